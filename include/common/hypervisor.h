@@ -53,5 +53,59 @@ struct vmtag {
 #define IOCTL_VIRTIO_MMIO_DEINIT	0xf00e
 #define IOCTL_REQUEST_VIRQ		0xf00f
 #define IOCTL_CREATE_HOST_VDEV		0xf010
+#define IOCTL_CREATE_IOEVENT		0xf011
+#define IOCTL_REGISTER_IOEVENT		0xf012
+#define IOCTL_CREATE_VIRQ_DOORBELL	0xf013
+#define IOCTL_KICK_VIRQ_DOORBELL	0xf014
+#define IOCTL_CREATE_VCPU_STATS		0xf015
+
+/*
+ * ioevent doorbell page shared between the hypervisor
+ * and the mvm, when the guest write a registered value
+ * to a registered address, the hypervisor set the related
+ * pending bit and send the ioevent virq to vm0 only when
+ * the kicked flag is not set, the mvm clear the kicked
+ * flag before it handle the pending bits
+ */
+#define VM_MAX_IOEVENTS			(128)
+
+struct ioevent_doorbell {
+	volatile uint32_t kicked;
+	volatile uint32_t reserved;
+	volatile uint32_t pending[VM_MAX_IOEVENTS / 32];
+};
+
+/*
+ * virq doorbell page shared between the hypervisor and
+ * the mvm, the mvm set the pending bit of the virq and
+ * only kick the hypervisor when the kicked flag is not
+ * set, then the hypervisor inject all the pending virqs
+ * to the guest vm in one hypercall
+ */
+#define VM_MAX_DOORBELL_VIRQS		(128)
+
+struct virq_doorbell {
+	volatile uint32_t kicked;
+	volatile uint32_t reserved;
+	volatile uint32_t pending[VM_MAX_DOORBELL_VIRQS / 32];
+};
+
+/*
+ * exit statistics of each vcpu, shared with the vm0, the
+ * histograms are log2 buckets of the CNTPCT ticks which
+ * used to handle the exit or the mmio trap, the wfi/wfe
+ * exits which block the vcpu are in the block_hist
+ */
+#define VCPU_STAT_EC_NR		64
+#define VCPU_STAT_HIST_NR	32
+
+struct vcpu_stats {
+	uint64_t exits;
+	uint64_t mmio_traps;
+	uint64_t ec_count[VCPU_STAT_EC_NR];
+	uint64_t exit_hist[VCPU_STAT_HIST_NR];
+	uint64_t mmio_hist[VCPU_STAT_HIST_NR];
+	uint64_t block_hist[VCPU_STAT_HIST_NR];
+};
 
 #endif
@@ -26,10 +26,14 @@
  * $FreeBSD$
  */
 
+#define LOG_SUBSYS	LOG_SUB_BLK
+
 #include <sys/param.h>
 #include <sys/queue.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
 #include <linux/fs.h>
 #include <errno.h>
 #include <assert.h>
@@ -42,9 +46,16 @@
 #include <signal.h>
 #include <unistd.h>
 #include <inttypes.h>
+#include <debug.h>
+#include <vm.h>
 #include <block_if.h>
 #include <ahci.h>
 
+#ifdef __NR_io_uring_setup
+#include <linux/io_uring.h>
+#define BLOCKIF_HAS_IO_URING
+#endif
+
 #define MAXCOMLEN	19
 
 /*
@@ -64,12 +75,17 @@
 #define BLOCKIF_NUMTHR	8
 #define BLOCKIF_MAXREQ	(64 + BLOCKIF_NUMTHR)
 
+#define BLOCKIF_URING_ENTRIES	256
+
+#ifndef RWF_DSYNC
+#define RWF_DSYNC	0x00000002
+#endif
+
 /*
  * Debug printf
  */
-static int block_if_debug;
-#define DPRINTF(params) do { if (block_if_debug) printf params; } while (0)
-#define WPRINTF(params) (printf params)
+#define DPRINTF(params) pr_debug params
+#define WPRINTF(params) pr_warn params
 
 enum blockop {
 	BOP_READ,
@@ -78,6 +94,11 @@ enum blockop {
 	BOP_DELETE
 };
 
+enum blockengine {
+	BENGINE_THREAD,
+	BENGINE_IO_URING
+};
+
 enum blockstat {
 	BST_FREE,
 	BST_BLOCK,
@@ -122,6 +143,10 @@ struct blockif_ctxt {
 
 	/* write cache enable */
 	uint8_t			wce;
+
+	/* io_uring engine, the thread pool is not used */
+	enum blockengine	engine;
+	struct blockif_uring	*uring;
 };
 
 static pthread_once_t blockif_once = PTHREAD_ONCE_INIT;
@@ -376,12 +401,19 @@ blockif_thr(void *arg)
 
 	pthread_mutex_lock(&bc->mtx);
 	for (;;) {
+		/*
+		 * the completion virqs of all the requests handled
+		 * in this round are injected by one doorbell kick
+		 */
+		virq_batch_begin();
 		while (blockif_dequeue(bc, t, &be)) {
 			pthread_mutex_unlock(&bc->mtx);
 			blockif_proc(bc, be, buf);
 			pthread_mutex_lock(&bc->mtx);
 			blockif_complete(bc, be);
 		}
+		virq_batch_end();
+
 		/* Check ctxt status here to see if exit requested */
 		if (bc->closing)
 			break;
@@ -429,6 +461,356 @@ blockif_init(void)
 	signal(SIGCONT, blockif_sigcont_handler);
 }
 
+#ifdef BLOCKIF_HAS_IO_URING
+/*
+ * io_uring engine, the guest iovecs are submitted to the
+ * kernel directly, the requests which are queued in one
+ * notify pass of the frontend are submitted by one
+ * io_uring_enter() and all the completions are reaped in
+ * one thread
+ */
+struct blockif_uring {
+	int			fd;
+	unsigned		entries;
+	unsigned		*sq_head;
+	unsigned		*sq_tail;
+	unsigned		*sq_mask;
+	unsigned		*sq_array;
+	unsigned		*cq_head;
+	unsigned		*cq_tail;
+	unsigned		*cq_mask;
+	struct io_uring_sqe	*sqes;
+	struct io_uring_cqe	*cqes;
+	void			*sq_ring;
+	size_t			sq_ring_sz;
+	void			*cq_ring;
+	size_t			cq_ring_sz;
+	size_t			sqes_sz;
+	unsigned		sq_pending;
+	unsigned		inflight;
+	int			plugged;
+	pthread_t		tid;
+};
+
+static int
+io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+	       unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, to_submit,
+			min_complete, flags, NULL, 0);
+}
+
+/* called with bc->mtx held */
+static void
+blockif_uring_submit(struct blockif_ctxt *bc)
+{
+	struct blockif_uring *ur = bc->uring;
+	int ret;
+
+	while (ur->sq_pending) {
+		ret = io_uring_enter(ur->fd, ur->sq_pending, 0, 0);
+		if (ret < 0) {
+			if (errno == EINTR || errno == EAGAIN)
+				continue;
+			WPRINTF(("blockif: io_uring submit failed %d\n",
+				 errno));
+			break;
+		}
+		ur->sq_pending -= ret;
+	}
+}
+
+/* called with bc->mtx held */
+static struct io_uring_sqe *
+blockif_uring_get_sqe(struct blockif_ctxt *bc)
+{
+	struct blockif_uring *ur = bc->uring;
+	struct io_uring_sqe *sqe;
+	unsigned tail, index;
+
+	if (ur->inflight >= ur->entries)
+		return NULL;
+
+	tail = *ur->sq_tail;
+	if (tail - __atomic_load_n(ur->sq_head, __ATOMIC_ACQUIRE) >=
+			ur->entries) {
+		blockif_uring_submit(bc);
+		if (tail - __atomic_load_n(ur->sq_head,
+				__ATOMIC_ACQUIRE) >= ur->entries)
+			return NULL;
+	}
+
+	index = tail & *ur->sq_mask;
+	sqe = &ur->sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ur->sq_array[index] = index;
+
+	return sqe;
+}
+
+/* called with bc->mtx held */
+static void
+blockif_uring_commit(struct blockif_ctxt *bc)
+{
+	struct blockif_uring *ur = bc->uring;
+
+	__atomic_store_n(ur->sq_tail, *ur->sq_tail + 1, __ATOMIC_RELEASE);
+	ur->sq_pending++;
+	ur->inflight++;
+
+	if (!ur->plugged)
+		blockif_uring_submit(bc);
+}
+
+static int
+blockif_uring_request(struct blockif_ctxt *bc, struct blockif_req *breq,
+		      enum blockop op)
+{
+	struct io_uring_sqe *sqe;
+
+	switch (op) {
+	case BOP_READ:
+	case BOP_WRITE:
+	case BOP_FLUSH:
+		break;
+	case BOP_DELETE:
+		/* only used by AHCI, and delete is not supported now */
+		(*breq->callback)(breq, EOPNOTSUPP);
+		return 0;
+	default:
+		return EINVAL;
+	}
+
+	if (op == BOP_WRITE && bc->rdonly) {
+		(*breq->callback)(breq, EROFS);
+		return 0;
+	}
+
+	pthread_mutex_lock(&bc->mtx);
+	sqe = blockif_uring_get_sqe(bc);
+	if (!sqe) {
+		pthread_mutex_unlock(&bc->mtx);
+		return E2BIG;
+	}
+
+	sqe->fd = bc->fd;
+	sqe->user_data = (uintptr_t)breq;
+	switch (op) {
+	case BOP_READ:
+		sqe->opcode = IORING_OP_READV;
+		break;
+	case BOP_WRITE:
+		sqe->opcode = IORING_OP_WRITEV;
+		/* writethru, same as fsync after each write */
+		if (!bc->wce)
+			sqe->rw_flags = RWF_DSYNC;
+		break;
+	default:
+		sqe->opcode = IORING_OP_FSYNC;
+		break;
+	}
+
+	if (op != BOP_FLUSH) {
+		sqe->addr = (uintptr_t)breq->iov;
+		sqe->len = breq->iovcnt;
+		sqe->off = breq->offset + bc->sub_file_start_lba;
+	}
+
+	blockif_uring_commit(bc);
+	pthread_mutex_unlock(&bc->mtx);
+
+	return 0;
+}
+
+static void *
+blockif_uring_thr(void *arg)
+{
+	struct blockif_ctxt *bc = arg;
+	struct blockif_uring *ur = bc->uring;
+	struct blockif_req *br;
+	struct io_uring_cqe *cqe;
+	unsigned head, count;
+	int stop = 0, done = 0, err;
+
+	while (!done) {
+		if (io_uring_enter(ur->fd, 0, 1,
+				IORING_ENTER_GETEVENTS) < 0) {
+			if (errno == EINTR)
+				continue;
+			WPRINTF(("blockif: io_uring wait failed %d\n", errno));
+			break;
+		}
+
+		count = 0;
+		head = *ur->cq_head;
+
+		/* inject the completion virqs by one doorbell kick */
+		virq_batch_begin();
+		while (head != __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE)) {
+			cqe = &ur->cqes[head & *ur->cq_mask];
+			br = (struct blockif_req *)(uintptr_t)cqe->user_data;
+			if (br) {
+				err = 0;
+				if (cqe->res < 0)
+					err = -cqe->res;
+				else
+					br->resid -= cqe->res;
+				(*br->callback)(br, err);
+			} else {
+				/* the nop sent by blockif_close */
+				stop = 1;
+			}
+
+			head++;
+			count++;
+			__atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+		}
+		virq_batch_end();
+
+		pthread_mutex_lock(&bc->mtx);
+		ur->inflight -= count;
+		done = stop && (ur->inflight == 0);
+		pthread_mutex_unlock(&bc->mtx);
+	}
+
+	pthread_exit(NULL);
+	return NULL;
+}
+
+static void
+blockif_uring_free(struct blockif_uring *ur)
+{
+	if (ur->sqes)
+		munmap(ur->sqes, ur->sqes_sz);
+	if (ur->cq_ring)
+		munmap(ur->cq_ring, ur->cq_ring_sz);
+	if (ur->sq_ring)
+		munmap(ur->sq_ring, ur->sq_ring_sz);
+	close(ur->fd);
+	free(ur);
+}
+
+static int
+blockif_uring_setup(struct blockif_ctxt *bc, const char *ident)
+{
+	char tname[MAXCOMLEN + 1];
+	struct io_uring_params p;
+	struct blockif_uring *ur;
+	void *ptr;
+
+	ur = calloc(1, sizeof(struct blockif_uring));
+	if (!ur)
+		return -ENOMEM;
+
+	memset(&p, 0, sizeof(p));
+	ur->fd = io_uring_setup(BLOCKIF_URING_ENTRIES, &p);
+	if (ur->fd < 0) {
+		free(ur);
+		return -errno;
+	}
+
+	ur->entries = p.sq_entries;
+	ur->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	ur->cq_ring_sz = p.cq_off.cqes +
+			p.cq_entries * sizeof(struct io_uring_cqe);
+	ur->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+	ptr = mmap(NULL, ur->sq_ring_sz, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+	if (ptr == MAP_FAILED)
+		goto err;
+	ur->sq_ring = ptr;
+	ur->sq_head = ptr + p.sq_off.head;
+	ur->sq_tail = ptr + p.sq_off.tail;
+	ur->sq_mask = ptr + p.sq_off.ring_mask;
+	ur->sq_array = ptr + p.sq_off.array;
+
+	ptr = mmap(NULL, ur->cq_ring_sz, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_CQ_RING);
+	if (ptr == MAP_FAILED)
+		goto err;
+	ur->cq_ring = ptr;
+	ur->cq_head = ptr + p.cq_off.head;
+	ur->cq_tail = ptr + p.cq_off.tail;
+	ur->cq_mask = ptr + p.cq_off.ring_mask;
+	ur->cqes = ptr + p.cq_off.cqes;
+
+	ptr = mmap(NULL, ur->sqes_sz, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+	if (ptr == MAP_FAILED)
+		goto err;
+	ur->sqes = ptr;
+
+	bc->uring = ur;
+	if (pthread_create(&ur->tid, NULL, blockif_uring_thr, bc)) {
+		bc->uring = NULL;
+		goto err;
+	}
+
+	snprintf(tname, sizeof(tname), "blk-%s-uring", ident);
+	pthread_setname_np(ur->tid, tname);
+
+	return 0;
+err:
+	blockif_uring_free(ur);
+	return -ENOMEM;
+}
+
+static void
+blockif_uring_close(struct blockif_ctxt *bc)
+{
+	struct blockif_uring *ur = bc->uring;
+	struct io_uring_sqe *sqe;
+	void *jval;
+
+	/* send a nop to stop the completion thread */
+	pthread_mutex_lock(&bc->mtx);
+	while ((sqe = blockif_uring_get_sqe(bc)) == NULL) {
+		pthread_mutex_unlock(&bc->mtx);
+		usleep(1000);
+		pthread_mutex_lock(&bc->mtx);
+	}
+	sqe->opcode = IORING_OP_NOP;
+	sqe->user_data = 0;
+	ur->plugged = 0;
+	blockif_uring_commit(bc);
+	pthread_mutex_unlock(&bc->mtx);
+
+	pthread_join(ur->tid, &jval);
+	bc->uring = NULL;
+	blockif_uring_free(ur);
+}
+#else
+static int
+blockif_uring_setup(struct blockif_ctxt *bc, const char *ident)
+{
+	return -ENOSYS;
+}
+
+static int
+blockif_uring_request(struct blockif_ctxt *bc, struct blockif_req *breq,
+		      enum blockop op)
+{
+	return ENOSYS;
+}
+
+static void
+blockif_uring_submit(struct blockif_ctxt *bc)
+{
+}
+
+static void
+blockif_uring_close(struct blockif_ctxt *bc)
+{
+}
+#endif
+
 /*
  * This function checks if the sub file range, specified by sub_start and
  * sub_size, has any overlap with other sub file ranges with write access.
@@ -476,18 +858,55 @@ sub_file_unlock(struct blockif_ctxt *bc)
 }
 
 
+static void
+blockif_start(struct blockif_ctxt *bc, enum blockengine engine,
+		const char *ident)
+{
+	char tname[MAXCOMLEN + 1];
+	int i, err_code;
+
+	pthread_mutex_init(&bc->mtx, NULL);
+	pthread_cond_init(&bc->cond, NULL);
+	TAILQ_INIT(&bc->freeq);
+	TAILQ_INIT(&bc->pendq);
+	TAILQ_INIT(&bc->busyq);
+	for (i = 0; i < BLOCKIF_MAXREQ; i++) {
+		bc->reqs[i].status = BST_FREE;
+		TAILQ_INSERT_HEAD(&bc->freeq, &bc->reqs[i], link);
+	}
+
+	/* fall back to the thread pool if io_uring is not supported */
+	if (engine == BENGINE_IO_URING) {
+		err_code = blockif_uring_setup(bc, ident);
+		if (err_code == 0) {
+			bc->engine = BENGINE_IO_URING;
+			return;
+		}
+
+		WPRINTF(("blockif: io_uring not available %d, "
+			 "using threads\n", err_code));
+	}
+
+	bc->engine = BENGINE_THREAD;
+	for (i = 0; i < BLOCKIF_NUMTHR; i++) {
+		pthread_create(&bc->btid[i], NULL, blockif_thr, bc);
+		snprintf(tname, sizeof(tname), "blk-%s-%d", ident, i);
+		pthread_setname_np(bc->btid[i], tname);
+	}
+}
+
 struct blockif_ctxt *
 blockif_open(const char *optstr, const char *ident)
 {
-	char tname[MAXCOMLEN + 1];
 	/* char name[MAXPATHLEN]; */
 	char *nopt, *xopts, *cp;
 	struct blockif_ctxt *bc;
 	struct stat sbuf;
 	/* struct diocgattr_arg arg; */
 	off_t size, psectsz, psectoff;
-	int fd, i, sectsz;
+	int fd, sectsz;
 	int writeback, ro, candelete, geom, ssopt, pssopt;
+	enum blockengine engine;
 	long sz;
 	long long b;
 	int err_code = -1;
@@ -501,8 +920,13 @@ blockif_open(const char *optstr, const char *ident)
 	ro = 0;
 	sub_file_assign = 0;
 
-	/* writethru is on by default */
-	writeback = 0;
+	/*
+	 * writeback is on by default, the data is only flushed
+	 * when the guest send a flush request, use "writethru"
+	 * to fsync after each write
+	 */
+	writeback = 1;
+	engine = BENGINE_THREAD;
 
 	/*
 	 * The first element in the optstring is always a pathname.
@@ -523,6 +947,12 @@ blockif_open(const char *optstr, const char *ident)
 			writeback = 0;
 		else if (!strcmp(cp, "ro"))
 			ro = 1;
+		else if (!strcmp(cp, "aio=io_uring"))
+			engine = BENGINE_IO_URING;
+		else if (!strcmp(cp, "aio=threads"))
+			engine = BENGINE_THREAD;
+		else if (!strncmp(cp, "poll=", 5))
+			;	/* handled by the virtio block */
 		else if (sscanf(cp, "sectorsize=%d/%d", &ssopt, &pssopt) == 2)
 			;
 		else if (sscanf(cp, "sectorsize=%d", &ssopt) == 1)
@@ -669,21 +1099,7 @@ blockif_open(const char *optstr, const char *ident)
 	bc->psectsz = psectsz;
 	bc->psectoff = psectoff;
 	bc->wce = writeback;
-	pthread_mutex_init(&bc->mtx, NULL);
-	pthread_cond_init(&bc->cond, NULL);
-	TAILQ_INIT(&bc->freeq);
-	TAILQ_INIT(&bc->pendq);
-	TAILQ_INIT(&bc->busyq);
-	for (i = 0; i < BLOCKIF_MAXREQ; i++) {
-		bc->reqs[i].status = BST_FREE;
-		TAILQ_INSERT_HEAD(&bc->freeq, &bc->reqs[i], link);
-	}
-
-	for (i = 0; i < BLOCKIF_NUMTHR; i++) {
-		pthread_create(&bc->btid[i], NULL, blockif_thr, bc);
-		snprintf(tname, sizeof(tname), "blk-%s-%d", ident, i);
-		pthread_setname_np(bc->btid[i], tname);
-	}
+	blockif_start(bc, engine, ident);
 
 	return bc;
 err:
@@ -692,12 +1108,59 @@ err:
 	return NULL;
 }
 
+/*
+ * create another context on the same backing file which has its
+ * own request queues and i/o threads (or io_uring), used by the
+ * multi-queue devices so each queue can submit without sharing
+ * the lock with others. the file lock of the sub file is owned
+ * by the original context
+ */
+struct blockif_ctxt *
+blockif_clone(struct blockif_ctxt *obc, const char *ident)
+{
+	struct blockif_ctxt *bc;
+
+	assert(obc->magic == BLOCKIF_SIG);
+
+	bc = calloc(1, sizeof(struct blockif_ctxt));
+	if (bc == NULL) {
+		perror("calloc");
+		return NULL;
+	}
+
+	bc->fd = dup(obc->fd);
+	if (bc->fd < 0) {
+		warn("Could not dup backing file");
+		free(bc);
+		return NULL;
+	}
+
+	bc->magic = BLOCKIF_SIG;
+	bc->isblk = obc->isblk;
+	bc->isgeom = obc->isgeom;
+	bc->candelete = obc->candelete;
+	bc->rdonly = obc->rdonly;
+	bc->size = obc->size;
+	bc->sub_file_assign = 0;
+	bc->sub_file_start_lba = obc->sub_file_start_lba;
+	bc->sectsz = obc->sectsz;
+	bc->psectsz = obc->psectsz;
+	bc->psectoff = obc->psectoff;
+	bc->wce = obc->wce;
+	blockif_start(bc, obc->engine, ident);
+
+	return bc;
+}
+
 static int
 blockif_request(struct blockif_ctxt *bc, struct blockif_req *breq,
 		enum blockop op)
 {
 	int err;
 
+	if (bc->engine == BENGINE_IO_URING)
+		return blockif_uring_request(bc, breq, op);
+
 	err = 0;
 
 	pthread_mutex_lock(&bc->mtx);
@@ -750,6 +1213,37 @@ blockif_delete(struct blockif_ctxt *bc, struct blockif_req *breq)
 	return blockif_request(bc, breq, BOP_DELETE);
 }
 
+/*
+ * the requests queued between blockif_plug() and blockif_unplug()
+ * are submitted together, only used by the io_uring engine
+ */
+void
+blockif_plug(struct blockif_ctxt *bc)
+{
+	assert(bc->magic == BLOCKIF_SIG);
+
+	if (bc->engine != BENGINE_IO_URING)
+		return;
+
+	pthread_mutex_lock(&bc->mtx);
+	bc->uring->plugged++;
+	pthread_mutex_unlock(&bc->mtx);
+}
+
+void
+blockif_unplug(struct blockif_ctxt *bc)
+{
+	assert(bc->magic == BLOCKIF_SIG);
+
+	if (bc->engine != BENGINE_IO_URING)
+		return;
+
+	pthread_mutex_lock(&bc->mtx);
+	if (--bc->uring->plugged == 0)
+		blockif_uring_submit(bc);
+	pthread_mutex_unlock(&bc->mtx);
+}
+
 int
 blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 {
@@ -757,6 +1251,13 @@ blockif_cancel(struct blockif_ctxt *bc, struct blockif_req *breq)
 
 	assert(bc->magic == BLOCKIF_SIG);
 
+	/*
+	 * the request submitted to io_uring can not be taken
+	 * back, the caller need to wait for the callback
+	 */
+	if (bc->engine == BENGINE_IO_URING)
+		return -EBUSY;
+
 	pthread_mutex_lock(&bc->mtx);
 	/*
 	 * Check pending requests.
@@ -836,6 +1337,11 @@ blockif_close(struct blockif_ctxt *bc)
 	assert(bc->magic == BLOCKIF_SIG);
 	sub_file_unlock(bc);
 
+	if (bc->engine == BENGINE_IO_URING) {
+		blockif_uring_close(bc);
+		goto out;
+	}
+
 	/*
 	 * Stop the block i/o thread
 	 */
@@ -847,7 +1353,7 @@ blockif_close(struct blockif_ctxt *bc)
 		pthread_join(bc->btid[i], &jval);
 
 	/* XXX Cancel queued i/o's ??? */
-
+out:
 	/*
 	 * Release resources
 	 */
@@ -936,6 +1442,10 @@ int
 blockif_queuesz(struct blockif_ctxt *bc)
 {
 	assert(bc->magic == BLOCKIF_SIG);
+#ifdef BLOCKIF_HAS_IO_URING
+	if (bc->engine == BENGINE_IO_URING)
+		return (bc->uring->entries - 1);
+#endif
 	return (BLOCKIF_MAXREQ - 1);
 }
 
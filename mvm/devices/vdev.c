@@ -38,8 +38,16 @@
 #include <libfdt/libfdt.h>
 #include <common/gvm.h>
 
+struct vdev_ioevent {
+	struct vdev *vdev;
+	unsigned long value;
+	ioevent_handler_t handler;
+	void *data;
+};
+
 static int vdev_irq_base;
 static int vdev_irq_count;
+static struct vdev_ioevent vdev_ioevents[VM_MAX_IOEVENTS];
 
 void *vdev_map_iomem(void *base, size_t size)
 {
@@ -60,6 +68,68 @@ void vdev_send_irq(struct vdev *vdev)
 	send_virq_to_vm(vdev->gvm_irq);
 }
 
+int vdev_register_ioevent(struct vdev *vdev, unsigned long addr,
+		unsigned long value, ioevent_handler_t handler, void *data)
+{
+	int index;
+	struct vdev_ioevent *ioevent;
+	uint64_t args[2] = {addr, value};
+
+	if (!vdev->vm->ioevent_db)
+		return -ENOENT;
+
+	index = ioctl(vdev->vm->vm_fd, IOCTL_REGISTER_IOEVENT, args);
+	if ((index < 0) || (index >= VM_MAX_IOEVENTS)) {
+		pr_warn("register ioevent 0x%lx failed\n", addr);
+		return -ENOSPC;
+	}
+
+	ioevent = &vdev_ioevents[index];
+	ioevent->vdev = vdev;
+	ioevent->value = value;
+	ioevent->handler = handler;
+	ioevent->data = data;
+
+	return 0;
+}
+
+static void vdev_handle_ioevent(int index)
+{
+	struct vdev_ioevent *ioevent = &vdev_ioevents[index];
+
+	if (!ioevent->handler) {
+		pr_err("no handler for ioevent %d\n", index);
+		return;
+	}
+
+	pthread_mutex_lock(&ioevent->vdev->lock);
+	ioevent->handler(ioevent->vdev, ioevent->value, ioevent->data);
+	pthread_mutex_unlock(&ioevent->vdev->lock);
+}
+
+void vdev_handle_ioevents(struct vm *vm)
+{
+	int i, bit;
+	uint32_t pending;
+	struct ioevent_doorbell *db = vm->ioevent_db;
+
+	/*
+	 * clear the kicked flag first, the notify which
+	 * comes after this will send a new virq
+	 */
+	__atomic_exchange_n(&db->kicked, 0, __ATOMIC_ACQ_REL);
+
+	for (i = 0; i < VM_MAX_IOEVENTS / 32; i++) {
+		pending = __atomic_exchange_n(&db->pending[i],
+				0, __ATOMIC_ACQ_REL);
+		while (pending) {
+			bit = __builtin_ctz(pending);
+			pending &= pending - 1;
+			vdev_handle_ioevent(i * 32 + bit);
+		}
+	}
+}
+
 static struct vdev_ops *get_vdev_ops(char *class)
 {
 	struct vdev_ops *ops;
@@ -168,6 +238,56 @@ int vdev_alloc_and_request_irq(struct vm *vm, int nr)
 	return __vdev_alloc_and_request_irq(vm, nr, 1);
 }
 
+static int vdev_add_to_index(struct vm *vm, struct vdev *vdev)
+{
+	int i;
+	struct vdev **index;
+
+	/*
+	 * the vdevs are created before the vcpu threads
+	 * start, so no need to lock the index here
+	 */
+	index = realloc(vm->vdev_index,
+			(vm->nr_vdevs + 1) * sizeof(struct vdev *));
+	if (!index)
+		return -ENOMEM;
+
+	for (i = vm->nr_vdevs; i > 0; i--) {
+		if (index[i - 1]->guest_iomem <= vdev->guest_iomem)
+			break;
+		index[i] = index[i - 1];
+	}
+
+	index[i] = vdev;
+	vm->vdev_index = index;
+	vm->nr_vdevs++;
+
+	return 0;
+}
+
+struct vdev *vdev_find_mmio(struct vm *vm, unsigned long addr)
+{
+	int l = 0, r = vm->nr_vdevs - 1, m;
+	struct vdev *vdev;
+
+	while (l <= r) {
+		m = (l + r) / 2;
+		if ((unsigned long)vm->vdev_index[m]->guest_iomem <= addr)
+			l = m + 1;
+		else
+			r = m - 1;
+	}
+
+	if (r < 0)
+		return NULL;
+
+	vdev = vm->vdev_index[r];
+	if (addr < (unsigned long)vdev->guest_iomem + vdev->iomem_size)
+		return vdev;
+
+	return NULL;
+}
+
 int create_vdev(struct vm *vm, char *class, char *args)
 {
 	struct vdev *vdev;
@@ -178,6 +298,10 @@ int create_vdev(struct vm *vm, char *class, char *args)
 
 	list_add_tail(&vm->vdev_list, &vdev->list);
 
+	/* vdev without mmio region do not need to be indexed */
+	if (vdev->iomem_size)
+		return vdev_add_to_index(vm, vdev);
+
 	return 0;
 }
 
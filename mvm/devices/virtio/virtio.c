@@ -30,6 +30,7 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#define LOG_SUBSYS	LOG_SUB_VIRTIO
 
 #include <mvm.h>
 #include <virtio.h>
@@ -37,10 +38,17 @@
 #include <barrier.h>
 #include <common/gvm.h>
 
+#define VIRTQ_POLL_MIN_NS	(2000)
+#define VIRTQ_POLL_MAX_US	(1000 * 1000)
+
+static __LIST_HEAD(virtio_device_list);
 static int virtio_devices_nr;
 static void *virtio_iomem_base;
 static int virtio_device_index;
 
+static void virtio_queue_ioevent(struct vdev *vdev,
+		unsigned long value, void *data);
+
 static void *hv_virtio_mmio_init(struct vm *vm, void *gbase)
 {
 	int ret = 0;
@@ -101,16 +109,34 @@ static inline int next_desc(struct vring_desc *desc)
 	return (!(desc->flags & VRING_DESC_F_NEXT)) ? -1 : desc->next;
 }
 
-static void translate_desc(struct vring_desc *desc, int index,
+static int translate_addr(uint64_t addr, uint32_t len, int index,
 		struct iovec *iov, int iov_size)
 {
+	void *base;
+
 	if (index >= iov_size) {
 		pr_err("index %d out of iov range %d\n", index, iov_size);
-		return;
+		return -ENOMEM;
 	}
 
-	iov[index].iov_len = desc->len;
-	iov[index].iov_base = (void *)gpa_to_hvm_va(desc->addr);
+	/* the buffer must be inside the memory of the guest */
+	base = gpa_to_hva(addr, len);
+	if (!base) {
+		pr_err_ratelimited("invalid buffer 0x%"PRIx64" 0x%x\n",
+				addr, len);
+		return -EFAULT;
+	}
+
+	iov[index].iov_len = len;
+	iov[index].iov_base = base;
+
+	return 0;
+}
+
+static inline int translate_desc(struct vring_desc *desc, int index,
+		struct iovec *iov, int iov_size)
+{
+	return translate_addr(desc->addr, desc->len, index, iov, iov_size);
 }
 
 static int get_indirect_buf(struct vring_desc *desc, int index,
@@ -120,6 +146,7 @@ static int get_indirect_buf(struct vring_desc *desc, int index,
 	struct vring_desc *in_desc, *vd;
 	unsigned int nr_in, old_index = index;
 	unsigned int next = 0;
+	int ret;
 
 	nr_in = desc->len / 16;
 	if ((desc->len & 0xf) || nr_in == 0) {
@@ -127,27 +154,39 @@ static int get_indirect_buf(struct vring_desc *desc, int index,
 		return -EINVAL;
 	}
 
-	in_desc = (struct vring_desc *)gpa_to_hvm_va(desc->addr);
+	in_desc = gpa_to_hva(desc->addr, desc->len);
+	if (!in_desc) {
+		pr_err("invalid indirect table 0x%"PRIx64"\n", desc->addr);
+		return -EFAULT;
+	}
 
 	for (;;) {
+		if (index - old_index >= nr_in) {
+			pr_err("loop in the indirect desc\n");
+			return -EINVAL;
+		}
+
 		vd = &in_desc[next];
 		if (vd->flags & VRING_DESC_F_INDIRECT) {
 			pr_err("invalid desc in indirect desc\n");
 			return -EINVAL;
 		}
 
-		translate_desc(vd, index, iov, iov_size);
-		if (desc->flags & VRING_DESC_F_WRITE)
+		if (!(vd->flags & VRING_DESC_F_WRITE) && *in) {
+			pr_err("readable desc after writable desc\n");
+			return -EINVAL;
+		}
+
+		ret = translate_desc(vd, index, iov, iov_size);
+		if (ret)
+			return ret;
+
+		if (vd->flags & VRING_DESC_F_WRITE)
 			*in += 1;
 		else
 			*out += 1;
 
 		index++;
-		if (index >= iov_size) {
-			pr_err("%d out of ivo size\n", index);
-			return -ENOMEM;
-		}
-
 		next = next_desc(vd);
 		if (next == -1)
 			break;
@@ -161,6 +200,317 @@ static int get_indirect_buf(struct vring_desc *desc, int index,
 	return (index - old_index);
 }
 
+/*
+ * the indirect table of the packed ring do not have the next
+ * field, all the descs in the table belong to the buffer
+ */
+static int get_packed_indirect_buf(struct vring_packed_desc *desc,
+		int index, struct iovec *iov, int iov_size,
+		unsigned int *in, unsigned int *out)
+{
+	struct vring_packed_desc *in_desc, *vd;
+	unsigned int i, nr_in;
+	int ret;
+
+	nr_in = desc->len / sizeof(struct vring_packed_desc);
+	if ((desc->len & 0xf) || nr_in == 0) {
+		pr_err("invalid indirect len 0x%x\n", desc->len);
+		return -EINVAL;
+	}
+
+	if (index + nr_in > iov_size) {
+		pr_err("%d out of ivo size\n", index + nr_in);
+		return -ENOMEM;
+	}
+
+	in_desc = gpa_to_hva(desc->addr, desc->len);
+	if (!in_desc) {
+		pr_err("invalid indirect table 0x%"PRIx64"\n", desc->addr);
+		return -EFAULT;
+	}
+
+	for (i = 0; i < nr_in; i++) {
+		vd = &in_desc[i];
+		if (vd->flags & VRING_DESC_F_INDIRECT) {
+			pr_err("invalid desc in indirect desc\n");
+			return -EINVAL;
+		}
+
+		if (!(vd->flags & VRING_DESC_F_WRITE) && *in) {
+			pr_err("readable desc after writable desc\n");
+			return -EINVAL;
+		}
+
+		ret = translate_addr(vd->addr, vd->len,
+				index + i, iov, iov_size);
+		if (ret)
+			return ret;
+
+		if (vd->flags & VRING_DESC_F_WRITE)
+			*in += 1;
+		else
+			*out += 1;
+	}
+
+	return nr_in;
+}
+
+static int virtq_enable_notify_packed(struct virt_queue *vq)
+{
+	struct vring_packed_desc_event *event = vq->device_event;
+
+	if (!(vq->used_flags & VRING_USED_F_NO_NOTIFY))
+		return 0;
+
+	vq->used_flags &= ~VRING_USED_F_NO_NOTIFY;
+	if (!virtq_has_feature(vq, VIRTIO_RING_F_EVENT_IDX))
+		event->flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+	else {
+		event->off_wrap = vq->last_avail_idx |
+			(vq->avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR);
+		wmb();
+		event->flags = VRING_PACKED_EVENT_FLAG_DESC;
+	}
+
+	mb();
+
+	return virtq_has_descs(vq);
+}
+
+static void virtq_disable_notify_packed(struct virt_queue *vq)
+{
+	if (vq->used_flags & VRING_USED_F_NO_NOTIFY)
+		return;
+
+	vq->used_flags |= VRING_USED_F_NO_NOTIFY;
+	vq->device_event->flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+	mb();
+}
+
+static int virtq_get_descs_packed(struct virt_queue *vq,
+		struct iovec *iov, unsigned int iov_size,
+		unsigned int *in_num, unsigned int *out_num)
+{
+	struct vring_packed_desc *desc;
+	uint16_t idx = vq->last_avail_idx;
+	uint16_t wrap = vq->avail_wrap_counter;
+	unsigned int count = 0, id = 0;
+	int iov_index = 0, ret;
+
+	desc = &vq->pdesc[idx];
+	if (!vring_packed_desc_avail(desc->flags, wrap))
+		return vq->num;
+
+	/* the flags must be read before the other fields */
+	rmb();
+
+	*in_num = *out_num = 0;
+
+	for (;;) {
+		if (count >= vq->num) {
+			pr_err("packed desc chain out of range %d\n", count);
+			return -EINVAL;
+		}
+
+		if (iov_index >= iov_size) {
+			pr_err("iov count out of iov range %d\n", iov_size);
+			return -ENOMEM;
+		}
+
+		/* the indirect desc can not have the next flag */
+		if ((desc->flags & VRING_DESC_F_INDIRECT) &&
+				(desc->flags & VRING_DESC_F_NEXT)) {
+			pr_err("invalid packed indirect desc\n");
+			return -EINVAL;
+		}
+
+		if (desc->flags & VRING_DESC_F_INDIRECT) {
+			ret = get_packed_indirect_buf(desc, iov_index, iov,
+					iov_size, in_num, out_num);
+			if (ret < 0) {
+				pr_err("failed to get indirect buf\n");
+				return ret;
+			}
+
+			iov_index += ret;
+		} else {
+			if (!(desc->flags & VRING_DESC_F_WRITE) &&
+					*in_num) {
+				pr_err("readable desc after writable desc\n");
+				return -EINVAL;
+			}
+
+			ret = translate_addr(desc->addr, desc->len,
+					iov_index, iov, iov_size);
+			if (ret)
+				return ret;
+
+			if (desc->flags & VRING_DESC_F_WRITE)
+				*in_num += 1;
+			else
+				*out_num += 1;
+			iov_index++;
+		}
+
+		/* the buffer id is in the last desc of the chain */
+		id = desc->id;
+		count++;
+
+		if (++idx >= vq->num) {
+			idx = 0;
+			wrap ^= 1;
+		}
+
+		if (!(desc->flags & VRING_DESC_F_NEXT))
+			break;
+
+		desc = &vq->pdesc[idx];
+	}
+
+	if (id >= vq->num) {
+		pr_err("packed buffer id %d out of range\n", id);
+		return -EINVAL;
+	}
+
+	/*
+	 * remember how many descs this buffer used, the used
+	 * idx need skip them when the buffer is returned, and
+	 * the discard need rewind them
+	 */
+	vq->ndescs[id] = count;
+	vq->hist[vq->hist_idx] = count;
+	if (++vq->hist_idx >= vq->num)
+		vq->hist_idx = 0;
+
+	vq->last_avail_idx = idx;
+	vq->avail_wrap_counter = wrap;
+
+	return id;
+}
+
+static void virtq_discard_desc_packed(struct virt_queue *vq, int n)
+{
+	uint16_t count;
+
+	while (n-- > 0) {
+		vq->hist_idx = (vq->hist_idx ? vq->hist_idx : vq->num) - 1;
+		count = vq->hist[vq->hist_idx];
+
+		if (vq->last_avail_idx < count) {
+			vq->last_avail_idx += vq->num;
+			vq->avail_wrap_counter ^= 1;
+		}
+
+		vq->last_avail_idx -= count;
+	}
+}
+
+static inline void virtq_packed_next_used(struct virt_queue *vq,
+		uint16_t *idx, uint16_t *wrap, unsigned int id)
+{
+	*idx += vq->ndescs[id];
+	if (*idx >= vq->num) {
+		*idx -= vq->num;
+		*wrap ^= 1;
+	}
+}
+
+static int virtq_add_used_n_packed(struct virt_queue *vq,
+			struct vring_used_elem *heads,
+			unsigned int count)
+{
+	struct vring_packed_desc *desc;
+	uint16_t idx, wrap, flags;
+	unsigned int i, n;
+	int ret = 0;
+
+	/* write the id and len of all the used descs first */
+	idx = vq->last_used_idx;
+	wrap = vq->used_wrap_counter;
+	for (n = 0; n < count; n++) {
+		if (heads[n].id >= vq->num) {
+			pr_err("used buffer id %d out of range\n", heads[n].id);
+			ret = -EINVAL;
+			break;
+		}
+
+		desc = &vq->pdesc[idx];
+		desc->id = heads[n].id;
+		desc->len = heads[n].len;
+		virtq_packed_next_used(vq, &idx, &wrap, heads[n].id);
+	}
+
+	if (n == 0)
+		return ret;
+
+	wmb();
+
+	/*
+	 * then mark them as used, the flags of the first one is
+	 * updated at last, so the driver will see the whole batch
+	 * at once
+	 */
+	idx = vq->last_used_idx;
+	wrap = vq->used_wrap_counter;
+	for (i = 0; i < n; i++) {
+		flags = wrap ? (VRING_PACKED_DESC_F_AVAIL |
+				VRING_PACKED_DESC_F_USED) : 0;
+		if (i == 0)
+			desc = &vq->pdesc[idx];
+		else
+			vq->pdesc[idx].flags = flags;
+
+		virtq_packed_next_used(vq, &idx, &wrap, heads[i].id);
+	}
+
+	wmb();
+	desc->flags = vq->used_wrap_counter ? (VRING_PACKED_DESC_F_AVAIL |
+			VRING_PACKED_DESC_F_USED) : 0;
+
+	/* the signalled used idx is not comparable after wrap */
+	if (wrap != vq->used_wrap_counter)
+		vq->signalled_used_valid = 0;
+
+	vq->last_used_idx = idx;
+	vq->used_wrap_counter = wrap;
+
+	return ret;
+}
+
+static int virtq_need_notify_packed(struct virt_queue *vq)
+{
+	struct vring_packed_desc_event *event = vq->driver_event;
+	uint16_t old, new, off_wrap, off, flags;
+	int notify;
+
+	/* the used descs must be visible before read the event */
+	mb();
+
+	old = vq->signalled_used;
+	notify = vq->signalled_used_valid;
+	new = vq->signalled_used = vq->last_used_idx;
+	vq->signalled_used_valid = 1;
+
+	flags = event->flags;
+	if (flags == VRING_PACKED_EVENT_FLAG_DISABLE)
+		return 0;
+
+	if (flags == VRING_PACKED_EVENT_FLAG_ENABLE)
+		return 1;
+
+	if (!notify)
+		return 1;
+
+	rmb();
+	off_wrap = event->off_wrap;
+	off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+	if ((off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) !=
+			vq->used_wrap_counter)
+		off -= vq->num;
+
+	return virtq_need_event(off, new, old);
+}
+
 static void virtq_update_used_flags(struct virt_queue *vq)
 {
 	vq->used->flags = vq->used_flags;
@@ -177,6 +527,9 @@ int virtq_enable_notify(struct virt_queue *vq)
 {
 	uint16_t avail_idx;
 
+	if (vq->packed)
+		return virtq_enable_notify_packed(vq);
+
 	if (!(vq->used_flags & VRING_USED_F_NO_NOTIFY))
 		return 0;
 
@@ -194,15 +547,103 @@ int virtq_enable_notify(struct virt_queue *vq)
 /* tell the guest do not notify again */
 void virtq_disable_notify(struct virt_queue *vq)
 {
+	if (vq->packed) {
+		virtq_disable_notify_packed(vq);
+		return;
+	}
+
 	if (vq->used_flags & VRING_USED_F_NO_NOTIFY)
 		return;
 
 	vq->used_flags |= VRING_USED_F_NO_NOTIFY;
-	if (virtq_has_feature(vq, VIRTIO_RING_F_EVENT_IDX))
+	if (!virtq_has_feature(vq, VIRTIO_RING_F_EVENT_IDX))
 		virtq_update_used_flags(vq);
 }
 
-int virtq_get_descs(struct virt_queue *vq,
+static inline uint64_t virtq_poll_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * called by the backend when the virt queue is empty and the
+ * notify is still disabled, busy poll the avail ring for the
+ * budget, return 1 if new buffers come
+ */
+int virtq_poll(struct virt_queue *vq)
+{
+	uint64_t start;
+
+	if (!vq->poll_max_ns)
+		return 0;
+
+	start = virtq_poll_time();
+	do {
+		if (virtq_has_descs(vq)) {
+			vq->poll_hits++;
+			vq->poll_ns = (vq->poll_ns * 2 > vq->poll_max_ns) ?
+				vq->poll_max_ns : vq->poll_ns * 2;
+			return 1;
+		}
+	} while (virtq_poll_time() - start < vq->poll_ns);
+
+	vq->poll_misses++;
+	vq->poll_ns = (vq->poll_ns / 2 < VIRTQ_POLL_MIN_NS) ?
+		VIRTQ_POLL_MIN_NS : vq->poll_ns / 2;
+	if (vq->poll_ns > vq->poll_max_ns)
+		vq->poll_ns = vq->poll_max_ns;
+
+	return 0;
+}
+
+void virtio_set_poll(struct virtio_device *dev, int us)
+{
+	struct virt_queue *vq;
+	int i;
+
+	/* the budget is kept in ns, 1s is more than enough */
+	if (us < 0)
+		us = 0;
+	else if (us > VIRTQ_POLL_MAX_US)
+		us = VIRTQ_POLL_MAX_US;
+
+	for (i = 0; i < dev->nr_vq; i++) {
+		vq = &dev->vqs[i];
+		vq->poll_max_ns = (uint32_t)us * 1000;
+		vq->poll_ns = vq->poll_max_ns;
+	}
+
+	if (us)
+		pr_info("%s poll the virt queues for %dus\n",
+				dev->vdev->name, us);
+}
+
+void virtio_dump_stats(void)
+{
+	struct virtio_device *dev;
+	struct virt_queue *vq;
+	int i;
+
+	list_for_each_entry(dev, &virtio_device_list, list) {
+		for (i = 0; i < dev->nr_vq; i++) {
+			vq = &dev->vqs[i];
+			if (!vq->ready)
+				continue;
+
+			pr_info("%s vq-%d kicks:%"PRIu64" avoided:%"PRIu64
+				" miss:%"PRIu64" budget:%uns\n",
+				dev->vdev->name, i, vq->kicks,
+				vq->poll_hits, vq->poll_misses,
+				vq->poll_ns);
+		}
+	}
+}
+
+static int virtq_get_descs_split(struct virt_queue *vq,
 		struct iovec *iov, unsigned int iov_size,
 		unsigned int *in_num, unsigned int *out_num)
 {
@@ -264,7 +705,15 @@ int virtq_get_descs(struct virt_queue *vq,
 			continue;
 		}
 
-		translate_desc(desc, iov_index, iov, iov_size);
+		if (!(desc->flags & VRING_DESC_F_WRITE) && *in_num) {
+			pr_err("readable desc after writable desc\n");
+			return -EINVAL;
+		}
+
+		ret = translate_desc(desc, iov_index, iov, iov_size);
+		if (ret)
+			return ret;
+
 		if (desc->flags & VRING_DESC_F_WRITE)
 			*in_num += 1;
 		else
@@ -277,9 +726,62 @@ int virtq_get_descs(struct virt_queue *vq,
 	return head;
 }
 
+/*
+ * the guest gave a buffer which can not be handled, the
+ * avail idx is not moved so the buffer will be fetched
+ * again and again, stop the device and tell the driver
+ * it need to reset the device
+ */
+static void virtio_set_needs_reset(struct virtio_device *dev)
+{
+	uint32_t *status;
+
+	if (dev->broken)
+		return;
+
+	dev->broken = 1;
+	wmb();
+
+	pr_err("%s is broken, need reset\n", dev->vdev->name);
+	status = dev->vdev->iomem + VIRTIO_MMIO_STATUS;
+	__atomic_fetch_or(status, VIRTIO_DEV_NEEDS_RESET, __ATOMIC_SEQ_CST);
+	virtio_send_irq(dev, VIRTIO_MMIO_INT_CONFIG);
+}
+
+/*
+ * return the head of the buffer, vq->num if there is no
+ * buffer, or a negative errno if the buffer is invalid,
+ * then the device is marked as need reset and no more
+ * buffer will be returned until it is reset
+ */
+int virtq_get_descs(struct virt_queue *vq,
+		struct iovec *iov, unsigned int iov_size,
+		unsigned int *in_num, unsigned int *out_num)
+{
+	int ret;
+
+	if (vq->dev->broken)
+		return vq->num;
+
+	if (vq->packed)
+		ret = virtq_get_descs_packed(vq, iov, iov_size,
+				in_num, out_num);
+	else
+		ret = virtq_get_descs_split(vq, iov, iov_size,
+				in_num, out_num);
+
+	if (ret < 0)
+		virtio_set_needs_reset(vq->dev);
+
+	return ret;
+}
+
 void virtq_discard_desc(struct virt_queue *vq, int n)
 {
-	vq->last_avail_idx -= n;
+	if (vq->packed)
+		virtq_discard_desc_packed(vq, n);
+	else
+		vq->last_avail_idx -= n;
 	wmb();
 }
 
@@ -317,6 +819,9 @@ int virtq_add_used_n(struct virt_queue *vq,
 {
 	int start, n, r;
 
+	if (vq->packed)
+		return virtq_add_used_n_packed(vq, heads, count);
+
 	start = vq->last_used_idx & (vq->num - 1);
 	n = vq->num - start;
 	if (n < count) {
@@ -351,6 +856,9 @@ static int virtq_need_notify(struct virt_queue *vq)
 	uint16_t event, flags;
 	int notify;
 
+	if (vq->packed)
+		return virtq_need_notify_packed(vq);
+
 	if (virtq_has_feature(vq, VIRTIO_F_NOTIFY_ON_EMPTY) &&
 			(vq->avail_idx == vq->last_avail_idx))
 		return 1;
@@ -436,12 +944,26 @@ static void inline virtq_reset(struct virt_queue *vq)
 	vq->used_flags = 0;
 	vq->signalled_used = 0;
 	vq->signalled_used_valid = 0;
+	vq->packed = 0;
+	vq->pdesc = NULL;
+	vq->driver_event = NULL;
+	vq->device_event = NULL;
+	vq->avail_wrap_counter = 1;
+	vq->used_wrap_counter = 1;
+	vq->hist_idx = 0;
 }
 
 int virtio_device_reset(struct virtio_device *dev)
 {
 	int i;
 
+	if (dev->broken) {
+		__atomic_fetch_and((uint32_t *)(dev->vdev->iomem +
+				VIRTIO_MMIO_STATUS), ~VIRTIO_DEV_NEEDS_RESET,
+				__ATOMIC_SEQ_CST);
+		dev->broken = 0;
+	}
+
 	for (i = 0; i < dev->nr_vq; i++) {
 		if (dev->ops && dev->ops->vq_reset)
 			dev->ops->vq_reset(&dev->vqs[i]);
@@ -457,6 +979,11 @@ void virtio_device_deinit(struct virtio_device *virt_dev)
 	int i;
 	struct virt_queue *vq;
 
+	if (virt_dev->list.next) {
+		list_del(&virt_dev->list);
+		virt_dev->list.next = NULL;
+	}
+
 	for (i = 0; i < virt_dev->nr_vq; i++) {
 		vq = &virt_dev->vqs[i];
 		if (virt_dev->ops && virt_dev->ops->vq_deinit)
@@ -464,6 +991,10 @@ void virtio_device_deinit(struct virtio_device *virt_dev)
 
 		if (vq->iovec)
 			free(vq->iovec);
+		if (vq->ndescs)
+			free(vq->ndescs);
+		if (vq->hist)
+			free(vq->hist);
 	}
 
 	if (virt_dev->vqs)
@@ -480,7 +1011,7 @@ int virtio_device_init(struct virtio_device *virt_dev, struct vdev *vdev,
 	if (!virt_dev || !vdev)
 		return -EINVAL;
 
-	if ((type == 0) || (type > 18) ||
+	if ((type == 0) || (type > VIRTIO_TYPE_VSOCK) ||
 			((type > 9) && (type < 18))) {
 		pr_err("unsupport virtio device type %d\n", type);
 		return -EINVAL;
@@ -526,8 +1057,35 @@ int virtio_device_init(struct virtio_device *virt_dev, struct vdev *vdev,
 		}
 
 		vq->iovec_size = iov_size;
+
+		/* used to track the buffers of the packed ring */
+		vq->ndescs = malloc(sizeof(uint16_t) * rs);
+		vq->hist = malloc(sizeof(uint16_t) * rs);
+		if (!vq->ndescs || !vq->hist) {
+			pr_err("failed to get memory for vq %d\n", i);
+			ret = -ENOMEM;
+			goto release_virtio_dev;
+		}
 	}
 
+	/*
+	 * the packed ring is transparent to the backend
+	 * drivers, so all the virtio devices can support it
+	 */
+	virtio_set_feature(virt_dev, VIRTIO_F_RING_PACKED);
+
+	/*
+	 * the queue notify can be handled in the hypervisor
+	 * directly, if the hypervisor do not support it the
+	 * notify will still be trapped by the vmcs
+	 */
+	for (i = 0; i < queue_nr; i++)
+		vdev_register_ioevent(vdev, (unsigned long)gbase +
+				VIRTIO_MMIO_QUEUE_NOTIFY, i,
+				virtio_queue_ioevent, virt_dev);
+
+	list_add_tail(&virtio_device_list, &virt_dev->list);
+
 	return 0;
 
 release_virtio_dev:
@@ -572,7 +1130,7 @@ static int virtio_queue_event(struct virtio_device *dev, uint32_t arg)
 {
 	struct virt_queue *queue;
 
-	if (arg > dev->nr_vq) {
+	if (arg >= dev->nr_vq) {
 		pr_err("receive unvaild virt queue event %d\n", arg);
 		return -EINVAL;
 	}
@@ -588,6 +1146,8 @@ static int virtio_queue_event(struct virtio_device *dev, uint32_t arg)
 		return -EPERM;
 	}
 
+	queue->kicks++;
+
 	if (queue->callback)
 		queue->callback(queue);
 	else
@@ -596,10 +1156,18 @@ static int virtio_queue_event(struct virtio_device *dev, uint32_t arg)
 	return 0;
 }
 
+static void virtio_queue_ioevent(struct vdev *vdev,
+		unsigned long value, void *data)
+{
+	virtio_queue_event((struct virtio_device *)data, (uint32_t)value);
+}
+
 static int virtio_buffer_event(struct virtio_device *dev, uint32_t arg)
 {
 	struct virt_queue *vq;
 	void *iomem = dev->vdev->iomem;
+	void *desc, *avail, *used;
+	size_t desc_size, avail_size, used_size;
 	uint32_t high, low;
 
 	if (arg >= dev->nr_vq) {
@@ -613,30 +1181,76 @@ static int virtio_buffer_event(struct virtio_device *dev, uint32_t arg)
 	vq->dev = dev;
 	vq->num = ioread32(iomem + VIRTIO_MMIO_QUEUE_NUM);
 
+	if (!vq->num || vq->num > ioread32(iomem +
+				VIRTIO_MMIO_QUEUE_NUM_MAX)) {
+		pr_err("invaild virt queue size %d\n", vq->num);
+		return -EINVAL;
+	}
+
+	/*
+	 * the layout of the ring is decided by the features
+	 * which the driver acked, each device can use the
+	 * packed ring or the split ring
+	 */
+	vq->packed = !!(dev->acked_features &
+			(1UL << VIRTIO_F_RING_PACKED));
+	if (vq->packed) {
+		desc_size = sizeof(struct vring_packed_desc) * vq->num;
+		avail_size = sizeof(struct vring_packed_desc_event);
+		used_size = sizeof(struct vring_packed_desc_event);
+	} else {
+		desc_size = sizeof(struct vring_desc) * vq->num;
+		avail_size = sizeof(uint16_t) * (3 + vq->num);
+		used_size = sizeof(uint16_t) * 3 +
+			sizeof(struct vring_used_elem) * vq->num;
+	}
+
+	/*
+	 * translate the rings only once when the queue is
+	 * ready, and make sure they are inside the guest memory
+	 */
 	high = ioread32(iomem + VIRTIO_MMIO_QUEUE_DESC_HIGH);
 	low = ioread32(iomem + VIRTIO_MMIO_QUEUE_DESC_LOW);
-	vq->desc = (struct vring_desc *)u32_to_u64(high, low);
+	desc = gpa_to_hva(u32_to_u64(high, low), desc_size);
 
+	/* the driver area */
 	high = ioread32(iomem + VIRTIO_MMIO_QUEUE_AVAIL_HIGH);
 	low = ioread32(iomem + VIRTIO_MMIO_QUEUE_AVAIL_LOW);
-	vq->avail = (struct vring_avail *)u32_to_u64(high, low);
+	avail = gpa_to_hva(u32_to_u64(high, low), avail_size);
 
+	/* the device area */
 	high = ioread32(iomem + VIRTIO_MMIO_QUEUE_USED_HIGH);
 	low = ioread32(iomem + VIRTIO_MMIO_QUEUE_USED_LOW);
-	vq->used = (struct vring_used *)u32_to_u64(high, low);
+	used = gpa_to_hva(u32_to_u64(high, low), used_size);
 
-	vq->desc = (struct vring_desc *)
-		gpa_to_hvm_va((unsigned long)vq->desc);
-	vq->avail = (struct vring_avail *)
-		gpa_to_hvm_va((unsigned long)vq->avail);
-	vq->used = (struct vring_used *)
-		gpa_to_hvm_va((unsigned long)vq->used);
+	if (!desc || !avail || !used) {
+		pr_err("virt queue %d is out of guest memory\n", arg);
+		vq->packed = 0;
+		return -EFAULT;
+	}
+
+	if (vq->packed) {
+		vq->pdesc = (struct vring_packed_desc *)desc;
+		vq->driver_event = (struct vring_packed_desc_event *)avail;
+		vq->device_event = (struct vring_packed_desc_event *)used;
+		vq->desc = NULL;
+		vq->avail = NULL;
+		vq->used = NULL;
+	} else {
+		vq->desc = (struct vring_desc *)desc;
+		vq->avail = (struct vring_avail *)avail;
+		vq->used = (struct vring_used *)used;
+	}
 
 	vq->last_avail_idx = 0;
 	vq->avail_idx = 0;
 	vq->last_used_idx = 0;
+	vq->used_flags = 0;
 	vq->signalled_used = 0;
 	vq->signalled_used_valid = 0;
+	vq->avail_wrap_counter = 1;
+	vq->used_wrap_counter = 1;
+	vq->hist_idx = 0;
 	vq->ready = 1;
 
 	if (dev->ops && dev->ops->vq_init)
@@ -675,6 +1289,11 @@ static int virtio_mmio_write(struct virtio_device *dev,
 		break;
 
 	default:
+		/* write to the device specific config space */
+		if ((offset >= VIRTIO_MMIO_CONFIG) && dev->ops &&
+				dev->ops->cfg_write)
+			dev->ops->cfg_write(dev,
+					offset - VIRTIO_MMIO_CONFIG, arg);
 		break;
 	}
 
@@ -26,6 +26,8 @@
  * $FreeBSD$
  */
 
+#define LOG_SUBSYS	LOG_SUB_BLK
+
 #include <sys/param.h>
 #include <errno.h>
 #include <stdio.h>
@@ -37,9 +39,11 @@
 #include <virtio.h>
 #include <block_if.h>
 #include <compiler.h>
+#include <stddef.h>
 
 #define VIRTIO_BLK_RINGSZ	64
 #define VIRTIO_BLK_IOVSZ	64
+#define VIRTIO_BLK_MAX_QUEUES	8
 
 #define VIRTIO_BLK_S_OK		0
 #define VIRTIO_BLK_S_IOERR	1
@@ -55,6 +59,7 @@
 
 /* Device can toggle its cache between writeback and writethrough modes */
 #define	VIRTIO_BLK_F_CONFIG_WCE	(11)
+#define	VIRTIO_BLK_F_MQ		(12)	/* support more than one vq */
 
 /*
  * Config space "registers"
@@ -76,6 +81,8 @@ struct virtio_blk_config {
 		uint32_t opt_io_size;
 	} topology;
 	uint8_t	writeback;
+	uint8_t unused0;
+	uint16_t num_queues;
 } __attribute__((packed));
 
 /*
@@ -96,20 +103,43 @@ struct virtio_blk_hdr {
 struct virtio_blk_ioreq {
 	struct blockif_req req;
 	struct virtio_blk *blk;
+	struct virtio_blk_queue *queue;
 	uint8_t *status;
 	uint16_t idx;
 };
 
+/*
+ * each virt queue has its own lock and blockif context, so
+ * the queues do not contend with each other when submit and
+ * complete the requests
+ */
+struct virtio_blk_queue {
+	pthread_mutex_t mtx;
+	struct virt_queue *vq;
+	struct blockif_ctxt *bc;
+	struct virtio_blk_ioreq ios[VIRTIO_BLK_RINGSZ];
+
+	/*
+	 * when the busy poll is enabled, the queue is handled
+	 * by its own poll thread, then the polling will not
+	 * block the notify of the other devices of the vm
+	 */
+	pthread_t poll_tid;
+	pthread_cond_t poll_cond;
+	int poll_thread;
+	int poll_kicked;
+	int poll_closing;
+};
+
 /*
  * Per-device struct
  */
 struct virtio_blk {
 	struct virtio_device virtio_dev;
-	pthread_mutex_t mtx;
 	struct virtio_blk_config *cfg;
-	struct blockif_ctxt *bc;
+	int nr_queues;
+	struct virtio_blk_queue *queues;
 	char ident[VIRTIO_BLK_BLK_ID_BYTES + 1];
-	struct virtio_blk_ioreq ios[VIRTIO_BLK_RINGSZ];
 	uint8_t original_wce;
 };
 
@@ -123,10 +153,7 @@ static void
 virtio_blk_done(struct blockif_req *br, int err)
 {
 	struct virtio_blk_ioreq *io = br->param;
-	struct virtio_blk *blk = io->blk;
-	struct virt_queue *vq;
-
-	vq = &blk->virtio_dev.vqs[0];
+	struct virtio_blk_queue *queue = io->queue;
 
 	/* convert errno into a virtio block error return */
 	if (err == EOPNOTSUPP || err == ENOSYS)
@@ -140,68 +167,96 @@ virtio_blk_done(struct blockif_req *br, int err)
 	 * Return the descriptor back to the host.
 	 * We wrote 1 byte (our status) to host.
 	 */
-	pthread_mutex_lock(&blk->mtx);
-	virtq_add_used_and_signal(vq, io->idx, 1);
-	pthread_mutex_unlock(&blk->mtx);
+	pthread_mutex_lock(&queue->mtx);
+	virtq_add_used_and_signal(queue->vq, io->idx, 1);
+	pthread_mutex_unlock(&queue->mtx);
+}
+
+/*
+ * the request can not be handled, return the buffer to the
+ * guest with an error if there is a status byte
+ */
+static void
+virtio_blk_reject(struct virtio_blk_queue *queue, uint16_t idx,
+		struct iovec *status)
+{
+	uint32_t len = 0;
+
+	if (status && status->iov_len >= 1) {
+		*(uint8_t *)status->iov_base = VIRTIO_BLK_S_IOERR;
+		len = 1;
+	}
+
+	pthread_mutex_lock(&queue->mtx);
+	virtq_add_used_and_signal(queue->vq, idx, len);
+	pthread_mutex_unlock(&queue->mtx);
 }
 
 static void
-virtio_blk_proc(struct virtio_blk *blk,
-		struct virt_queue *vq, uint16_t idx, int n)
+virtio_blk_proc(struct virtio_blk *blk, struct virtio_blk_queue *queue,
+		uint16_t idx, int in, int out)
 {
 	struct virtio_blk_hdr *vbh;
 	struct virtio_blk_ioreq *io;
-	int i;
+	int i, n = in + out;
 	int err;
 	ssize_t iolen;
 	int __unused writeop, type;
-	struct iovec *iov = vq->iovec;
+	struct iovec *iov = queue->vq->iovec;
 
 	/*
 	 * The first descriptor will be the read-only fixed header,
-	 * and the last is for status (hence +2 above and below).
-	 * The remaining iov's are the actual data I/O vectors.
+	 * and the last is the device writable status byte. The
+	 * remaining iov's are the actual data I/O vectors, they are
+	 * read-only for write and writable for read and ident.
+	 *
+	 * the device readable descs are always before the writable
+	 * ones, so iov[0, out) is read-only and iov[out, n) writable,
+	 * the indirect table of linux guest has the same layout
 	 *
 	 * XXX - note - this fails on crash dump, which does a
 	 * VIRTIO_BLK_T_FLUSH with a zero transfer length
 	 */
-	if (n < 2 || n > BLOCKIF_IOV_MAX + 2) {
-		pr_err("wrong desc value\n");
+	if (out < 1 || in < 1 || n > BLOCKIF_IOV_MAX + 2) {
+		pr_err("wrong desc value in:%d out:%d\n", in, out);
+		virtio_blk_reject(queue, idx, in ? &iov[n - 1] : NULL);
 		return;
 	}
 
-	io = &blk->ios[idx];
-	if (iov[0].iov_len != sizeof(struct virtio_blk_hdr)) {
+	if (iov[0].iov_len != sizeof(struct virtio_blk_hdr) ||
+			iov[n - 1].iov_len != 1) {
 		pr_err("wrong size of virtio_blk_hdr %ld %ld\n",
 				iov[0].iov_len, sizeof(struct virtio_blk_hdr));
+		virtio_blk_reject(queue, idx, &iov[n - 1]);
 		return;
 	}
 
-	vbh = iov[0].iov_base;
-	memcpy(&io->req.iov, &iov[1], sizeof(struct iovec) * (n - 2));
-	io->req.iovcnt = n - 2;
-	io->req.offset = vbh->sector * DEV_BSIZE;
-	io->status = iov[--n].iov_base;
-	assert(iov[n].iov_len == 1);
-
 	/*
 	 * XXX
 	 * The guest should not be setting the BARRIER flag because
 	 * we don't advertise the capability.
 	 */
+	vbh = iov[0].iov_base;
 	type = vbh->type & ~VBH_FLAG_BARRIER;
 	writeop = (type == VBH_OP_WRITE);
 
+	/* the data must be on the right side of the status */
+	if ((writeop && in != 1) || ((type == VBH_OP_READ ||
+			type == VBH_OP_IDENT) && out != 1)) {
+		pr_err("wrong data direction for op %d\n", type);
+		virtio_blk_reject(queue, idx, &iov[n - 1]);
+		return;
+	}
+
+	io = &queue->ios[idx];
+	memcpy(&io->req.iov, &iov[1], sizeof(struct iovec) * (n - 2));
+	io->req.iovcnt = n - 2;
+	io->req.offset = vbh->sector * DEV_BSIZE;
+	io->status = iov[--n].iov_base;
+
 	iolen = 0;
-	for (i = 1; i < n; i++) {
-		/*
-		 * - write op implies read-only descriptor,
-		 * - read/ident op implies write-only descriptor,
-		 * therefore test the inverse of the descriptor bit
-		 * to the op.
-		 */
+	for (i = 1; i < n; i++)
 		iolen += iov[i].iov_len;
-	}
 	io->req.resid = iolen;
 
 	DBG("virtio-block: %s op, %zd bytes, %d segs, offset %ld\n\r",
@@ -210,16 +265,21 @@ virtio_blk_proc(struct virtio_blk *blk,
 
 	switch (type) {
 	case VBH_OP_READ:
-		err = blockif_read(blk->bc, &io->req);
+		err = blockif_read(queue->bc, &io->req);
 		break;
 	case VBH_OP_WRITE:
-		err = blockif_write(blk->bc, &io->req);
+		err = blockif_write(queue->bc, &io->req);
 		break;
 	case VBH_OP_FLUSH:
 	case VBH_OP_FLUSH_OUT:
-		err = blockif_flush(blk->bc, &io->req);
+		err = blockif_flush(queue->bc, &io->req);
 		break;
 	case VBH_OP_IDENT:
+		if (n < 2) {
+			virtio_blk_done(&io->req, EINVAL);
+			return;
+		}
+
 		/* Assume a single buffer */
 		/* S/n equal to buffer is not zero-terminated. */
 		memset(iov[1].iov_base, 0, iov[1].iov_len);
@@ -235,22 +295,34 @@ virtio_blk_proc(struct virtio_blk *blk,
 }
 
 static void
-virtio_blk_notify(struct virt_queue *vq)
+virtio_blk_proc_queue(struct virtio_blk *blk, struct virtio_blk_queue *queue)
 {
-	int idx;
+	int idx, polled;
 	unsigned int in, out;
-	struct virtio_blk *blk;
+	struct virt_queue *vq = queue->vq;
 
-	blk = virtio_dev_to_blk(vq->dev);
 	virtq_disable_notify(vq);
 
-	while (virtq_has_descs(vq)) {
+	/* submit all the requests of this pass together */
+	blockif_plug(queue->bc);
+
+	for (;;) {
 		idx = virtq_get_descs(vq, vq->iovec,
 				vq->iovec_size, &in, &out);
 		if (idx < 0)
-			return;
+			break;
 
 		if (idx == vq->num) {
+			/*
+			 * submit the requests before polling, the
+			 * notify is kept disabled during the polling
+			 */
+			blockif_unplug(queue->bc);
+			polled = virtq_poll(vq);
+			blockif_plug(queue->bc);
+			if (polled)
+				continue;
+
 			if (virtq_enable_notify(vq)) {
 				virtq_disable_notify(vq);
 				continue;
@@ -258,29 +330,266 @@ virtio_blk_notify(struct virt_queue *vq)
 			break;
 		}
 
-		if (in) {
-			pr_err("unexpected description from guest");
-			return;
-		}
+		virtio_blk_proc(blk, queue, idx, in, out);
+	}
+
+	blockif_unplug(queue->bc);
+}
+
+static void *
+virtio_blk_poll_thread(void *param)
+{
+	struct virtio_blk_queue *queue = param;
+	struct virtio_blk *blk = queue->ios[0].blk;
+
+	pthread_mutex_lock(&queue->mtx);
+
+	for (;;) {
+		while (!queue->poll_kicked && !queue->poll_closing)
+			pthread_cond_wait(&queue->poll_cond, &queue->mtx);
+
+		if (queue->poll_closing)
+			break;
+
+		/* the completion also need the lock */
+		queue->poll_kicked = 0;
+		pthread_mutex_unlock(&queue->mtx);
+		virtio_blk_proc_queue(blk, queue);
+		pthread_mutex_lock(&queue->mtx);
+	}
+
+	pthread_mutex_unlock(&queue->mtx);
+
+	return NULL;
+}
+
+static void
+virtio_blk_notify(struct virt_queue *vq)
+{
+	struct virtio_blk *blk;
+	struct virtio_blk_queue *queue;
+
+	blk = virtio_dev_to_blk(vq->dev);
+	queue = &blk->queues[vq->vq_index];
 
-		virtio_blk_proc(blk, vq, idx, out);
+	if (!queue->poll_thread) {
+		virtio_blk_proc_queue(blk, queue);
+		return;
 	}
+
+	/* let the poll thread of the queue to handle it */
+	pthread_mutex_lock(&queue->mtx);
+	virtq_disable_notify(vq);
+	queue->poll_kicked = 1;
+	pthread_cond_signal(&queue->poll_cond);
+	pthread_mutex_unlock(&queue->mtx);
 }
 
 static int vblk_init_vq(struct virt_queue *vq)
 {
-	if (vq->vq_index == 0)
-		vq->callback = virtio_blk_notify;
-	else
-		pr_err("virtio block only have one vq");
+	struct virtio_blk *blk = virtio_dev_to_blk(vq->dev);
+
+	if (vq->vq_index >= blk->nr_queues) {
+		pr_err("virtio block vq %d not exist\n", vq->vq_index);
+		return -EINVAL;
+	}
+
+	vq->callback = virtio_blk_notify;
 
 	return 0;
 }
 
+static void vblk_set_wce(struct virtio_blk *blk, uint8_t wce)
+{
+	int i;
+
+	blk->cfg->writeback = wce;
+	for (i = 0; i < blk->nr_queues; i++)
+		blockif_set_wce(blk->queues[i].bc, wce);
+}
+
+/*
+ * the device must be write through if the driver did not
+ * accept VIRTIO_BLK_F_FLUSH since it will never send flush
+ */
+static void vblk_neg_features(struct virtio_device *dev)
+{
+	struct virtio_blk *blk = virtio_dev_to_blk(dev);
+
+	if (!(dev->acked_features & (1UL << VIRTIO_BLK_F_FLUSH)))
+		vblk_set_wce(blk, 0);
+	else if (!(dev->acked_features & (1UL << VIRTIO_BLK_F_CONFIG_WCE)))
+		vblk_set_wce(blk, blk->original_wce);
+}
+
+static void vblk_cfg_write(struct virtio_device *dev,
+		unsigned long offset, uint32_t value)
+{
+	struct virtio_blk *blk = virtio_dev_to_blk(dev);
+
+	if (offset != offsetof(struct virtio_blk_config, writeback)) {
+		pr_warn("virtio_blk: write to ro config 0x%lx\n", offset);
+		return;
+	}
+
+	if (!(dev->acked_features & (1UL << VIRTIO_BLK_F_CONFIG_WCE)))
+		return;
+
+	pr_info("virtio_blk: guest set cache to %s\n",
+			(value & 0xff) ? "writeback" : "writethrough");
+	vblk_set_wce(blk, !!(value & 0xff));
+}
+
 static struct virtio_ops vblk_ops = {
 	.vq_init = vblk_init_vq,
+	.neg_features = vblk_neg_features,
+	.cfg_write = vblk_cfg_write,
 };
 
+static void vblk_release_queues(struct virtio_blk *blk)
+{
+	struct virtio_blk_queue *queue;
+	int i;
+
+	for (i = 0; i < blk->nr_queues; i++) {
+		queue = &blk->queues[i];
+		if (!queue->bc)
+			continue;
+
+		if (queue->poll_thread) {
+			pthread_mutex_lock(&queue->mtx);
+			queue->poll_closing = 1;
+			pthread_cond_signal(&queue->poll_cond);
+			pthread_mutex_unlock(&queue->mtx);
+			pthread_join(queue->poll_tid, NULL);
+			pthread_cond_destroy(&queue->poll_cond);
+		}
+
+		if (blockif_flush_all(queue->bc))
+			pr_warn("virtio_blk: failed to flush queue %d\n", i);
+		blockif_close(queue->bc);
+		pthread_mutex_destroy(&queue->mtx);
+	}
+
+	free(blk->queues);
+	blk->queues = NULL;
+}
+
+/*
+ * one virt queue for each vcpu of the guest, the first queue
+ * use the blockif context which opened by the caller and the
+ * others use a clone of it
+ */
+static int vblk_init_queues(struct virtio_blk *blk,
+		struct blockif_ctxt *bctxt, int nr)
+{
+	struct virtio_blk_queue *queue;
+	struct virtio_blk_ioreq *io;
+	pthread_mutexattr_t attr;
+	char bident[16];
+	int i, j, rc;
+
+	blk->queues = calloc(nr, sizeof(struct virtio_blk_queue));
+	if (!blk->queues)
+		return -ENOMEM;
+
+	/* init mutex attribute properly to avoid deadlock */
+	rc = pthread_mutexattr_init(&attr);
+	if (rc)
+		pr_info("mutexattr init failed with erro %d!\n", rc);
+	rc = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	if (rc)
+		pr_info("virtio_blk: mutexattr_settype failed with "
+					"error %d!\n", rc);
+
+	blk->nr_queues = nr;
+	for (i = 0; i < nr; i++) {
+		queue = &blk->queues[i];
+		queue->vq = &blk->virtio_dev.vqs[i];
+
+		if (i == 0) {
+			queue->bc = bctxt;
+		} else {
+			snprintf(bident, sizeof(bident), "%d:%d",
+					blk->virtio_dev.vdev->id, i);
+			queue->bc = blockif_clone(bctxt, bident);
+			if (!queue->bc) {
+				pr_err("virtio_blk: failed to clone ctxt\n");
+				pthread_mutexattr_destroy(&attr);
+				return -ENOMEM;
+			}
+		}
+
+		rc = pthread_mutex_init(&queue->mtx, &attr);
+		if (rc)
+			pr_info("virtio_blk: pthread_mutex_init failed with "
+						"error %d!\n", rc);
+
+		for (j = 0; j < VIRTIO_BLK_RINGSZ; j++) {
+			io = &queue->ios[j];
+			io->req.callback = virtio_blk_done;
+			io->req.param = io;
+			io->blk = blk;
+			io->queue = queue;
+			io->idx = j;
+		}
+	}
+
+	pthread_mutexattr_destroy(&attr);
+
+	return 0;
+}
+
+static void vblk_start_poll(struct virtio_blk *blk)
+{
+	struct virtio_blk_queue *queue;
+	char tname[32];
+	int i;
+
+	for (i = 0; i < blk->nr_queues; i++) {
+		queue = &blk->queues[i];
+		if (!queue->vq->poll_max_ns)
+			continue;
+
+		pthread_cond_init(&queue->poll_cond, NULL);
+		if (pthread_create(&queue->poll_tid, NULL,
+				virtio_blk_poll_thread, queue)) {
+			pr_warn("virtio_blk: poll thread %d failed\n", i);
+			pthread_cond_destroy(&queue->poll_cond);
+			continue;
+		}
+
+		snprintf(tname, sizeof(tname), "vtblk-%d:%d poll",
+				blk->virtio_dev.vdev->id, i);
+		pthread_setname_np(queue->poll_tid, tname);
+		queue->poll_thread = 1;
+	}
+}
+
+/*
+ * the first option is the path of the image, and the
+ * others are handled by the blockif except "poll=<us>"
+ */
+static int vblk_parse_poll(char *opts)
+{
+	char *nopt, *xopts, *cp;
+	int us = 0;
+
+	nopt = xopts = strdup(opts);
+	if (!nopt)
+		return 0;
+
+	(void)strsep(&xopts, ",");
+	while ((cp = strsep(&xopts, ",")) != NULL) {
+		if (!strncmp(cp, "poll=", 5))
+			us = atoi(cp + 5);
+	}
+
+	free(nopt);
+
+	return us;
+}
+
 static int
 virtio_blk_init(struct vdev *vdev, char *opts)
 {
@@ -288,9 +597,8 @@ virtio_blk_init(struct vdev *vdev, char *opts)
 	struct blockif_ctxt *bctxt;
 	struct virtio_blk *blk;
 	off_t size;
-	int i, sectsz, sts, sto;
-	pthread_mutexattr_t attr;
-	int rc;
+	int sectsz, sts, sto;
+	int rc, nr_queues;
 
 	if (opts == NULL || opts[0] == 0) {
 		printf("virtio-block: backing device required\n");
@@ -300,7 +608,7 @@ virtio_blk_init(struct vdev *vdev, char *opts)
 	/*
 	 * The supplied backing file has to exist
 	 */
-	snprintf(bident, sizeof(bident), "%d:%d", 0, 0);
+	snprintf(bident, sizeof(bident), "%d:%d", vdev->id, 0);
 	bctxt = blockif_open(opts, bident);
 	if (bctxt == NULL) {
 		perror("Could not open backing file");
@@ -317,9 +625,15 @@ virtio_blk_init(struct vdev *vdev, char *opts)
 		return -1;
 	}
 
-	/* virtio blk only has 1 virt queue */
+	/* one virt queue for each vcpu */
+	nr_queues = vdev->vm->nr_vcpus;
+	if (nr_queues > VIRTIO_BLK_MAX_QUEUES)
+		nr_queues = VIRTIO_BLK_MAX_QUEUES;
+	else if (nr_queues <= 0)
+		nr_queues = 1;
+
 	rc = virtio_device_init(&blk->virtio_dev, vdev,
-			VIRTIO_TYPE_BLOCK, 1, VIRTIO_BLK_RINGSZ,
+			VIRTIO_TYPE_BLOCK, nr_queues, VIRTIO_BLK_RINGSZ,
 			VIRTIO_BLK_IOVSZ);
 	if (rc) {
 		pr_err("failed to init virtio blk device\n");
@@ -328,35 +642,19 @@ virtio_blk_init(struct vdev *vdev, char *opts)
 		return rc;
 	}
 
-	blk->bc = bctxt;
-	for (i = 0; i < VIRTIO_BLK_RINGSZ; i++) {
-		struct virtio_blk_ioreq *io = &blk->ios[i];
-
-		io->req.callback = virtio_blk_done;
-		io->req.param = io;
-		io->blk = blk;
-		io->idx = i;
+	rc = vblk_init_queues(blk, bctxt, nr_queues);
+	if (rc) {
+		pr_err("failed to init virtio blk queues\n");
+		vblk_release_queues(blk);
+		virtio_device_deinit(&blk->virtio_dev);
+		free(blk);
+		return rc;
 	}
 
 	vdev_set_pdata(vdev, blk);
 	blk->virtio_dev.ops = &vblk_ops;
 	blk->cfg = (struct virtio_blk_config *)blk->virtio_dev.config;
 
-
-	/* init mutex attribute properly to avoid deadlock */
-	rc = pthread_mutexattr_init(&attr);
-	if (rc)
-		pr_info("mutexattr init failed with erro %d!\n", rc);
-	rc = pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
-	if (rc)
-		pr_info("virtio_blk: mutexattr_settype failed with "
-					"error %d!\n", rc);
-
-	rc = pthread_mutex_init(&blk->mtx, &attr);
-	if (rc)
-		pr_info("virtio_blk: pthread_mutex_init failed with "
-					"error %d!\n", rc);
-
 	sprintf(blk->ident, "Minos--%02X%02X-%02X%02X-%02X%02X",
 			0, 1, 2, 3, 4, 5);
 
@@ -374,14 +672,20 @@ virtio_blk_init(struct vdev *vdev, char *opts)
 	    (sto != 0) ? ((sts - sto) / sectsz) : 0;
 	blk->cfg->topology.min_io_size = 0;
 	blk->cfg->topology.opt_io_size = 0;
-	blk->cfg->writeback = blockif_get_wce(blk->bc);
+	blk->cfg->writeback = blockif_get_wce(bctxt);
+	blk->cfg->num_queues = nr_queues;
 	blk->original_wce = blk->cfg->writeback; /* save for reset */
 
-	/* set the feature of the virtio block */
-	if (!!blk->cfg->writeback) {
-		virtio_set_feature(&blk->virtio_dev, VIRTIO_BLK_F_FLUSH);
-		virtio_set_feature(&blk->virtio_dev, VIRTIO_BLK_F_CONFIG_WCE);
-	}
+	/*
+	 * set the feature of the virtio block, the flush is always
+	 * supported, the cache mode is writeback by default and
+	 * the guest can change it by the config space
+	 */
+	virtio_set_feature(&blk->virtio_dev, VIRTIO_BLK_F_FLUSH);
+	virtio_set_feature(&blk->virtio_dev, VIRTIO_BLK_F_CONFIG_WCE);
+
+	if (nr_queues > 1)
+		virtio_set_feature(&blk->virtio_dev, VIRTIO_BLK_F_MQ);
 
 	virtio_set_feature(&blk->virtio_dev, VIRTIO_F_VERSION_1);
 	virtio_set_feature(&blk->virtio_dev, VIRTIO_BLK_F_SEG_MAX);
@@ -389,13 +693,17 @@ virtio_blk_init(struct vdev *vdev, char *opts)
 	virtio_set_feature(&blk->virtio_dev, VIRTIO_BLK_F_TOPOLOGY);
 	virtio_set_feature(&blk->virtio_dev,
 			VIRTIO_RING_F_INDIRECT_DESC);
+
+	/* busy poll the virt queues */
+	virtio_set_poll(&blk->virtio_dev, vblk_parse_poll(opts));
+	vblk_start_poll(blk);
+
 	return 0;
 }
 
 static void
 virtio_blk_deinit(struct vdev *vdev)
 {
-	struct blockif_ctxt *bctxt;
 	struct virtio_blk *blk;
 
 	blk = (struct virtio_blk *)vdev_get_pdata(vdev);
@@ -403,14 +711,9 @@ virtio_blk_deinit(struct vdev *vdev)
 		return;
 
 	pr_info("virtio_blk: deinit\n");
-	bctxt = blk->bc;
-	if (blockif_flush_all(bctxt)) {
-		pr_warn("vrito_blk:"
-			"Failed to flush before close\n");
-		blockif_close(bctxt);
-		virtio_device_deinit(&blk->virtio_dev);
-		free(blk);
-	}
+	vblk_release_queues(blk);
+	virtio_device_deinit(&blk->virtio_dev);
+	free(blk);
 }
 
 static int virtio_blk_event(struct vdev *vdev, int read,
@@ -439,7 +742,7 @@ static int virtio_blk_reset(struct vdev *vdev)
 
 	pr_info("virtio_blk: device reset requested !\n");
 	virtio_device_reset(&blk->virtio_dev);
-	blockif_set_wce(blk->bc, blk->original_wce);
+	vblk_set_wce(blk, blk->original_wce);
 
 	return 0;
 }
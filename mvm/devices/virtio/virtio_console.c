@@ -28,6 +28,8 @@
  * SUCH DAMAGE.
  */
 
+#define LOG_SUBSYS	LOG_SUB_CON
+
 #include <stdlib.h>
 #include <stdio.h>
 #include <termios.h>
@@ -52,6 +54,13 @@
 #define	VIRTIO_CONSOLE_MAXPORTS	16
 #define	VIRTIO_CONSOLE_MAXQ	(VIRTIO_CONSOLE_MAXPORTS * 2 + 2)
 
+/*
+ * the buffers of the guest are handled in batch, the tx buffers of
+ * one batch are written to the backend by one writev
+ */
+#define	VIRTIO_CONSOLE_BATCH	32
+#define	VIRTIO_CONSOLE_BATCH_IOVSZ	256
+
 #define	VIRTIO_CONSOLE_DEVICE_READY	0
 #define	VIRTIO_CONSOLE_DEVICE_ADD	1
 #define	VIRTIO_CONSOLE_DEVICE_REMOVE	2
@@ -310,7 +319,7 @@ virtio_console_control_send(struct virtio_console *console,
 {
 	struct virt_queue *vq;
 	struct iovec iov;
-	uint16_t idx;
+	int idx;
 	unsigned int in, out;
 
 	vq = virtio_console_port_to_vq(&console->control_port, true);
@@ -319,6 +328,14 @@ virtio_console_control_send(struct virtio_console *console,
 		return;
 
 	idx = virtq_get_descs(vq, &iov, 1, &in, &out);
+	if (idx < 0 || idx == vq->num)
+		return;
+
+	if (iov.iov_len < sizeof(struct virtio_console_control) + len) {
+		pr_err("control buffer too small %zu\n", iov.iov_len);
+		virtq_add_used_and_signal(vq, idx, 0);
+		return;
+	}
 
 	memcpy(iov.iov_base, ctrl, sizeof(struct virtio_console_control));
 	if (payload != NULL && len > 0)
@@ -334,16 +351,22 @@ virtio_console_notify_tx(struct virt_queue *vq)
 {
 	struct virtio_console *console;
 	struct virtio_console_port *port;
-	uint16_t idx;
+	struct vring_used_elem used[VIRTIO_CONSOLE_BATCH];
+	struct iovec iov[VIRTIO_CONSOLE_BATCH_IOVSZ];
+	int idx, niov = 0, nused = 0;
 	unsigned int in = 0, out = 0;
+	bool batch;
 
 	console = virtio_dev_to_console(vq->dev);
 	port = virtio_console_vq_to_port(console, vq);
 
+	/* the control messages must be handled one by one */
+	batch = (port != &console->control_port);
+
 	virtq_disable_notify(vq);
 
 	for (;;) {
-		idx = virtq_get_descs(vq, vq->iovec,
+		idx = virtq_get_descs(vq, iov + niov,
 				vq->iovec_size, &in, &out);
 		if (idx < 0)
 			break;
@@ -359,14 +382,38 @@ virtio_console_notify_tx(struct virt_queue *vq)
 
 		if (in) {
 			pr_err("unexpected description from guest\n");
+			virtq_discard_desc(vq, 1);
 			break;
 		}
 
-		if (port != NULL)
-			port->cb(port, port->arg, vq->iovec, out);
-
-		virtq_add_used_and_signal(vq, idx, 0);
+		used[nused].id = idx;
+		used[nused].len = 0;
+		nused++;
+
+		if (!batch) {
+			if (port != NULL)
+				port->cb(port, port->arg, iov, out);
+		} else
+			niov += out;
+
+		/* flush the batch if there is no room for next chain */
+		if ((nused == VIRTIO_CONSOLE_BATCH) ||
+				(niov + vq->iovec_size >
+				 VIRTIO_CONSOLE_BATCH_IOVSZ)) {
+			if (niov && port != NULL)
+				port->cb(port, port->arg, iov, niov);
+			virtq_add_used_n(vq, used, nused);
+			niov = nused = 0;
+		}
 	}
+
+	if (niov && port != NULL)
+		port->cb(port, port->arg, iov, niov);
+	if (nused)
+		virtq_add_used_n(vq, used, nused);
+
+	/* one interrupt for the whole batch */
+	virtq_notify(vq);
 }
 
 static void
@@ -413,10 +460,9 @@ virtio_console_backend_read(int fd __attribute__((unused)),
 	struct virtio_console_port *port;
 	struct virtio_console_backend *be = arg;
 	struct virt_queue *vq;
-	struct iovec iov;
+	struct vring_used_elem used[VIRTIO_CONSOLE_BATCH];
 	static char dummybuf[2048];
-	int len;
-	uint16_t idx;
+	int len, idx, nused = 0;
 	unsigned int in, out;
 
 	port = be->port;
@@ -440,10 +486,16 @@ virtio_console_backend_read(int fd __attribute__((unused)),
 	virtq_disable_notify(vq);
 
 	do {
-		idx = virtq_get_descs(vq, &iov, 1, &in, &out);
-		len = readv(be->fd, &iov, in);
+		idx = virtq_get_descs(vq, vq->iovec, vq->iovec_size,
+				&in, &out);
+		if (idx < 0 || idx == vq->num)
+			break;
+
+		len = readv(be->fd, vq->iovec, in);
 		if (len <= 0) {
 			virtq_discard_desc(vq, 1);
+			if (nused)
+				virtq_add_used_n(vq, used, nused);
 			virtq_notify(vq);
 
 			/* no data available */
@@ -456,9 +508,19 @@ virtio_console_backend_read(int fd __attribute__((unused)),
 			goto close;
 		}
 
-		virtq_add_used_and_signal(vq, idx, len);
+		/* publish the filled buffers in batch */
+		used[nused].id = idx;
+		used[nused].len = len;
+		if (++nused == VIRTIO_CONSOLE_BATCH) {
+			virtq_add_used_n(vq, used, nused);
+			nused = 0;
+		}
 	} while (virtq_has_descs(vq));
 
+	if (nused)
+		virtq_add_used_n(vq, used, nused);
+	virtq_notify(vq);
+
 	return;
 
 close:
@@ -661,7 +723,8 @@ virtio_console_add_backend(struct virtio_console *console,
 	if (virtio_console_backend_can_read(be_type)) {
 		if (isatty(fd)) {
 			be->evp = mevent_add(fd, EVF_READ,
-					virtio_console_backend_read, be);
+					virtio_console_backend_read, be,
+					console);
 			if (be->evp == NULL) {
 				pr_warn("vtcon: mevent_add failed\n");
 				error = -1;
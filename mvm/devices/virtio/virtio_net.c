@@ -26,6 +26,9 @@
  * $FreeBSD$
  */
 
+#define LOG_SUBSYS	LOG_SUB_NET
+
+#include <sys/param.h>
 #include <sys/uio.h>
 #include <net/ethernet.h>
 #ifndef NETMAP_WITH_LIBS
@@ -49,6 +52,12 @@
 #define VIRTIO_NET_RINGSZ	1024
 #define VIRTIO_NET_MAXSEGS	256
 
+/* max chains released to the used ring together in rx */
+#define VIRTIO_NET_RX_BATCH	64
+
+/* max size of a packet which the tap may send when gso is enabled */
+#define VIRTIO_NET_GSO_MAXLEN	(65535 + ETHER_HDR_LEN + 4)
+
 /*
  * Host capabilities.  Note that we only offer a few of these.
  */
@@ -70,6 +79,7 @@
 #define	VIRTIO_NET_F_CTRL_RX		(18) /* control channel RX mode support */
 #define	VIRTIO_NET_F_CTRL_VLAN		(19) /* control channel VLAN filtering */
 #define	VIRTIO_NET_F_GUEST_ANNOUN	(21) /* guest can send gratuitous pkts */
+#define	VIRTIO_NET_F_MQ			(22) /* multiple queue pairs */
 
 #define VIRTIO_NET_S_HOSTCAPS      \
 	(VIRTIO_NET_F_MAC | VIRTIO_NET_F_MRG_RXBUF | VIRTIO_NET_F_STATUS | \
@@ -84,16 +94,33 @@
 struct virtio_net_config {
 	uint8_t  mac[6];
 	uint16_t status;
+	uint16_t max_virtqueue_pairs;
 } __attribute__((packed));
 
 /*
- * Queue definitions.
+ * Queue definitions. the rx and tx queue of the pair n are
+ * 2n and 2n + 1, the control queue is after all the pairs
+ * if VIRTIO_NET_F_MQ is negotiated, otherwise it is 2
  */
 #define VIRTIO_NET_RXQ	0
 #define VIRTIO_NET_TXQ	1
-#define VIRTIO_NET_CTLQ	2	/* NB: not yet supported */
+#define VIRTIO_NET_CTLQ	2
 
-#define VIRTIO_NET_MAXQ	3
+#define VIRTIO_NET_MAX_PAIRS	8
+
+/*
+ * Control queue definitions
+ */
+struct virtio_net_ctrl_hdr {
+	uint8_t		class;
+	uint8_t		cmd;
+} __attribute__((packed));
+
+#define VIRTIO_NET_OK			0
+#define VIRTIO_NET_ERR			1
+
+#define VIRTIO_NET_CTRL_MQ		4
+#define VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET	0
 
 /*
  * Fixed network header size
@@ -108,19 +135,45 @@ struct virtio_net_rxhdr {
 	uint16_t	vrh_bufs;
 } __attribute__((packed));
 
+struct virtio_net;
+
+/*
+ * Per queue pair struct, each pair has its own tap queue,
+ * rx event and tx thread
+ */
+struct virtio_net_qpair {
+	struct virtio_net *net;
+	int		index;
+	int		tapfd;
+	int		attached;	/* tap queue is attached */
+	struct mevent	*mevp;
+	struct virt_queue *rxq;
+	struct virt_queue *txq;
+
+	int		rx_ready;
+	pthread_mutex_t	rx_mtx;
+	int		rx_in_progress;
+	struct iovec	rx_iov[VIRTIO_NET_MAXSEGS];
+	uint8_t		*rx_spill;	/* tail of the big rx packet */
+	uint64_t	rx_dropped;	/* no enough rx bufs for it */
+
+	pthread_t	tx_tid;
+	pthread_mutex_t	tx_mtx;
+	pthread_cond_t	tx_cond;
+	int		tx_in_progress;
+};
+
 /*
  * Per-device struct
  */
 struct virtio_net {
 	struct virtio_device virtio_dev;
 	pthread_mutex_t mtx;
-	struct mevent	*mevp;
 
-	int		tapfd;
+	int		vnet_hdr;	/* tap has virtio net header */
+	int		mq;		/* tap has multiple queues */
 	struct nm_desc	*nmd;
 
-	int		rx_ready;
-
 	volatile int	resetting;	/* set and checked outside lock */
 	volatile int	closing;	/* stop the tx i/o thread */
 
@@ -128,17 +181,16 @@ struct virtio_net {
 
 	struct virtio_net_config *config;
 
-	pthread_mutex_t	rx_mtx;
-	int		rx_in_progress;
 	int		rx_vhdrlen;
 	int		rx_merge;	/* merged rx bufs in use */
-	pthread_t	tx_tid;
-	pthread_mutex_t	tx_mtx;
-	pthread_cond_t	tx_cond;
-	int		tx_in_progress;
+	int		rx_gso;		/* guest can receive gso packets */
 
-	void (*virtio_net_rx)(struct virtio_net *net);
-	void (*virtio_net_tx)(struct virtio_net *net, struct iovec *iov,
+	int		max_pairs;
+	int		curr_pairs;
+	struct virtio_net_qpair qps[VIRTIO_NET_MAX_PAIRS];
+
+	void (*virtio_net_rx)(struct virtio_net_qpair *qp);
+	void (*virtio_net_tx)(struct virtio_net_qpair *qp, struct iovec *iov,
 			     int iovcnt, int len);
 };
 
@@ -168,30 +220,30 @@ ether_aton(const char *a, struct ether_addr *e)
  * If the transmit thread is active then stall until it is done.
  */
 static void
-virtio_net_txwait(struct virtio_net *net)
+virtio_net_txwait(struct virtio_net_qpair *qp)
 {
-	pthread_mutex_lock(&net->tx_mtx);
-	while (net->tx_in_progress) {
-		pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_lock(&qp->tx_mtx);
+	while (qp->tx_in_progress) {
+		pthread_mutex_unlock(&qp->tx_mtx);
 		usleep(10000);
-		pthread_mutex_lock(&net->tx_mtx);
+		pthread_mutex_lock(&qp->tx_mtx);
 	}
-	pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_unlock(&qp->tx_mtx);
 }
 
 /*
  * If the receive thread is active then stall until it is done.
  */
 static void
-virtio_net_rxwait(struct virtio_net *net)
+virtio_net_rxwait(struct virtio_net_qpair *qp)
 {
-	pthread_mutex_lock(&net->rx_mtx);
-	while (net->rx_in_progress) {
-		pthread_mutex_unlock(&net->rx_mtx);
+	pthread_mutex_lock(&qp->rx_mtx);
+	while (qp->rx_in_progress) {
+		pthread_mutex_unlock(&qp->rx_mtx);
 		usleep(10000);
-		pthread_mutex_lock(&net->rx_mtx);
+		pthread_mutex_lock(&qp->rx_mtx);
 	}
-	pthread_mutex_unlock(&net->rx_mtx);
+	pthread_mutex_unlock(&qp->rx_mtx);
 }
 
 /*
@@ -201,24 +253,28 @@ static void
 virtio_net_tx_stop(struct virtio_net *net)
 {
 	void *jval;
+	int i;
 
 	net->closing = 1;
 
-	pthread_cond_broadcast(&net->tx_cond);
-
-	pthread_join(net->tx_tid, &jval);
+	for (i = 0; i < net->max_pairs; i++) {
+		pthread_mutex_lock(&net->qps[i].tx_mtx);
+		pthread_cond_broadcast(&net->qps[i].tx_cond);
+		pthread_mutex_unlock(&net->qps[i].tx_mtx);
+		pthread_join(net->qps[i].tx_tid, &jval);
+	}
 }
 
 /*
  * Called to send a buffer chain out to the tap device
  */
-static void virtio_net_tap_tx(struct virtio_net *net,
+static void virtio_net_tap_tx(struct virtio_net_qpair *qp,
 		struct iovec *iov, int iovcnt, int len)
 {
 	static char pad[60]; /* all zero bytes */
 	ssize_t ret;
 
-	if (net->tapfd == -1)
+	if (qp->tapfd == -1)
 		return;
 
 	/*
@@ -231,7 +287,7 @@ static void virtio_net_tap_tx(struct virtio_net *net,
 		iov[iovcnt].iov_len = 60 - len;
 		iovcnt++;
 	}
-	ret = writev(net->tapfd, iov, iovcnt);
+	ret = writev(qp->tapfd, iov, iovcnt);
 	(void)ret; /*avoid compiler warning*/
 }
 
@@ -265,13 +321,119 @@ rx_iov_trim(struct iovec *iov, int *niov, int tlen)
 	return riov;
 }
 
+/*
+ * a gso packet from the tap may be much bigger than one rx buffer
+ * of the guest when merged rx bufs is used, read the packet to the
+ * first chain and a spill buffer, then only gather the chains the
+ * tail of the packet need and copy it to them, so the small packets
+ * still only cost one chain. the tap will fill the virtio net header
+ * at the begin of the first chain.
+ *
+ * return the number of chains used, 0 if there is no rx buffer
+ * and -EAGAIN if no more packets
+ */
+static int
+virtio_net_tap_rx_merged(struct virtio_net_qpair *qp, struct virt_queue *vq)
+{
+	struct virtio_net *net = qp->net;
+	struct vring_used_elem used[VIRTIO_NET_MAXSEGS];
+	struct iovec *iov = qp->rx_iov;
+	struct virtio_net_rxhdr *vrxh;
+	unsigned int in, out, i, n, nchain = 1;
+	size_t spill_len = VIRTIO_NET_GSO_MAXLEN + net->rx_vhdrlen;
+	size_t left, off = 0, copy;
+	ssize_t len;
+	int idx;
+
+	if (!qp->rx_spill) {
+		qp->rx_spill = malloc(spill_len);
+		if (!qp->rx_spill)
+			return 0;
+	}
+
+	/* keep one iov for the spill buffer */
+	idx = virtq_get_descs(vq, iov, VIRTIO_NET_MAXSEGS - 1, &in, &out);
+	if (idx < 0 || idx == vq->num)
+		return 0;
+
+	if (iov[0].iov_len < net->rx_vhdrlen) {
+		pr_err("vtnet: rx buffer too small for header\n");
+		virtq_discard_desc(vq, 1);
+		return -EAGAIN;
+	}
+
+	/* the iovs will be reused by the other chains */
+	vrxh = iov[0].iov_base;
+	used[0].id = idx;
+	used[0].len = 0;
+	for (i = 0; i < in; i++)
+		used[0].len += iov[i].iov_len;
+
+	iov[in].iov_base = qp->rx_spill;
+	iov[in].iov_len = spill_len;
+
+	len = readv(qp->tapfd, iov, in + 1);
+	if (len <= 0) {
+		virtq_discard_desc(vq, 1);
+		return -EAGAIN;
+	}
+
+	if (len <= used[0].len) {
+		used[0].len = len;
+		goto out;
+	}
+
+	/* gather the chains for the data in the spill buffer */
+	left = len - used[0].len;
+	while (left > 0) {
+		if (nchain == VIRTIO_NET_MAXSEGS)
+			goto drop;
+
+		idx = virtq_get_descs(vq, iov, VIRTIO_NET_MAXSEGS, &in, &out);
+		if (idx < 0 || idx == vq->num)
+			goto drop;
+
+		used[nchain].id = idx;
+		used[nchain].len = 0;
+		for (n = 0; n < in && left > 0; n++) {
+			copy = left < iov[n].iov_len ? left : iov[n].iov_len;
+			memcpy(iov[n].iov_base, qp->rx_spill + off, copy);
+			used[nchain].len += copy;
+			off += copy;
+			left -= copy;
+		}
+
+		nchain++;
+	}
+
+out:
+	vrxh->vrh_bufs = nchain;
+	virtq_add_used_n(vq, used, nchain);
+
+	return nchain;
+
+drop:
+	/*
+	 * the packet has been read from the tap, can not be
+	 * truncated since the gso header describe the whole
+	 * packet, drop it and return the chains
+	 */
+	virtq_discard_desc(vq, nchain);
+	qp->rx_dropped++;
+	pr_warn_ratelimited("vtnet: no rx buffer for %zd bytes packet, "
+			"%"PRIu64" dropped\n", len, qp->rx_dropped);
+
+	return 0;
+}
+
 static void
-virtio_net_tap_rx(struct virtio_net *net)
+virtio_net_tap_rx(struct virtio_net_qpair *qp)
 {
+	struct virtio_net *net = qp->net;
+	struct vring_used_elem used[VIRTIO_NET_RX_BATCH];
 	struct virt_queue *vq;
 	void *vrx;
-	int len;
-	uint16_t idx;
+	int len, idx, nused = 0;
 	ssize_t ret;
 	unsigned int in, out;
 	struct iovec *iov, *riov;
@@ -279,17 +441,17 @@ virtio_net_tap_rx(struct virtio_net *net)
 	/*
 	 * Should never be called without a valid tap fd
 	 */
-	assert(net->tapfd != -1);
+	assert(qp->tapfd != -1);
 
 	/*
 	 * But, will be called when the rx ring hasn't yet
 	 * been set up or the guest is resetting the device.
 	 */
-	if (!net->rx_ready || net->resetting) {
+	if (!qp->rx_ready || net->resetting) {
 		/*
 		 * Drop the packet and try later.
 		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
+		ret = read(qp->tapfd, dummybuf, sizeof(dummybuf));
 		(void)ret; /*avoid compiler warning*/
 
 		return;
@@ -298,13 +460,13 @@ virtio_net_tap_rx(struct virtio_net *net)
 	/*
 	 * Check for available rx buffers
 	 */
-	vq = &net->virtio_dev.vqs[VIRTIO_NET_RXQ];
+	vq = qp->rxq;
 	if (!virtq_has_descs(vq)) {
 		/*
 		 * Drop the packet and try later.  Interrupt on
 		 * empty, if that's negotiated.
 		 */
-		ret = read(net->tapfd, dummybuf, sizeof(dummybuf));
+		ret = read(qp->tapfd, dummybuf, sizeof(dummybuf));
 		(void)ret; /*avoid compiler warning*/
 
 		virtq_notify(vq);
@@ -315,14 +477,29 @@ virtio_net_tap_rx(struct virtio_net *net)
 	virtq_disable_notify(vq);
 
 	do {
+		if (net->vnet_hdr && net->rx_merge && net->rx_gso) {
+			ret = virtio_net_tap_rx_merged(qp, vq);
+			if (ret == -EAGAIN)
+				goto out;
+
+			if (ret == 0) {
+				if (virtq_enable_notify(vq)) {
+					virtq_disable_notify(vq);
+					continue;
+				}
+				break;
+			}
+
+			continue;
+		}
+
 		/*
 		 * Get descriptor chain.
 		 */
 		idx = virtq_get_descs(vq, vq->iovec,
 				VIRTIO_NET_MAXSEGS, &in, &out);
-
 		if (idx < 0)
-			return;
+			break;
 
 		if (idx == vq->num) {
 			if (virtq_enable_notify(vq)) {
@@ -333,45 +510,62 @@ virtio_net_tap_rx(struct virtio_net *net)
 		}
 
 		/*
-		 * Get a pointer to the rx header, and use the
-		 * data immediately following it for the packet buffer.
+		 * Get a pointer to the rx header, if the tap has the
+		 * virtio net header, it will be filled by the tap, else
+		 * use the data immediately following it for the packet
+		 * buffer.
 		 */
 		vrx = iov[0].iov_base;
-		riov = rx_iov_trim(iov, (int *)&in, net->rx_vhdrlen);
+		if (net->vnet_hdr) {
+			len = readv(qp->tapfd, iov, in);
+		} else {
+			riov = rx_iov_trim(iov, (int *)&in, net->rx_vhdrlen);
+			len = readv(qp->tapfd, riov, in);
 
-		len = readv(net->tapfd, riov, in);
+			/*
+			 * The only valid field in the rx packet header is
+			 * the number of buffers if merged rx bufs were
+			 * negotiated.
+			 */
+			if (len >= 0) {
+				memset(vrx, 0, net->rx_vhdrlen);
+				len += net->rx_vhdrlen;
+			}
+		}
 
-		if (len < 0 && errno == EWOULDBLOCK) {
+		if (len < net->rx_vhdrlen) {
 			/*
 			 * No more packets, but still some avail ring
 			 * entries.  Interrupt if needed/appropriate.
 			 */
 			virtq_discard_desc(vq, 1);
-			virtq_enable_notify(vq);
-			virtq_notify(vq);
-			return;
+			goto out;
 		}
 
-		/*
-		 * The only valid field in the rx packet header is the
-		 * number of buffers if merged rx bufs were negotiated.
-		 */
-		memset(vrx, 0, net->rx_vhdrlen);
-
 		if (net->rx_merge) {
-			struct virtio_net_rxhdr *vrxh;
+			struct virtio_net_rxhdr *vrxh = vrx;
 
-			vrxh = vrx;
 			vrxh->vrh_bufs = 1;
 		}
 
 		/*
-		 * Release this chain and handle more chains.
+		 * Release the chains in batch and handle more chains,
+		 * the guest only see them when the batch is published.
 		 */
-		virtq_add_used(vq, idx, len + net->rx_vhdrlen);
+		used[nused].id = idx;
+		used[nused].len = len;
+		if (++nused == VIRTIO_NET_RX_BATCH) {
+			virtq_add_used_n(vq, used, nused);
+			nused = 0;
+		}
 	} while (virtq_has_descs(vq));
 
+out:
+	if (nused)
+		virtq_add_used_n(vq, used, nused);
+
 	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
+	virtq_enable_notify(vq);
 	virtq_notify(vq);
 }
 
@@ -449,7 +643,6 @@ virtio_net_netmap_readv(struct nm_desc *nmd, struct iovec *iov, int iovcnt)
 		}
 		ring->head = ring->cur = nm_ring_next(ring, cur);
 		nmd->cur_rx_ring = r;
-		ioctl(nmd->fd, NIOCRXSYNC, NULL);
 		break;
 	}
 	for (; i < iovcnt; i++)
@@ -462,10 +655,11 @@ virtio_net_netmap_readv(struct nm_desc *nmd, struct iovec *iov, int iovcnt)
  * Called to send a buffer chain out to the vale port
  */
 static void
-virtio_net_netmap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
-		    int len)
+virtio_net_netmap_tx(struct virtio_net_qpair *qp, struct iovec *iov,
+		    int iovcnt, int len)
 {
 	static char pad[60]; /* all zero bytes */
+	struct virtio_net *net = qp->net;
 
 	if (net->nmd == NULL)
 		return;
@@ -484,12 +678,13 @@ virtio_net_netmap_tx(struct virtio_net *net, struct iovec *iov, int iovcnt,
 }
 
 static void
-virtio_net_netmap_rx(struct virtio_net *net)
+virtio_net_netmap_rx(struct virtio_net_qpair *qp)
 {
+	struct virtio_net *net = qp->net;
+	struct vring_used_elem used[VIRTIO_NET_RX_BATCH];
 	struct virt_queue *vq;
 	void *vrx;
-	int len;
-	uint16_t idx;
+	int len, idx, nused = 0;
 	unsigned int in, out;
 	struct iovec *iov, *riov;
 
@@ -502,7 +697,7 @@ virtio_net_netmap_rx(struct virtio_net *net)
 	 * But, will be called when the rx ring hasn't yet
 	 * been set up or the guest is resetting the device.
 	 */
-	if (!net->rx_ready || net->resetting) {
+	if (!qp->rx_ready || net->resetting) {
 		/*
 		 * Drop the packet and try later.
 		 */
@@ -513,7 +708,7 @@ virtio_net_netmap_rx(struct virtio_net *net)
 	/*
 	 * Check for available rx buffers
 	 */
-	vq = &net->virtio_dev.vqs[VIRTIO_NET_RXQ];
+	vq = qp->rxq;
 	if (!virtq_has_descs(vq)) {
 		/*
 		 * Drop the packet and try later.  Interrupt on
@@ -534,7 +729,7 @@ virtio_net_netmap_rx(struct virtio_net *net)
 		idx = virtq_get_descs(vq, vq->iovec,
 				VIRTIO_NET_MAXSEGS, &in, &out);
 		if (idx < 0)
-			return;
+			break;
 
 		if (idx == vq->num) {
 			if (virtq_enable_notify(vq)) {
@@ -557,9 +752,9 @@ virtio_net_netmap_rx(struct virtio_net *net)
 			 * No more packets, but still some avail ring
 			 * entries.  Interrupt if needed/appropriate.
 			 */
+			virtq_discard_desc(vq, 1);
 			virtq_enable_notify(vq);
-			virtq_notify(vq);
-			return;
+			break;
 		}
 
 		/*
@@ -576,47 +771,59 @@ virtio_net_netmap_rx(struct virtio_net *net)
 		}
 
 		/*
-		 * Release this chain and handle more chains.
+		 * Release the chains in batch and handle more chains.
 		 */
-		virtq_add_used_and_signal(vq, idx, len + net->rx_vhdrlen);
+		used[nused].id = idx;
+		used[nused].len = len + net->rx_vhdrlen;
+		if (++nused == VIRTIO_NET_RX_BATCH) {
+			virtq_add_used_n(vq, used, nused);
+			nused = 0;
+		}
 	}
 
+	/* release all the netmap slots consumed by this batch */
+	ioctl(net->nmd->fd, NIOCRXSYNC, NULL);
+
 	/* Interrupt if needed, including for NOTIFY_ON_EMPTY. */
+	if (nused)
+		virtq_add_used_n(vq, used, nused);
 	virtq_notify(vq);
 }
 
 static void
 virtio_net_rx_callback(int fd, enum ev_type type, void *param)
 {
-	struct virtio_net *net = param;
+	struct virtio_net_qpair *qp = param;
 
-	pthread_mutex_lock(&net->rx_mtx);
-	net->rx_in_progress = 1;
-	net->virtio_net_rx(net);
-	net->rx_in_progress = 0;
-	pthread_mutex_unlock(&net->rx_mtx);
+	pthread_mutex_lock(&qp->rx_mtx);
+	qp->rx_in_progress = 1;
+	qp->net->virtio_net_rx(qp);
+	qp->rx_in_progress = 0;
+	pthread_mutex_unlock(&qp->rx_mtx);
 }
 
 static void
 virtio_net_ping_rxq(struct virt_queue *vq)
 {
 	struct virtio_net *net = virtio_dev_to_net(vq->dev);
+	struct virtio_net_qpair *qp = &net->qps[vq->vq_index / 2];
 
 	/*
 	 * A qnotify means that the rx process can now begin
 	 */
-	if (net->rx_ready == 0) {
-		net->rx_ready = 1;
-		vq->used->flags |= VRING_USED_F_NO_NOTIFY;
+	if (qp->rx_ready == 0) {
+		qp->rx_ready = 1;
+		virtq_disable_notify(vq);
 	}
 }
 
 static void
-virtio_net_proctx(struct virtio_net *net, struct virt_queue *vq)
+virtio_net_proctx(struct virtio_net_qpair *qp, struct virt_queue *vq)
 {
+	struct virtio_net *net = qp->net;
 	int i;
 	int plen, tlen;
-	uint16_t idx;
+	int idx;
 	unsigned int in, out;
 
 	/*
@@ -638,8 +845,11 @@ virtio_net_proctx(struct virtio_net *net, struct virt_queue *vq)
 		tlen += vq->iovec[i].iov_len;
 	}
 
-	pr_info("virtio: packet send, %d %d bytes, %d segs\n\r", tlen, plen, out);
-	net->virtio_net_tx(net, &vq->iovec[1], out - 1, plen);
+	/* the header is passed to the tap if it support vnet header */
+	if (net->vnet_hdr)
+		net->virtio_net_tx(qp, vq->iovec, out, plen);
+	else
+		net->virtio_net_tx(qp, &vq->iovec[1], out - 1, plen);
 
 	/* chain is processed, release it and set tlen */
 	virtq_add_used(vq, idx, tlen);
@@ -649,6 +859,7 @@ static void
 virtio_net_ping_txq(struct virt_queue *vq)
 {
 	struct virtio_net *net = virtio_dev_to_net(vq->dev);
+	struct virtio_net_qpair *qp = &net->qps[vq->vq_index / 2];
 
 	/*
 	 * Any ring entries to process?
@@ -657,11 +868,11 @@ virtio_net_ping_txq(struct virt_queue *vq)
 		return;
 
 	/* Signal the tx thread for processing */
-	pthread_mutex_lock(&net->tx_mtx);
-	vq->used->flags |= VRING_USED_F_NO_NOTIFY;
-	if (net->tx_in_progress == 0)
-		pthread_cond_signal(&net->tx_cond);
-	pthread_mutex_unlock(&net->tx_mtx);
+	pthread_mutex_lock(&qp->tx_mtx);
+	virtq_disable_notify(vq);
+	if (qp->tx_in_progress == 0)
+		pthread_cond_signal(&qp->tx_cond);
+	pthread_mutex_unlock(&qp->tx_mtx);
 }
 
 /*
@@ -670,22 +881,23 @@ virtio_net_ping_txq(struct virt_queue *vq)
 static void *
 virtio_net_tx_thread(void *param)
 {
-	struct virtio_net *net = param;
-	struct virt_queue *vq;
+	struct virtio_net_qpair *qp = param;
+	struct virtio_net *net = qp->net;
+	struct virt_queue *vq = qp->txq;
 	int error;
 
-	vq = &net->virtio_dev.vqs[VIRTIO_NET_TXQ];
-
 	/*
 	 * Let us wait till the tx queue pointers get initialised &
 	 * first tx signaled
 	 */
-	pthread_mutex_lock(&net->tx_mtx);
-	error = pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
-	assert(error == 0);
+	pthread_mutex_lock(&qp->tx_mtx);
+	if (!net->closing) {
+		error = pthread_cond_wait(&qp->tx_cond, &qp->tx_mtx);
+		assert(error == 0);
+	}
 	if (net->closing) {
 		pr_warn("vtnet tx thread closing...\n");
-		pthread_mutex_unlock(&net->tx_mtx);
+		pthread_mutex_unlock(&qp->tx_mtx);
 		return NULL;
 	}
 
@@ -698,48 +910,45 @@ virtio_net_tx_thread(void *param)
 			if (!net->resetting && virtq_has_descs(vq))
 				break;
 
-			net->tx_in_progress = 0;
-			error = pthread_cond_wait(&net->tx_cond, &net->tx_mtx);
+			qp->tx_in_progress = 0;
+			error = pthread_cond_wait(&qp->tx_cond, &qp->tx_mtx);
 			assert(error == 0);
 			if (net->closing) {
 				pr_warn("vtnet tx thread closing...\n");
-				pthread_mutex_unlock(&net->tx_mtx);
+				pthread_mutex_unlock(&qp->tx_mtx);
 				return NULL;
 			}
 		}
 
 		virtq_disable_notify(vq);
-		net->tx_in_progress = 1;
-		pthread_mutex_unlock(&net->tx_mtx);
+		qp->tx_in_progress = 1;
+		pthread_mutex_unlock(&qp->tx_mtx);
 
 		do {
+			do {
+				/*
+				 * Run through entries, placing them into
+				 * iovecs and sending when an end-of-packet
+				 * is found
+				 */
+				virtio_net_proctx(qp, vq);
+			} while (virtq_has_descs(vq));
+
 			/*
-			 * Run through entries, placing them into
-			 * iovecs and sending when an end-of-packet
-			 * is found
+			 * Generate an interrupt if needed, then keep
+			 * polling the ring for a while if the polling
+			 * mode is enabled, the guest do not need to
+			 * kick for the packets come during it
 			 */
-			virtio_net_proctx(net, vq);
-		} while (virtq_has_descs(vq));
+			virtq_notify(vq);
+		} while (virtq_poll(vq));
 
-		/*
-		 * Generate an interrupt if needed.
-		 */
 		virtq_enable_notify(vq);
-		virtq_notify(vq);
 
-		pthread_mutex_lock(&net->tx_mtx);
+		pthread_mutex_lock(&qp->tx_mtx);
 	}
 }
 
-#ifdef notyet
-static int
-virtio_net_ping_ctlq(struct virt_queue *vq)
-{
-	pr_info("vtnet: control qnotify!\n\r");
-	return 0;
-}
-#endif
-
 static int
 virtio_net_parsemac(char *mac_str, uint8_t *mac_addr)
 {
@@ -766,9 +975,10 @@ virtio_net_parsemac(char *mac_str, uint8_t *mac_addr)
 }
 
 static int
-virtio_net_tap_open(char *devname)
+virtio_net_tap_open(char *devname, int *vnet_hdr, int *mq)
 {
 	int tunfd, rc;
+	unsigned int features = 0;
 	struct ifreq ifr;
 
 #define PATH_NET_TUN "/dev/net/tun"
@@ -781,6 +991,20 @@ virtio_net_tap_open(char *devname)
 	memset(&ifr, 0, sizeof(ifr));
 	ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
 
+	/* use the virtio net header if the tap support it */
+	*vnet_hdr = 0;
+	if (!ioctl(tunfd, TUNGETFEATURES, &features) &&
+			(features & IFF_VNET_HDR)) {
+		ifr.ifr_flags |= IFF_VNET_HDR;
+		*vnet_hdr = 1;
+	}
+
+	/* each queue of the multi-queue tap is a new opened fd */
+	if (*mq && (features & IFF_MULTI_QUEUE))
+		ifr.ifr_flags |= IFF_MULTI_QUEUE;
+	else
+		*mq = 0;
+
 	if (*devname)
 		strncpy(ifr.ifr_name, devname, IFNAMSIZ);
 
@@ -795,45 +1019,166 @@ virtio_net_tap_open(char *devname)
 	return tunfd;
 }
 
+static int
+virtio_net_tap_attach(struct virtio_net_qpair *qp, int attach)
+{
+	struct ifreq ifr;
+
+	if (qp->tapfd < 0 || qp->attached == attach)
+		return 0;
+
+	memset(&ifr, 0, sizeof(ifr));
+	ifr.ifr_flags = attach ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+	if (ioctl(qp->tapfd, TUNSETQUEUE, (void *)&ifr) < 0) {
+		pr_warn("vtnet: failed to %s tap queue %d\n",
+				attach ? "attach" : "detach", qp->index);
+		return -errno;
+	}
+
+	/* the detached queue is always readable with error */
+	if (attach)
+		mevent_enable(qp->mevp);
+	else
+		mevent_disable(qp->mevp);
+
+	qp->attached = attach;
+
+	return 0;
+}
+
+/*
+ * set the virtio net header size and the offloads of the tap
+ * according to the negotiated features
+ */
+static int
+virtio_net_tap_set_offload(struct virtio_net *net)
+{
+	unsigned int offload = 0;
+	uint64_t features = net->features;
+	int hdrlen = net->rx_vhdrlen;
+
+	/* the header size and offloads are shared by all the queues */
+	if (ioctl(net->qps[0].tapfd, TUNSETVNETHDRSZ, &hdrlen) < 0)
+		return -errno;
+
+	if (features & (1UL << VIRTIO_NET_F_GUEST_CSUM)) {
+		offload |= TUN_F_CSUM;
+		if (features & (1UL << VIRTIO_NET_F_GUEST_TSO4))
+			offload |= TUN_F_TSO4;
+		if (features & (1UL << VIRTIO_NET_F_GUEST_TSO6))
+			offload |= TUN_F_TSO6;
+		if (features & (1UL << VIRTIO_NET_F_GUEST_ECN))
+			offload |= TUN_F_TSO_ECN;
+	}
+
+	if (ioctl(net->qps[0].tapfd, TUNSETOFFLOAD, offload) < 0)
+		return -errno;
+
+	net->rx_gso = !!(offload & (TUN_F_TSO4 | TUN_F_TSO6));
+
+	return 0;
+}
+
+static int
+virtio_net_tap_queue_setup(struct virtio_net_qpair *qp, char *devname,
+		int *mq)
+{
+	struct virtio_net *net = qp->net;
+	int opt = 1, vnet_hdr;
+
+	/* all the queues must be opened with the same flags */
+	qp->tapfd = virtio_net_tap_open(devname, &vnet_hdr, mq);
+	if (qp->tapfd == -1)
+		return -ENOENT;
+
+	if (qp->index == 0)
+		net->vnet_hdr = vnet_hdr;
+
+	/*
+	 * Set non-blocking and register for read
+	 * notifications with the event loop
+	 */
+	if (ioctl(qp->tapfd, FIONBIO, &opt) < 0) {
+		pr_warn("tap device O_NONBLOCK failed\n");
+		goto out;
+	}
+
+	qp->mevp = mevent_add(qp->tapfd, EVF_READ,
+			       virtio_net_rx_callback, qp, net);
+	if (qp->mevp == NULL) {
+		pr_warn("Could not register event\n");
+		goto out;
+	}
+
+	qp->attached = 1;
+
+	return 0;
+
+out:
+	close(qp->tapfd);
+	qp->tapfd = -1;
+	return -EIO;
+}
+
 static void
 virtio_net_tap_setup(struct virtio_net *net, char *devname)
 {
+	int i, mq;
+
 	net->virtio_net_rx = virtio_net_tap_rx;
 	net->virtio_net_tx = virtio_net_tap_tx;
 
-	net->tapfd = virtio_net_tap_open(devname);
-	if (net->tapfd == -1) {
+	mq = (net->max_pairs > 1);
+	if (virtio_net_tap_queue_setup(&net->qps[0], devname, &mq)) {
 		pr_warn("open of tap device %s failed\n", devname);
 		return;
 	}
 	pr_info("open of tap device %s success!\n", devname);
 
 	/*
-	 * Set non-blocking and register for read
-	 * notifications with the event loop
+	 * the header size is updated when the features are
+	 * negotiated, the offloads are off until the guest
+	 * accept them
 	 */
-	int opt = 1;
+	if (net->vnet_hdr) {
+		if (virtio_net_tap_set_offload(net)) {
+			pr_warn("tap device %s vnet header not usable\n",
+					devname);
+			net->vnet_hdr = 0;
+		}
+	}
 
-	if (ioctl(net->tapfd, FIONBIO, &opt) < 0) {
-		pr_warn("tap device O_NONBLOCK failed\n");
-		close(net->tapfd);
-		net->tapfd = -1;
+	/*
+	 * open other queues of the tap, only the first pair
+	 * is enabled until the guest enable more pairs by the
+	 * control queue
+	 */
+	net->mq = mq;
+	if (!mq) {
+		net->max_pairs = 1;
+		return;
 	}
 
-	net->mevp = mevent_add(net->tapfd, EVF_READ,
-			       virtio_net_rx_callback, net);
-	if (net->mevp == NULL) {
-		pr_warn("Could not register event\n");
-		close(net->tapfd);
-		net->tapfd = -1;
+	for (i = 1; i < net->max_pairs; i++) {
+		if (virtio_net_tap_queue_setup(&net->qps[i], devname, &mq)) {
+			pr_warn("open of tap queue %d failed\n", i);
+			break;
+		}
+
+		virtio_net_tap_attach(&net->qps[i], 0);
 	}
+
+	net->max_pairs = i;
 }
 
 static void
 virtio_net_netmap_setup(struct virtio_net *net, char *ifname)
 {
+	struct virtio_net_qpair *qp = &net->qps[0];
+
 	net->virtio_net_rx = virtio_net_netmap_rx;
 	net->virtio_net_tx = virtio_net_netmap_tx;
+	net->max_pairs = 1;
 
 	net->nmd = nm_open(ifname, NULL, 0, 0);
 	if (net->nmd == NULL) {
@@ -841,9 +1186,9 @@ virtio_net_netmap_setup(struct virtio_net *net, char *ifname)
 		return;
 	}
 
-	net->mevp = mevent_add(net->nmd->fd, EVF_READ,
-			       virtio_net_rx_callback, net);
-	if (net->mevp == NULL) {
+	qp->mevp = mevent_add(net->nmd->fd, EVF_READ,
+			       virtio_net_rx_callback, qp, net);
+	if (qp->mevp == NULL) {
 		pr_warn("Could not register event\n");
 		nm_close(net->nmd);
 		net->nmd = NULL;
@@ -857,25 +1202,129 @@ static void virtio_net_neg_features(struct virtio_device *dev)
 	net = virtio_dev_to_net(dev);
 	net->features = dev->acked_features;
 
-	if (!(net->features & VIRTIO_NET_F_MRG_RXBUF)) {
+	if (!(net->features & (1UL << VIRTIO_NET_F_MRG_RXBUF))) {
 		net->rx_merge = 0;
-		/* non-merge rx header is 2 bytes shorter */
-		net->rx_vhdrlen -= 2;
+		/*
+		 * non-merge rx header is 2 bytes shorter, but
+		 * the header always has the num_buffers in v1
+		 */
+		if (!(net->features & (1UL << VIRTIO_F_VERSION_1)))
+			net->rx_vhdrlen -= 2;
+	}
+
+	if (net->vnet_hdr && virtio_net_tap_set_offload(net))
+		pr_err("vtnet: failed to set offload of tap\n");
+}
+
+/*
+ * enable the first pairs of the tap queues, the packets will
+ * not be steered to the queues which are detached
+ */
+static int
+virtio_net_set_pairs(struct virtio_net *net, int pairs)
+{
+	int i;
+
+	if (pairs < 1 || pairs > net->max_pairs)
+		return -EINVAL;
+
+	if (net->mq) {
+		for (i = 1; i < net->max_pairs; i++)
+			virtio_net_tap_attach(&net->qps[i], i < pairs);
+	}
+
+	net->curr_pairs = pairs;
+	pr_info("vtnet: %d queue pairs enabled\n", pairs);
+
+	return 0;
+}
+
+static uint8_t
+virtio_net_ctrl_cmd(struct virtio_net *net, struct iovec *iov, int iovcnt)
+{
+	struct virtio_net_ctrl_hdr *hdr;
+	uint8_t buf[64];
+	uint16_t pairs;
+	size_t len = 0, n;
+	int i;
+
+	/* the command may be split to many descs, copy it together */
+	for (i = 0; i < iovcnt && len < sizeof(buf); i++) {
+		n = MIN(iov[i].iov_len, sizeof(buf) - len);
+		memcpy(buf + len, iov[i].iov_base, n);
+		len += n;
+	}
+
+	if (len < sizeof(struct virtio_net_ctrl_hdr))
+		return VIRTIO_NET_ERR;
+
+	hdr = (struct virtio_net_ctrl_hdr *)buf;
+	len -= sizeof(struct virtio_net_ctrl_hdr);
+
+	switch (hdr->class) {
+	case VIRTIO_NET_CTRL_MQ:
+		if (hdr->cmd != VIRTIO_NET_CTRL_MQ_VQ_PAIRS_SET ||
+				len < sizeof(uint16_t))
+			return VIRTIO_NET_ERR;
+
+		memcpy(&pairs, buf + sizeof(struct virtio_net_ctrl_hdr),
+				sizeof(uint16_t));
+		if (virtio_net_set_pairs(net, pairs))
+			return VIRTIO_NET_ERR;
+
+		return VIRTIO_NET_OK;
+	default:
+		pr_warn("vtnet: unsupported ctrl class %d cmd %d\n",
+				hdr->class, hdr->cmd);
+		return VIRTIO_NET_ERR;
 	}
 }
 
+static void
+virtio_net_ping_ctlq(struct virt_queue *vq)
+{
+	struct virtio_net *net = virtio_dev_to_net(vq->dev);
+	unsigned int in, out;
+	uint8_t *status;
+	int idx;
+
+	for (;;) {
+		idx = virtq_get_descs(vq, vq->iovec,
+				vq->iovec_size, &in, &out);
+		if (idx < 0 || idx == vq->num)
+			break;
+
+		/* the last writeable desc is the ack of the command */
+		if (in < 1 || out < 1 || vq->iovec[out].iov_len < 1) {
+			pr_err("vtnet: invalid ctrl command\n");
+			virtq_add_used(vq, idx, 0);
+			continue;
+		}
+
+		status = vq->iovec[out].iov_base;
+		*status = virtio_net_ctrl_cmd(net, vq->iovec, out);
+		virtq_add_used(vq, idx, 1);
+	}
+
+	virtq_notify(vq);
+}
+
 static int vnet_init_vq(struct virt_queue *vq)
 {
-	if (vq->vq_index == VIRTIO_NET_RXQ)
-		vq->callback = virtio_net_ping_rxq;
-	else if (vq->vq_index == VIRTIO_NET_TXQ)
-		vq->callback = virtio_net_ping_txq;
-#ifdef notyet
-	else if (vq->vq_index == VIRTIO_NET_CTLQ)
+	struct virtio_net *net = virtio_dev_to_net(vq->dev);
+	int ctlq = VIRTIO_NET_CTLQ;
+
+	if (net->features & (1UL << VIRTIO_NET_F_MQ))
+		ctlq = net->max_pairs * 2;
+
+	if (vq->vq_index == ctlq)
 		vq->callback = virtio_net_ping_ctlq;
-#endif
-	else
+	else if (vq->vq_index >= net->max_pairs * 2)
 		pr_err("unsupported vq index %d\n", vq->vq_index);
+	else if ((vq->vq_index % 2) == VIRTIO_NET_RXQ)
+		vq->callback = virtio_net_ping_rxq;
+	else
+		vq->callback = virtio_net_ping_txq;
 
 	return 0;
 }
@@ -885,15 +1334,41 @@ static struct virtio_ops vnet_ops = {
 	.neg_features = virtio_net_neg_features,
 };
 
+static void virtio_net_close_qps(struct virtio_net *net)
+{
+	struct virtio_net_qpair *qp;
+	int i;
+
+	for (i = 0; i < net->max_pairs; i++) {
+		qp = &net->qps[i];
+		if (qp->mevp != NULL) {
+			mevent_delete(qp->mevp);
+			qp->mevp = NULL;
+		}
+
+		if (qp->tapfd >= 0) {
+			close(qp->tapfd);
+			qp->tapfd = -1;
+		}
+
+		if (qp->rx_spill) {
+			free(qp->rx_spill);
+			qp->rx_spill = NULL;
+		}
+	}
+}
+
 static int virtio_net_init(struct vdev *vdev, char *opts)
 {
-	char tname[MAXCOMLEN + 1];
+	char tname[32];
 	struct virtio_net *net;
+	struct virtio_net_qpair *qp;
 	char *devname;
-	char *vtopts;
+	char *vtopts, *cp;
+	uint8_t mac[ETHER_ADDR_LEN];
 	int mac_provided;
 	pthread_mutexattr_t attr;
-	int rc;
+	int rc, i;
 
 	net = calloc(1, sizeof(struct virtio_net));
 	if (!net) {
@@ -901,12 +1376,85 @@ static int virtio_net_init(struct vdev *vdev, char *opts)
 		return -1;
 	}
 
+	/* one queue pair for each vcpu, can be set by "queues=N" */
+	net->max_pairs = vdev->vm->nr_vcpus;
+	if (opts && (cp = strstr(opts, "queues=")))
+		net->max_pairs = atoi(cp + 7);
+	if (net->max_pairs > VIRTIO_NET_MAX_PAIRS)
+		net->max_pairs = VIRTIO_NET_MAX_PAIRS;
+	else if (net->max_pairs <= 0)
+		net->max_pairs = 1;
+
+	/* the rx event of the tap may come before the device is ready */
+	for (i = 0; i < VIRTIO_NET_MAX_PAIRS; i++) {
+		qp = &net->qps[i];
+		qp->net = net;
+		qp->index = i;
+		qp->tapfd = -1;
+		qp->rx_in_progress = 0;
+		pthread_mutex_init(&qp->rx_mtx, NULL);
+	}
+
+	net->rx_merge = 1;
+	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
+
+	/*
+	 * Attempt to open the tap device and read the MAC address
+	 * if specified, the tap may have less queues than required
+	 * so open it before the virt queues are created
+	 */
+	mac_provided = 0;
+	net->nmd = NULL;
+	if ((opts != NULL) && (opts[0] != 0)) {
+		int err;
+
+		devname = vtopts = strdup(opts);
+		if (!devname) {
+			pr_warn("virtio_net: strdup returns NULL\n");
+			free(net);
+			return -EFAULT;
+		}
+
+		(void) strsep(&vtopts, ",");
+
+		while ((cp = strsep(&vtopts, ",")) != NULL) {
+			if (!strncmp(cp, "queues=", 7) ||
+					!strncmp(cp, "poll=", 5))
+				continue;
+
+			err = virtio_net_parsemac(cp, mac);
+			if (err != 0) {
+				free(devname);
+				free(net);
+				return -EFAULT;
+			}
+			mac_provided = 1;
+		}
+
+		if (strncmp(devname, "vale", 4) == 0)
+			virtio_net_netmap_setup(net, devname);
+		if (strncmp(devname, "tap", 3) == 0 ||
+		    strncmp(devname, "vmnet", 5) == 0)
+			virtio_net_tap_setup(net, devname);
+
+		free(devname);
+	}
+
+	/* rx and tx queue for each pair and the control queue */
 	rc = virtio_device_init(&net->virtio_dev, vdev,
-			VIRTIO_TYPE_NET, VIRTIO_NET_MAXQ - 1,
+			VIRTIO_TYPE_NET, net->max_pairs * 2 + 1,
 			VIRTIO_NET_RINGSZ, VIRTIO_NET_MAXSEGS);
 	if (rc) {
 		pr_err("failed to init virtio net device\n");
+		virtio_net_close_qps(net);
 		free(net);
+		return rc;
+	}
+
+	for (i = 0; i < net->max_pairs; i++) {
+		qp = &net->qps[i];
+		qp->rxq = &net->virtio_dev.vqs[i * 2 + VIRTIO_NET_RXQ];
+		qp->txq = &net->virtio_dev.vqs[i * 2 + VIRTIO_NET_TXQ];
 	}
 
 	vdev_set_pdata(vdev, net);
@@ -934,43 +1482,29 @@ static int virtio_net_init(struct vdev *vdev, char *opts)
 	virtio_set_feature(&net->virtio_dev, VIRTIO_NET_F_STATUS);
 	virtio_set_feature(&net->virtio_dev, VIRTIO_F_NOTIFY_ON_EMPTY);
 	virtio_set_feature(&net->virtio_dev, VIRTIO_RING_F_INDIRECT_DESC);
-
-	/*
-	 * Attempt to open the tap device and read the MAC address
-	 * if specified
-	 */
-	mac_provided = 0;
-	net->tapfd = -1;
-	net->nmd = NULL;
-	if ((opts != NULL) && (opts[0] != 0)) {
-		int err;
-
-		devname = vtopts = strdup(opts);
-		if (!devname) {
-			pr_warn("virtio_net: strdup returns NULL\n");
-			goto error;
-		}
-
-		(void) strsep(&vtopts, ",");
-
-		if (vtopts != NULL) {
-			err = virtio_net_parsemac(vtopts, net->config->mac);
-			if (err != 0) {
-				free(devname);
-				goto error;
-			}
-			mac_provided = 1;
-		}
-
-		if (strncmp(devname, "vale", 4) == 0)
-			virtio_net_netmap_setup(net, devname);
-		if (strncmp(devname, "tap", 3) == 0 ||
-		    strncmp(devname, "vmnet", 5) == 0)
-			virtio_net_tap_setup(net, devname);
-
-		free(devname);
+	virtio_set_feature(&net->virtio_dev, VIRTIO_NET_F_CTRL_VQ);
+
+	/* busy poll the tx queues, "poll=<us>" */
+	if (opts && (cp = strstr(opts, "poll=")))
+		virtio_set_poll(&net->virtio_dev, atoi(cp + 5));
+
+	/* checksum and segmentation offload need the vnet header */
+	if (net->vnet_hdr) {
+		virtio_set_feature(&net->virtio_dev, VIRTIO_NET_F_CSUM);
+		virtio_set_feature(&net->virtio_dev, VIRTIO_NET_F_GUEST_CSUM);
+		virtio_set_feature(&net->virtio_dev, VIRTIO_NET_F_HOST_TSO4);
+		virtio_set_feature(&net->virtio_dev, VIRTIO_NET_F_HOST_TSO6);
+		virtio_set_feature(&net->virtio_dev, VIRTIO_NET_F_HOST_ECN);
+		virtio_set_feature(&net->virtio_dev, VIRTIO_NET_F_GUEST_TSO4);
+		virtio_set_feature(&net->virtio_dev, VIRTIO_NET_F_GUEST_TSO6);
+		virtio_set_feature(&net->virtio_dev, VIRTIO_NET_F_GUEST_ECN);
 	}
 
+	net->curr_pairs = 1;
+	net->config->max_virtqueue_pairs = net->max_pairs;
+	if (net->max_pairs > 1)
+		virtio_set_feature(&net->virtio_dev, VIRTIO_NET_F_MQ);
+
 	/*
 	 * The default MAC address is the standard NetApp OUI of 00-a0-98,
 	 * followed by an MD5 of the PCI slot/func number and dev name
@@ -982,40 +1516,32 @@ static int virtio_net_init(struct vdev *vdev, char *opts)
 		net->config->mac[3] = 0x33;
 		net->config->mac[4] = 0x44;
 		net->config->mac[5] = 0x55;
-	}
+	} else
+		memcpy(net->config->mac, mac, ETHER_ADDR_LEN);
 
 	/* Link is up if we managed to open tap device or vale port. */
-	net->config->status = (opts == NULL || net->tapfd >= 0 ||
+	net->config->status = (opts == NULL || net->qps[0].tapfd >= 0 ||
 			      net->nmd != NULL);
 
 	net->resetting = 0;
 	net->closing = 0;
 
-	net->rx_merge = 1;
-	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
-	net->rx_in_progress = 0;
-	pthread_mutex_init(&net->rx_mtx, NULL);
-
 	/*
-	 * Initialize tx semaphore & spawn TX processing thread.
-	 * As of now, only one thread for TX desc processing is
-	 * spawned.
+	 * Initialize tx semaphore & spawn TX processing thread
+	 * for each queue pair.
 	 */
-	net->tx_in_progress = 0;
-	pthread_mutex_init(&net->tx_mtx, NULL);
-	pthread_cond_init(&net->tx_cond, NULL);
-	pthread_create(&net->tx_tid, NULL, virtio_net_tx_thread,
-		       (void *)net);
-	snprintf(tname, sizeof(tname), "vtnet-%d:%d tx", 0x0, 0x1);
-	pthread_setname_np(net->tx_tid, tname);
+	for (i = 0; i < net->max_pairs; i++) {
+		qp = &net->qps[i];
+		qp->tx_in_progress = 0;
+		pthread_mutex_init(&qp->tx_mtx, NULL);
+		pthread_cond_init(&qp->tx_cond, NULL);
+		pthread_create(&qp->tx_tid, NULL, virtio_net_tx_thread,
+			       (void *)qp);
+		snprintf(tname, sizeof(tname), "vtnet-0:%d tx", i);
+		pthread_setname_np(qp->tx_tid, tname);
+	}
 
 	return 0;
-
-error:
-	virtio_device_deinit(&net->virtio_dev);
-	free(net);
-
-	return -EFAULT;
 }
 
 static void
@@ -1030,15 +1556,7 @@ virtio_net_deinit(struct vdev *vdev)
 	}
 
 	virtio_net_tx_stop(net);
-
-	if (net->tapfd >= 0) {
-		close(net->tapfd);
-		net->tapfd = -1;
-	} else
-		fprintf(stderr, "net->tapfd is -1!\n");
-
-	if (net->mevp != NULL)
-		mevent_delete(net->mevp);
+	virtio_net_close_qps(net);
 
 	virtio_device_deinit(&net->virtio_dev);
 	free(net);
@@ -1062,6 +1580,7 @@ static int virtio_net_event(struct vdev *vdev, int read,
 static int virtio_net_reset(struct vdev *vdev)
 {
 	struct virtio_net *net;
+	int i;
 
 	net = (struct virtio_net *)vdev_get_pdata(vdev);
 	if (!net)
@@ -1075,12 +1594,22 @@ static int virtio_net_reset(struct vdev *vdev)
 	 * Wait for the transmit and receive threads to finish their
 	 * processing.
 	 */
-	virtio_net_txwait(net);
-	virtio_net_rxwait(net);
+	for (i = 0; i < net->max_pairs; i++) {
+		virtio_net_txwait(&net->qps[i]);
+		virtio_net_rxwait(&net->qps[i]);
+		net->qps[i].rx_ready = 0;
+	}
+
+	/* only the first pair is used after reset */
+	virtio_net_set_pairs(net, 1);
 
-	net->rx_ready = 0;
 	net->rx_merge = 1;
 	net->rx_vhdrlen = sizeof(struct virtio_net_rxhdr);
+	net->features = 0;
+
+	/* offloads are off until the guest negotiate again */
+	if (net->vnet_hdr && virtio_net_tap_set_offload(net))
+		pr_err("vtnet: failed to reset offload of tap\n");
 
 	virtio_device_reset(&net->virtio_dev);
 
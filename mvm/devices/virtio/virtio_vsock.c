@@ -0,0 +1,1172 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (C) 2018 Min Le (lemin9538@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright notice,
+ *    this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright notice,
+ *    this list of conditions and the following disclaimer in the documentation
+ *    and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR
+ * SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER
+ * CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR
+ * TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/*
+ * virtio vsock device, the stream connections of the guest are
+ * forwarded to the AF_UNIX sockets of the host:
+ *
+ * - guest connect to host port N, mvm connect to "<path>_N"
+ * - host connect to "<path>" and write "CONNECT N\n", mvm connect
+ *   to guest port N and reply "OK <host port>\n" when established
+ */
+
+#define LOG_SUBSYS	LOG_SUB_VSOCK
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/uio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <mvm.h>
+#include <virtio.h>
+#include <mevent.h>
+#include <list.h>
+#include <compiler.h>
+
+#define VIRTIO_VSOCK_RINGSZ	128
+#define VIRTIO_VSOCK_IOVSZ	64
+
+#define VSOCK_RXQ		0
+#define VSOCK_TXQ		1
+#define VSOCK_EVTQ		2
+#define VSOCK_NR_VQ		3
+
+#define VSOCK_HOST_CID		2
+#define VSOCK_TYPE_STREAM	1
+
+#define VSOCK_OP_INVALID	0
+#define VSOCK_OP_REQUEST	1
+#define VSOCK_OP_RESPONSE	2
+#define VSOCK_OP_RST		3
+#define VSOCK_OP_SHUTDOWN	4
+#define VSOCK_OP_RW		5
+#define VSOCK_OP_CREDIT_UPDATE	6
+#define VSOCK_OP_CREDIT_REQUEST	7
+
+#define VSOCK_SHUTDOWN_RCV	1
+#define VSOCK_SHUTDOWN_SEND	2
+#define VSOCK_SHUTDOWN_ALL	(VSOCK_SHUTDOWN_RCV | VSOCK_SHUTDOWN_SEND)
+
+/*
+ * the data from the guest is buffered in the connection if the
+ * socket can not take it, the size is the credit of the guest
+ */
+#define VSOCK_BUF_SIZE		(256 * 1024)
+#define VSOCK_MAX_CONNS		256
+#define VSOCK_RX_BATCH		16
+#define VSOCK_LOCAL_PORT_BASE	(1U << 30)
+
+struct virtio_vsock_config {
+	uint64_t guest_cid;
+} __attribute__((packed));
+
+struct virtio_vsock_hdr {
+	uint64_t src_cid;
+	uint64_t dst_cid;
+	uint32_t src_port;
+	uint32_t dst_port;
+	uint32_t len;
+	uint16_t type;
+	uint16_t op;
+	uint32_t flags;
+	uint32_t buf_alloc;
+	uint32_t fwd_cnt;
+} __attribute__((packed));
+
+enum vsock_conn_state {
+	VSOCK_CONN_HOST_INIT,		/* wait "CONNECT <port>" from host */
+	VSOCK_CONN_CONNECTING,		/* wait the response of the guest */
+	VSOCK_CONN_ESTABLISHED,
+	VSOCK_CONN_CLOSING,		/* wait the RST to be sent */
+};
+
+struct vsock_conn {
+	struct list_head list;
+	enum vsock_conn_state state;
+	int fd;
+	int wfd;			/* dup of fd to wait writable */
+	struct mevent *revp;
+	struct mevent *wevp;
+	uint32_t local_port;
+	uint32_t peer_port;
+
+	/* the credit which the guest give us */
+	uint32_t peer_buf_alloc;
+	uint32_t peer_fwd_cnt;
+	uint32_t tx_cnt;
+
+	/* the data from the guest not written to the socket */
+	char *buf;
+	uint32_t buf_head;
+	uint32_t buf_len;
+	uint32_t fwd_cnt;
+	uint32_t last_fwd_cnt;
+
+	uint32_t pending;		/* control ops to send */
+	uint32_t peer_shutdown;
+	int rx_blocked;
+	int host_eof;
+
+	char line[32];
+	int line_len;
+};
+
+struct virtio_vsock {
+	struct virtio_device virtio_dev;
+	struct virtio_vsock_config *config;
+	pthread_mutex_t mtx;
+	uint64_t guest_cid;
+	char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+	int listen_fd;
+	struct mevent *listen_evp;
+	uint32_t next_port;
+	int nr_conns;
+	int rx_used;
+	struct list_head conns;
+};
+
+#define virtio_dev_to_vsock(dev) \
+	(struct virtio_vsock *)container_of(dev, \
+			struct virtio_vsock, virtio_dev)
+
+#define vsock_vq(vs, index)	(&(vs)->virtio_dev.vqs[index])
+
+static void vsock_conn_readable(int fd, enum ev_type t, void *arg);
+static void vsock_conn_writable(int fd, enum ev_type t, void *arg);
+
+static size_t iov_to_buf(struct iovec *iov, int n, size_t off,
+		void *buf, size_t len)
+{
+	size_t copied = 0, size;
+	int i;
+
+	for (i = 0; i < n && copied < len; i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+
+		size = iov[i].iov_len - off;
+		if (size > len - copied)
+			size = len - copied;
+		memcpy(buf + copied, iov[i].iov_base + off, size);
+		copied += size;
+		off = 0;
+	}
+
+	return copied;
+}
+
+static size_t iov_from_buf(struct iovec *iov, int n, void *buf, size_t len)
+{
+	size_t copied = 0, size;
+	int i;
+
+	for (i = 0; i < n && copied < len; i++) {
+		size = iov[i].iov_len;
+		if (size > len - copied)
+			size = len - copied;
+		memcpy(iov[i].iov_base, buf + copied, size);
+		copied += size;
+	}
+
+	return copied;
+}
+
+static size_t iov_size(struct iovec *iov, int n)
+{
+	size_t size = 0;
+	int i;
+
+	for (i = 0; i < n; i++)
+		size += iov[i].iov_len;
+
+	return size;
+}
+
+/* get the iovs of [off, off + len) of the iov */
+static int iov_slice(struct iovec *iov, int n, size_t off, size_t len,
+		struct iovec *diov)
+{
+	int i, cnt = 0;
+
+	for (i = 0; i < n && len; i++) {
+		if (off >= iov[i].iov_len) {
+			off -= iov[i].iov_len;
+			continue;
+		}
+
+		diov[cnt].iov_base = iov[i].iov_base + off;
+		diov[cnt].iov_len = iov[i].iov_len - off;
+		if (diov[cnt].iov_len > len)
+			diov[cnt].iov_len = len;
+		len -= diov[cnt].iov_len;
+		off = 0;
+		cnt++;
+	}
+
+	return cnt;
+}
+
+static struct vsock_conn *vsock_find_conn(struct virtio_vsock *vs,
+		uint32_t local_port, uint32_t peer_port)
+{
+	struct vsock_conn *conn;
+
+	list_for_each_entry(conn, &vs->conns, list) {
+		if (conn->local_port == local_port &&
+				conn->peer_port == peer_port &&
+				conn->state != VSOCK_CONN_HOST_INIT)
+			return conn;
+	}
+
+	return NULL;
+}
+
+/*
+ * the mevent callback may run after the connection is freed,
+ * so the callbacks always look up the connection by the fd
+ */
+static struct vsock_conn *vsock_find_conn_fd(struct virtio_vsock *vs,
+		int fd)
+{
+	struct vsock_conn *conn;
+
+	list_for_each_entry(conn, &vs->conns, list) {
+		if (conn->fd == fd || conn->wfd == fd)
+			return conn;
+	}
+
+	return NULL;
+}
+
+static struct vsock_conn *vsock_conn_alloc(struct virtio_vsock *vs,
+		int fd, enum vsock_conn_state state)
+{
+	struct vsock_conn *conn;
+
+	if (vs->nr_conns >= VSOCK_MAX_CONNS) {
+		pr_warn_ratelimited("vsock: too many connections\n");
+		return NULL;
+	}
+
+	conn = calloc(1, sizeof(*conn));
+	if (!conn)
+		return NULL;
+
+	conn->buf = malloc(VSOCK_BUF_SIZE);
+	if (!conn->buf)
+		goto err_buf;
+
+	conn->fd = fd;
+	conn->wfd = dup(fd);
+	if (conn->wfd < 0)
+		goto err_dup;
+
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	conn->state = state;
+
+	/*
+	 * the callbacks take the lock of the device, which is
+	 * already held by the caller, so add the events at last
+	 */
+	list_add_tail(&vs->conns, &conn->list);
+	vs->nr_conns++;
+
+	conn->revp = mevent_add(fd, EVF_READ, vsock_conn_readable, vs, vs);
+	conn->wevp = mevent_add(conn->wfd, EVF_WRITE,
+			vsock_conn_writable, vs, vs);
+	if (!conn->revp || !conn->wevp) {
+		pr_err("vsock: failed to add the event of connection\n");
+		if (conn->revp)
+			mevent_delete(conn->revp);
+		if (conn->wevp)
+			mevent_delete(conn->wevp);
+		list_del(&conn->list);
+		vs->nr_conns--;
+		close(conn->wfd);
+		goto err_dup;
+	}
+
+	/* only wait writable when there is data buffered */
+	mevent_disable(conn->wevp);
+
+	return conn;
+
+err_dup:
+	free(conn->buf);
+err_buf:
+	free(conn);
+	return NULL;
+}
+
+static void vsock_conn_free(struct virtio_vsock *vs, struct vsock_conn *conn)
+{
+	list_del(&conn->list);
+	vs->nr_conns--;
+
+	mevent_delete(conn->revp);
+	mevent_delete(conn->wevp);
+	close(conn->fd);
+	close(conn->wfd);
+	free(conn->buf);
+	free(conn);
+}
+
+static void vsock_conn_reset(struct vsock_conn *conn)
+{
+	if (conn->state == VSOCK_CONN_CLOSING)
+		return;
+
+	conn->state = VSOCK_CONN_CLOSING;
+	conn->pending = 1 << VSOCK_OP_RST;
+	conn->rx_blocked = 1;
+	mevent_disable(conn->revp);
+	mevent_disable(conn->wevp);
+}
+
+static void vsock_init_hdr(struct virtio_vsock *vs,
+		struct virtio_vsock_hdr *hdr, uint32_t local_port,
+		uint32_t peer_port, uint16_t op)
+{
+	memset(hdr, 0, sizeof(*hdr));
+	hdr->src_cid = VSOCK_HOST_CID;
+	hdr->dst_cid = vs->guest_cid;
+	hdr->src_port = local_port;
+	hdr->dst_port = peer_port;
+	hdr->type = VSOCK_TYPE_STREAM;
+	hdr->op = op;
+}
+
+static void vsock_set_credit(struct vsock_conn *conn,
+		struct virtio_vsock_hdr *hdr)
+{
+	hdr->buf_alloc = VSOCK_BUF_SIZE;
+	hdr->fwd_cnt = conn->fwd_cnt;
+	conn->last_fwd_cnt = conn->fwd_cnt;
+}
+
+static inline uint32_t vsock_peer_credit(struct vsock_conn *conn)
+{
+	return conn->peer_buf_alloc - (conn->tx_cnt - conn->peer_fwd_cnt);
+}
+
+/* send a packet which has no payload to the guest */
+static int vsock_rx_send_hdr(struct virtio_vsock *vs,
+		struct virtio_vsock_hdr *hdr)
+{
+	struct virt_queue *vq = vsock_vq(vs, VSOCK_RXQ);
+	struct iovec *iov = vq->iovec;
+	unsigned int in, out;
+	int idx;
+
+	if (!vq->ready)
+		return -ENOBUFS;
+
+	idx = virtq_get_descs(vq, iov, vq->iovec_size, &in, &out);
+	if (idx < 0)
+		return idx;
+	if (idx == vq->num)
+		return -ENOBUFS;
+
+	if (out || iov_size(iov, in) < sizeof(*hdr)) {
+		pr_err_ratelimited("vsock: invalid rx buffer\n");
+		virtq_add_used(vq, idx, 0);
+		vs->rx_used = 1;
+		return -EINVAL;
+	}
+
+	iov_from_buf(iov, in, hdr, sizeof(*hdr));
+	virtq_add_used(vq, idx, sizeof(*hdr));
+	vs->rx_used = 1;
+
+	return 0;
+}
+
+static void vsock_send_rst(struct virtio_vsock *vs,
+		struct virtio_vsock_hdr *req)
+{
+	struct virtio_vsock_hdr hdr;
+
+	vsock_init_hdr(vs, &hdr, req->dst_port, req->src_port,
+			VSOCK_OP_RST);
+	hdr.dst_cid = req->src_cid;
+	vsock_rx_send_hdr(vs, &hdr);
+}
+
+/*
+ * read the data from the socket to one rx buffer, the size
+ * is limited by the credit of the guest
+ */
+static int vsock_rx_data(struct virtio_vsock *vs, struct vsock_conn *conn)
+{
+	struct virt_queue *vq = vsock_vq(vs, VSOCK_RXQ);
+	struct iovec diov[VIRTIO_VSOCK_IOVSZ];
+	struct virtio_vsock_hdr hdr;
+	unsigned int in, out;
+	uint32_t credit;
+	size_t size;
+	ssize_t len;
+	int idx, n;
+
+	credit = vsock_peer_credit(conn);
+	if (!credit)
+		return -ENOSPC;
+
+	if (!vq->ready)
+		return -ENOBUFS;
+
+	idx = virtq_get_descs(vq, vq->iovec, vq->iovec_size, &in, &out);
+	if (idx < 0)
+		return idx;
+	if (idx == vq->num)
+		return -ENOBUFS;
+
+	size = iov_size(vq->iovec, in);
+	if (out || size <= sizeof(hdr)) {
+		pr_err_ratelimited("vsock: invalid rx buffer\n");
+		virtq_add_used(vq, idx, 0);
+		vs->rx_used = 1;
+		return -EINVAL;
+	}
+
+	size -= sizeof(hdr);
+	if (size > credit)
+		size = credit;
+
+	n = iov_slice(vq->iovec, in, sizeof(hdr), size, diov);
+	len = readv(conn->fd, diov, n);
+	if (len <= 0) {
+		virtq_discard_desc(vq, 1);
+		if (len == 0)
+			return -EPIPE;
+		return (errno == EAGAIN) ? -EAGAIN : -errno;
+	}
+
+	vsock_init_hdr(vs, &hdr, conn->local_port, conn->peer_port,
+			VSOCK_OP_RW);
+	vsock_set_credit(conn, &hdr);
+	hdr.len = len;
+
+	iov_from_buf(vq->iovec, in, &hdr, sizeof(hdr));
+	virtq_add_used(vq, idx, sizeof(hdr) + len);
+	vs->rx_used = 1;
+	conn->tx_cnt += len;
+
+	return 0;
+}
+
+/* send the pending control packets of the connection */
+static int vsock_conn_send_ctl(struct virtio_vsock *vs,
+		struct vsock_conn *conn)
+{
+	struct virtio_vsock_hdr hdr;
+	int op, ret;
+
+	while (conn->pending) {
+		op = __builtin_ctz(conn->pending);
+		vsock_init_hdr(vs, &hdr, conn->local_port,
+				conn->peer_port, op);
+		vsock_set_credit(conn, &hdr);
+		if (op == VSOCK_OP_SHUTDOWN)
+			hdr.flags = VSOCK_SHUTDOWN_ALL;
+
+		ret = vsock_rx_send_hdr(vs, &hdr);
+		if (ret == -ENOBUFS)
+			return ret;
+
+		conn->pending &= ~(1 << op);
+	}
+
+	return 0;
+}
+
+/*
+ * send the pending control packets and restart the connections
+ * which are waiting for the rx buffers or the credit
+ */
+static void vsock_rx_process(struct virtio_vsock *vs)
+{
+	struct virt_queue *vq = vsock_vq(vs, VSOCK_RXQ);
+	struct vsock_conn *conn, *tmp;
+
+	list_for_each_entry_safe(conn, tmp, &vs->conns, list) {
+		if (conn->pending && vsock_conn_send_ctl(vs, conn))
+			break;
+
+		if (conn->state == VSOCK_CONN_CLOSING) {
+			vsock_conn_free(vs, conn);
+			continue;
+		}
+
+		if (conn->rx_blocked && !conn->host_eof &&
+				conn->state == VSOCK_CONN_ESTABLISHED &&
+				!(conn->peer_shutdown & VSOCK_SHUTDOWN_RCV) &&
+				vsock_peer_credit(conn) &&
+				vq->ready && virtq_has_descs(vq)) {
+			conn->rx_blocked = 0;
+			mevent_enable(conn->revp);
+		}
+	}
+
+	if (vs->rx_used) {
+		vs->rx_used = 0;
+		virtq_notify(vq);
+	}
+}
+
+/* write the buffered data of the guest to the socket */
+static int vsock_conn_flush(struct vsock_conn *conn)
+{
+	struct iovec iov[2];
+	uint32_t tail;
+	ssize_t n;
+	int cnt;
+
+	while (conn->buf_len) {
+		tail = conn->buf_head + conn->buf_len;
+		iov[0].iov_base = conn->buf + conn->buf_head;
+		if (tail <= VSOCK_BUF_SIZE) {
+			iov[0].iov_len = conn->buf_len;
+			cnt = 1;
+		} else {
+			iov[0].iov_len = VSOCK_BUF_SIZE - conn->buf_head;
+			iov[1].iov_base = conn->buf;
+			iov[1].iov_len = tail - VSOCK_BUF_SIZE;
+			cnt = 2;
+		}
+
+		n = writev(conn->fd, iov, cnt);
+		if (n < 0) {
+			if (errno != EAGAIN)
+				return -errno;
+
+			mevent_enable(conn->wevp);
+			return 0;
+		}
+
+		conn->buf_head = (conn->buf_head + n) % VSOCK_BUF_SIZE;
+		conn->buf_len -= n;
+		conn->fwd_cnt += n;
+	}
+
+	mevent_disable(conn->wevp);
+	if (conn->peer_shutdown & VSOCK_SHUTDOWN_SEND)
+		shutdown(conn->fd, SHUT_WR);
+
+	return 0;
+}
+
+/*
+ * the guest will not send more data than the credit, write the
+ * data to the socket directly if nothing is buffered, and buffer
+ * the left data
+ */
+static int vsock_conn_recv(struct vsock_conn *conn, struct iovec *iov,
+		int n, size_t len)
+{
+	struct iovec diov[VIRTIO_VSOCK_IOVSZ];
+	size_t off = sizeof(struct virtio_vsock_hdr);
+	uint32_t tail, size;
+	ssize_t ret;
+	int cnt;
+
+	if (len > VSOCK_BUF_SIZE - conn->buf_len) {
+		pr_warn_ratelimited("vsock: guest overflow the credit\n");
+		return -ENOSPC;
+	}
+
+	if (!conn->buf_len) {
+		cnt = iov_slice(iov, n, off, len, diov);
+		ret = writev(conn->fd, diov, cnt);
+		if (ret < 0 && errno != EAGAIN)
+			return -errno;
+
+		if (ret > 0) {
+			conn->fwd_cnt += ret;
+			off += ret;
+			len -= ret;
+		}
+	}
+
+	while (len) {
+		tail = (conn->buf_head + conn->buf_len) % VSOCK_BUF_SIZE;
+		size = VSOCK_BUF_SIZE - tail;
+		if (size > len)
+			size = len;
+
+		size = iov_to_buf(iov, n, off, conn->buf + tail, size);
+		if (!size)
+			break;
+
+		conn->buf_len += size;
+		off += size;
+		len -= size;
+	}
+
+	if (conn->buf_len)
+		mevent_enable(conn->wevp);
+
+	return 0;
+}
+
+/* tell the guest the new credit if it used half of it */
+static void vsock_conn_update_credit(struct vsock_conn *conn)
+{
+	if (conn->fwd_cnt - conn->last_fwd_cnt >= VSOCK_BUF_SIZE / 2)
+		conn->pending |= 1 << VSOCK_OP_CREDIT_UPDATE;
+}
+
+static void vsock_guest_connect(struct virtio_vsock *vs,
+		struct virtio_vsock_hdr *hdr)
+{
+	struct sockaddr_un addr;
+	struct vsock_conn *conn;
+	int fd;
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0)
+		goto reset;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	if (snprintf(addr.sun_path, sizeof(addr.sun_path), "%s_%u",
+			vs->path, hdr->dst_port) >= sizeof(addr.sun_path)) {
+		close(fd);
+		goto reset;
+	}
+
+	if (connect(fd, (struct sockaddr *)&addr, sizeof(addr))) {
+		pr_warn_ratelimited("vsock: connect %s failed %d\n",
+				addr.sun_path, errno);
+		close(fd);
+		goto reset;
+	}
+
+	conn = vsock_conn_alloc(vs, fd, VSOCK_CONN_ESTABLISHED);
+	if (!conn) {
+		close(fd);
+		goto reset;
+	}
+
+	conn->local_port = hdr->dst_port;
+	conn->peer_port = hdr->src_port;
+	conn->peer_buf_alloc = hdr->buf_alloc;
+	conn->peer_fwd_cnt = hdr->fwd_cnt;
+	conn->pending |= 1 << VSOCK_OP_RESPONSE;
+
+	return;
+
+reset:
+	vsock_send_rst(vs, hdr);
+}
+
+static void vsock_tx_pkt(struct virtio_vsock *vs, struct iovec *iov, int n)
+{
+	struct virtio_vsock_hdr hdr;
+	struct vsock_conn *conn;
+	char buf[32];
+	int len;
+
+	if (iov_to_buf(iov, n, 0, &hdr, sizeof(hdr)) < sizeof(hdr)) {
+		pr_err_ratelimited("vsock: invalid tx packet\n");
+		return;
+	}
+
+	if (hdr.src_cid != vs->guest_cid || hdr.dst_cid != VSOCK_HOST_CID ||
+			hdr.type != VSOCK_TYPE_STREAM) {
+		if (hdr.op != VSOCK_OP_RST)
+			vsock_send_rst(vs, &hdr);
+		return;
+	}
+
+	conn = vsock_find_conn(vs, hdr.dst_port, hdr.src_port);
+	if (!conn) {
+		if (hdr.op == VSOCK_OP_REQUEST)
+			vsock_guest_connect(vs, &hdr);
+		else if (hdr.op != VSOCK_OP_RST)
+			vsock_send_rst(vs, &hdr);
+		return;
+	}
+
+	if (conn->state == VSOCK_CONN_CLOSING)
+		return;
+
+	/* each packet carries the credit of the guest */
+	conn->peer_buf_alloc = hdr.buf_alloc;
+	conn->peer_fwd_cnt = hdr.fwd_cnt;
+
+	switch (hdr.op) {
+	case VSOCK_OP_RESPONSE:
+		if (conn->state != VSOCK_CONN_CONNECTING) {
+			vsock_conn_reset(conn);
+			break;
+		}
+
+		conn->state = VSOCK_CONN_ESTABLISHED;
+		len = sprintf(buf, "OK %u\n", conn->local_port);
+		if (write(conn->fd, buf, len) != len)
+			vsock_conn_reset(conn);
+		break;
+
+	case VSOCK_OP_RW:
+		if (conn->state != VSOCK_CONN_ESTABLISHED ||
+				hdr.len > iov_size(iov, n) - sizeof(hdr) ||
+				vsock_conn_recv(conn, iov, n, hdr.len)) {
+			vsock_conn_reset(conn);
+			break;
+		}
+
+		vsock_conn_update_credit(conn);
+		break;
+
+	case VSOCK_OP_CREDIT_UPDATE:
+		break;
+
+	case VSOCK_OP_CREDIT_REQUEST:
+		conn->pending |= 1 << VSOCK_OP_CREDIT_UPDATE;
+		break;
+
+	case VSOCK_OP_SHUTDOWN:
+		conn->peer_shutdown |= hdr.flags & VSOCK_SHUTDOWN_ALL;
+		if (conn->peer_shutdown == VSOCK_SHUTDOWN_ALL)
+			vsock_conn_reset(conn);
+		else if ((conn->peer_shutdown & VSOCK_SHUTDOWN_SEND) &&
+				!conn->buf_len)
+			shutdown(conn->fd, SHUT_WR);
+		break;
+
+	case VSOCK_OP_RST:
+		vsock_conn_free(vs, conn);
+		break;
+
+	default:
+		vsock_conn_reset(conn);
+		break;
+	}
+}
+
+static void vsock_notify_tx(struct virt_queue *vq)
+{
+	struct virtio_vsock *vs = virtio_dev_to_vsock(vq->dev);
+	unsigned int in, out;
+	int idx;
+
+	pthread_mutex_lock(&vs->mtx);
+	virtq_disable_notify(vq);
+
+	for (;;) {
+		idx = virtq_get_descs(vq, vq->iovec,
+				vq->iovec_size, &in, &out);
+		if (idx < 0)
+			break;
+
+		if (idx == vq->num) {
+			if (virtq_enable_notify(vq)) {
+				virtq_disable_notify(vq);
+				continue;
+			}
+			break;
+		}
+
+		vsock_tx_pkt(vs, vq->iovec, out);
+		virtq_add_used(vq, idx, 0);
+	}
+
+	/* one interrupt for the whole batch */
+	virtq_notify(vq);
+	vsock_rx_process(vs);
+	pthread_mutex_unlock(&vs->mtx);
+}
+
+static void vsock_notify_rx(struct virt_queue *vq)
+{
+	struct virtio_vsock *vs = virtio_dev_to_vsock(vq->dev);
+
+	pthread_mutex_lock(&vs->mtx);
+	vsock_rx_process(vs);
+	pthread_mutex_unlock(&vs->mtx);
+}
+
+static void vsock_notify_evt(struct virt_queue *vq)
+{
+	/* the transport reset event is not used */
+}
+
+/* the host side connect, wait "CONNECT <port>\n" */
+static void vsock_conn_read_connect(struct virtio_vsock *vs,
+		struct vsock_conn *conn)
+{
+	uint32_t port;
+	ssize_t n;
+
+	n = read(conn->fd, conn->line + conn->line_len,
+			sizeof(conn->line) - 1 - conn->line_len);
+	if (n <= 0) {
+		if (n == 0 || errno != EAGAIN)
+			vsock_conn_free(vs, conn);
+		return;
+	}
+
+	conn->line_len += n;
+	conn->line[conn->line_len] = 0;
+	if (!strchr(conn->line, '\n')) {
+		if (conn->line_len >= sizeof(conn->line) - 1)
+			vsock_conn_free(vs, conn);
+		return;
+	}
+
+	if (sscanf(conn->line, "CONNECT %u", &port) != 1) {
+		pr_warn("vsock: invalid connect request\n");
+		vsock_conn_free(vs, conn);
+		return;
+	}
+
+	conn->peer_port = port;
+	do {
+		conn->local_port = vs->next_port++;
+		if (vs->next_port < VSOCK_LOCAL_PORT_BASE)
+			vs->next_port = VSOCK_LOCAL_PORT_BASE;
+	} while (vsock_find_conn(vs, conn->local_port, port));
+
+	/* do not read from the socket until the guest accept it */
+	conn->state = VSOCK_CONN_CONNECTING;
+	conn->pending |= 1 << VSOCK_OP_REQUEST;
+	conn->rx_blocked = 1;
+	mevent_disable(conn->revp);
+}
+
+static void vsock_conn_readable(int fd, enum ev_type t, void *arg)
+{
+	struct virtio_vsock *vs = arg;
+	struct vsock_conn *conn;
+	int i, ret;
+
+	pthread_mutex_lock(&vs->mtx);
+
+	conn = vsock_find_conn_fd(vs, fd);
+	if (!conn)
+		goto out;
+
+	if (conn->state == VSOCK_CONN_HOST_INIT) {
+		vsock_conn_read_connect(vs, conn);
+		goto process;
+	}
+
+	if (conn->state != VSOCK_CONN_ESTABLISHED)
+		goto block;
+
+	/*
+	 * the control packets such as the RESPONSE must be sent
+	 * before the data, wait the rx buffers if they can not
+	 */
+	if (conn->pending && vsock_conn_send_ctl(vs, conn))
+		goto block;
+
+	for (i = 0; i < VSOCK_RX_BATCH; i++) {
+		ret = vsock_rx_data(vs, conn);
+		if (ret == 0)
+			continue;
+
+		if (ret == -EAGAIN)
+			break;
+
+		if (ret == -EPIPE) {
+			/* the host closed the socket */
+			conn->host_eof = 1;
+			conn->pending |= 1 << VSOCK_OP_SHUTDOWN;
+			goto block;
+		}
+
+		if (ret == -ENOBUFS || ret == -ENOSPC)
+			goto block;
+
+		vsock_conn_reset(conn);
+		break;
+	}
+
+	goto process;
+
+block:
+	/* enabled again by vsock_rx_process() */
+	conn->rx_blocked = 1;
+	mevent_disable(conn->revp);
+process:
+	vsock_rx_process(vs);
+out:
+	pthread_mutex_unlock(&vs->mtx);
+}
+
+static void vsock_conn_writable(int fd, enum ev_type t, void *arg)
+{
+	struct virtio_vsock *vs = arg;
+	struct vsock_conn *conn;
+
+	pthread_mutex_lock(&vs->mtx);
+
+	conn = vsock_find_conn_fd(vs, fd);
+	if (conn && conn->state == VSOCK_CONN_ESTABLISHED) {
+		if (vsock_conn_flush(conn))
+			vsock_conn_reset(conn);
+		else
+			vsock_conn_update_credit(conn);
+
+		vsock_rx_process(vs);
+	}
+
+	pthread_mutex_unlock(&vs->mtx);
+}
+
+static void vsock_accept(int fd, enum ev_type t, void *arg)
+{
+	struct virtio_vsock *vs = arg;
+	int cfd;
+
+	cfd = accept4(fd, NULL, NULL, SOCK_CLOEXEC);
+	if (cfd < 0)
+		return;
+
+	pthread_mutex_lock(&vs->mtx);
+	if (!vsock_conn_alloc(vs, cfd, VSOCK_CONN_HOST_INIT))
+		close(cfd);
+	pthread_mutex_unlock(&vs->mtx);
+}
+
+static int vsock_listen(struct virtio_vsock *vs)
+{
+	struct sockaddr_un addr;
+
+	vs->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (vs->listen_fd < 0)
+		return -errno;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, vs->path);
+	unlink(vs->path);
+
+	if (bind(vs->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+			listen(vs->listen_fd, 16)) {
+		pr_err("vsock: failed to listen on %s\n", vs->path);
+		close(vs->listen_fd);
+		vs->listen_fd = -1;
+		return -errno;
+	}
+
+	vs->listen_evp = mevent_add(vs->listen_fd, EVF_READ,
+			vsock_accept, vs, vs);
+	if (!vs->listen_evp) {
+		close(vs->listen_fd);
+		vs->listen_fd = -1;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void vsock_close_all(struct virtio_vsock *vs)
+{
+	struct vsock_conn *conn, *tmp;
+
+	pthread_mutex_lock(&vs->mtx);
+	list_for_each_entry_safe(conn, tmp, &vs->conns, list)
+		vsock_conn_free(vs, conn);
+	pthread_mutex_unlock(&vs->mtx);
+}
+
+static int vsock_init_vq(struct virt_queue *vq)
+{
+	switch (vq->vq_index) {
+	case VSOCK_RXQ:
+		vq->callback = vsock_notify_rx;
+		break;
+	case VSOCK_TXQ:
+		vq->callback = vsock_notify_tx;
+		break;
+	case VSOCK_EVTQ:
+		vq->callback = vsock_notify_evt;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+static struct virtio_ops vsock_ops = {
+	.vq_init = vsock_init_vq,
+};
+
+/* virtio_vsock,cid=<guest cid>,path=<unix socket path> */
+static int vsock_parse_opts(struct virtio_vsock *vs, char *opts)
+{
+	char *str, *tmp, *cp;
+	int ret = 0;
+
+	str = tmp = strdup(opts);
+	if (!str)
+		return -ENOMEM;
+
+	while ((cp = strsep(&tmp, ",")) != NULL) {
+		if (!strncmp(cp, "cid=", 4))
+			vs->guest_cid = strtoull(cp + 4, NULL, 0);
+		else if (!strncmp(cp, "path=", 5) &&
+				strlen(cp + 5) < sizeof(vs->path) - 12)
+			strcpy(vs->path, cp + 5);
+		else if (*cp) {
+			pr_err("vsock: invalid option %s\n", cp);
+			ret = -EINVAL;
+		}
+	}
+
+	free(str);
+
+	if (vs->guest_cid <= VSOCK_HOST_CID || vs->guest_cid >= 0xffffffff ||
+			!vs->path[0]) {
+		pr_err("vsock: cid and path are required\n");
+		ret = -EINVAL;
+	}
+
+	return ret;
+}
+
+static int virtio_vsock_init(struct vdev *vdev, char *opts)
+{
+	struct virtio_vsock *vs;
+	int rc;
+
+	if (!opts) {
+		pr_err("vsock: cid and path are required\n");
+		return -EINVAL;
+	}
+
+	vs = calloc(1, sizeof(struct virtio_vsock));
+	if (!vs)
+		return -ENOMEM;
+
+	vs->listen_fd = -1;
+	vs->next_port = VSOCK_LOCAL_PORT_BASE;
+	init_list(&vs->conns);
+	pthread_mutex_init(&vs->mtx, NULL);
+
+	rc = vsock_parse_opts(vs, opts);
+	if (rc)
+		goto free_vs;
+
+	rc = virtio_device_init(&vs->virtio_dev, vdev, VIRTIO_TYPE_VSOCK,
+			VSOCK_NR_VQ, VIRTIO_VSOCK_RINGSZ, VIRTIO_VSOCK_IOVSZ);
+	if (rc) {
+		pr_err("failed to init virtio vsock device\n");
+		goto free_vs;
+	}
+
+	rc = vsock_listen(vs);
+	if (rc) {
+		virtio_device_deinit(&vs->virtio_dev);
+		goto free_vs;
+	}
+
+	vdev_set_pdata(vdev, vs);
+	vs->virtio_dev.ops = &vsock_ops;
+	vs->config = (struct virtio_vsock_config *)vs->virtio_dev.config;
+	vs->config->guest_cid = vs->guest_cid;
+
+	virtio_set_feature(&vs->virtio_dev, VIRTIO_F_VERSION_1);
+
+	return 0;
+
+free_vs:
+	free(vs);
+	return rc;
+}
+
+static void virtio_vsock_deinit(struct vdev *vdev)
+{
+	struct virtio_vsock *vs;
+
+	vs = (struct virtio_vsock *)vdev_get_pdata(vdev);
+	if (!vs)
+		return;
+
+	if (vs->listen_evp)
+		mevent_delete_close(vs->listen_evp);
+	unlink(vs->path);
+
+	vsock_close_all(vs);
+	virtio_device_deinit(&vs->virtio_dev);
+	free(vs);
+}
+
+static int virtio_vsock_reset(struct vdev *vdev)
+{
+	struct virtio_vsock *vs;
+
+	vs = (struct virtio_vsock *)vdev_get_pdata(vdev);
+	if (!vs)
+		return -EINVAL;
+
+	/* all the connections are lost when the driver reset */
+	vsock_close_all(vs);
+
+	return virtio_device_reset(&vs->virtio_dev);
+}
+
+static int virtio_vsock_event(struct vdev *vdev, int read,
+		unsigned long addr, unsigned long *value)
+{
+	struct virtio_vsock *vs;
+
+	if (!vdev)
+		return -EINVAL;
+
+	vs = (struct virtio_vsock *)vdev_get_pdata(vdev);
+	if (!vs)
+		return -EINVAL;
+
+	return virtio_handle_mmio(&vs->virtio_dev, read, addr, value);
+}
+
+struct vdev_ops virtio_vsock_ops = {
+	.name		= "virtio_vsock",
+	.init		= virtio_vsock_init,
+	.deinit		= virtio_vsock_deinit,
+	.reset		= virtio_vsock_reset,
+	.event		= virtio_vsock_event,
+};
+
+DEFINE_VDEV_TYPE(virtio_vsock_ops);
@@ -1,16 +1,80 @@
 #ifndef __DEBUG_H__
 #define __DEBUG_H__
 
-extern int verbose;
+/*
+ * log level, the messages which level is bigger than the
+ * MVM_LOG_LEVEL are removed when compiling, and the runtime
+ * level of each subsystem can be changed by "--log"
+ */
+#define LOG_ERR		0
+#define LOG_WARN	1
+#define LOG_INFO	2
+#define LOG_DEBUG	3
 
-#define pr_debug(...)	\
-	do {			\
-		if (verbose)	\
-			printf("[DEBUG] " __VA_ARGS__); \
+#ifndef MVM_LOG_LEVEL
+#define MVM_LOG_LEVEL	LOG_DEBUG
+#endif
+
+/*
+ * each source file can define the LOG_SUBSYS before include
+ * this file, otherwise it belongs to the core
+ */
+#define LOG_SUB_CORE	0
+#define LOG_SUB_VIRTIO	1
+#define LOG_SUB_BLK	2
+#define LOG_SUB_NET	3
+#define LOG_SUB_CON	4
+#define LOG_SUB_VSOCK	5
+#define LOG_SUB_MAX	6
+
+#ifndef LOG_SUBSYS
+#define LOG_SUBSYS	LOG_SUB_CORE
+#endif
+
+struct log_ratelimit {
+	unsigned long begin;
+	int printed;
+	int missed;
+};
+
+extern int mvm_log_levels[LOG_SUB_MAX];
+
+void mvm_log(int level, const char *fmt, ...)
+	__attribute__((format(printf, 2, 3)));
+int mvm_log_ratelimit(struct log_ratelimit *rs);
+void mvm_log_set_level(int subsys, int level);
+int mvm_log_parse(char *str);
+int mvm_log_init(void);
+
+/* only one branch if the level is disabled */
+#define log_enabled(level)	\
+	(((level) <= MVM_LOG_LEVEL) &&	\
+	 __builtin_expect((level) <= mvm_log_levels[LOG_SUBSYS], 0))
+
+#define pr_log(level, prefix, ...)				\
+	do {							\
+		if (log_enabled(level))				\
+			mvm_log(level, prefix __VA_ARGS__);	\
 	} while (0)
 
-#define pr_err(...)	printf("[ERROR] " __VA_ARGS__)
-#define pr_info(...)	printf("[INFO ] " __VA_ARGS__)
-#define pr_warn(...)	printf("[WARN ] " __VA_ARGS__)
+#define pr_log_ratelimited(level, prefix, ...)			\
+	do {							\
+		static struct log_ratelimit __rs;		\
+		if (log_enabled(level) &&			\
+				mvm_log_ratelimit(&__rs))	\
+			mvm_log(level, prefix __VA_ARGS__);	\
+	} while (0)
+
+#define pr_debug(...)	pr_log(LOG_DEBUG, "[DEBUG] ", __VA_ARGS__)
+#define pr_err(...)	pr_log(LOG_ERR, "[ERROR] ", __VA_ARGS__)
+#define pr_info(...)	pr_log(LOG_INFO, "[INFO ] ", __VA_ARGS__)
+#define pr_warn(...)	pr_log(LOG_WARN, "[WARN ] ", __VA_ARGS__)
+
+#define pr_err_ratelimited(...)		\
+	pr_log_ratelimited(LOG_ERR, "[ERROR] ", __VA_ARGS__)
+#define pr_warn_ratelimited(...)	\
+	pr_log_ratelimited(LOG_WARN, "[WARN ] ", __VA_ARGS__)
+#define pr_info_ratelimited(...)	\
+	pr_log_ratelimited(LOG_INFO, "[INFO ] ", __VA_ARGS__)
 
 #endif
@@ -29,6 +29,8 @@
 #ifndef	_MEVENT_H_
 #define	_MEVENT_H_
 
+#define	MEVENT_MAX_THREADS	8
+
 enum ev_type {
 	EVF_READ,
 	EVF_WRITE,
@@ -39,9 +41,13 @@ enum ev_type {
 struct mevent;
 struct vm;
 
+/*
+ * the events which have the same key are handled by the
+ * same i/o thread, the device usually use itself as the key
+ */
 struct mevent *mevent_add(int fd, enum ev_type type,
 			  void (*func)(int, enum ev_type, void *),
-			  void *param);
+			  void *param, void *key);
 int	mevent_enable(struct mevent *evp);
 int	mevent_disable(struct mevent *evp);
 int	mevent_delete(struct mevent *evp);
@@ -49,7 +55,7 @@ int	mevent_delete_close(struct mevent *evp);
 int	mevent_notify(void);
 
 void *mevent_dispatch(void *);
-int	mevent_init(void);
+int	mevent_init(int nr);
 void	mevent_deinit(void);
 
 #define list_foreach_safe(var, head, field, tvar)	\
@@ -36,6 +36,9 @@ struct vdev {
 	pthread_mutex_t lock;
 };
 
+typedef void (*ioevent_handler_t)(struct vdev *,
+		unsigned long, void *);
+
 #define DEFINE_VDEV_TYPE(ops)	\
 	static void *mvdev_ops_##ops __used __section("vdev_ops") = &ops
 
@@ -43,6 +46,7 @@ extern void * __start_vdev_ops;
 extern void *__stop_vdev_ops;
 
 int create_vdev(struct vm *vm, char *class, char *args);
+struct vdev *vdev_find_mmio(struct vm *vm, unsigned long addr);
 void *vdev_map_iomem(void *iomem, size_t size);
 void vdev_unmap_iomem(void *iomem, size_t size);
 void vdev_setup_env(struct vm *vm, void *data, int os_type);
@@ -51,6 +55,9 @@ void release_vdev(struct vdev *vdev);
 int vdev_subsystem_init(void);
 int vdev_alloc_irq(struct vm *vm, int nr);
 int vdev_alloc_and_request_irq(struct vm *vm, int nr);
+int vdev_register_ioevent(struct vdev *vdev, unsigned long addr,
+		unsigned long value, ioevent_handler_t handler, void *data);
+void vdev_handle_ioevents(struct vm *vm);
 
 static void inline vdev_set_pdata(struct vdev *vdev, void *data)
 {
@@ -23,6 +23,16 @@
 #define VIRTIO_F_NOTIFY_ON_EMPTY	24
 #define VIRTIO_F_ANY_LAYOUT		27
 #define VIRTIO_F_VERSION_1		32
+#define VIRTIO_F_RING_PACKED		34
+
+/* the avail and used flags of the packed ring desc */
+#define VRING_PACKED_DESC_F_AVAIL	(1 << 7)
+#define VRING_PACKED_DESC_F_USED	(1 << 15)
+
+#define VRING_PACKED_EVENT_FLAG_ENABLE	0x0
+#define VRING_PACKED_EVENT_FLAG_DISABLE	0x1
+#define VRING_PACKED_EVENT_FLAG_DESC	0x2
+#define VRING_PACKED_EVENT_F_WRAP_CTR	15
 
 #define VRING_AVAIL_ALIGN_SIZE		2
 #define VRING_USED_ALIGN_SIZE		4
@@ -42,6 +52,7 @@
 #define	VIRTIO_TYPE_SCSI		8
 #define	VIRTIO_TYPE_9P			9
 #define	VIRTIO_TYPE_INPUT		18
+#define	VIRTIO_TYPE_VSOCK		19
 
 #define VIRTIO_DEV_STATUS_ACK		(1)
 #define VIRTIO_DEV_STATUS_DRIVER	(2)
@@ -83,6 +94,18 @@ struct vring_desc {
 	uint16_t next;
 } __attribute__((__packed__));
 
+struct vring_packed_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t id;
+	uint16_t flags;
+} __attribute__((__packed__));
+
+struct vring_packed_desc_event {
+	uint16_t off_wrap;
+	uint16_t flags;
+} __attribute__((__packed__));
+
 struct virtio_device;
 
 struct virt_queue {
@@ -100,6 +123,33 @@ struct virt_queue {
 	uint16_t signalled_used_valid;
 	uint16_t vq_index;
 
+	/*
+	 * for the packed ring, the last_avail_idx and the
+	 * last_used_idx are the offset in the desc ring, the
+	 * driver area and the device area are the event
+	 * suppression structures
+	 */
+	int packed;
+	struct vring_packed_desc *pdesc;
+	struct vring_packed_desc_event *driver_event;
+	struct vring_packed_desc_event *device_event;
+	uint16_t avail_wrap_counter;
+	uint16_t used_wrap_counter;
+	uint16_t hist_idx;
+	uint16_t *ndescs;	/* how many descs each buffer id used */
+	uint16_t *hist;		/* desc count of the fetched buffers */
+
+	/*
+	 * adaptive busy poll of the avail ring, the budget is
+	 * doubled when new buffers come during the poll and
+	 * halved when not, poll_max_ns is 0 if disabled
+	 */
+	uint32_t poll_max_ns;
+	uint32_t poll_ns;
+	uint64_t kicks;
+	uint64_t poll_hits;	/* the kicks avoided by the poll */
+	uint64_t poll_misses;
+
 	struct virtio_device *dev;
 	struct iovec *iovec;
 
@@ -116,6 +166,7 @@ struct virtio_ops {
 	int (*vq_reset)(struct virt_queue *);
 	void (*vq_deinit)(struct virt_queue *);
 	void (*neg_features)(struct virtio_device *);
+	void (*cfg_write)(struct virtio_device *, unsigned long, uint32_t);
 };
 
 struct virtio_device {
@@ -123,12 +174,30 @@ struct virtio_device {
 	struct virt_queue *vqs;
 	int nr_vq;
 	uint64_t acked_features;
+	int broken;		/* set when need reset by the driver */
 	void *config;
 	struct virtio_ops *ops;
+	struct list_head list;
 };
 
+static int inline vring_packed_desc_avail(uint16_t flags, int wrap)
+{
+	int avail = !!(flags & VRING_PACKED_DESC_F_AVAIL);
+	int used = !!(flags & VRING_PACKED_DESC_F_USED);
+
+	return (avail == wrap) && (used != wrap);
+}
+
 static int inline virtq_has_descs(struct virt_queue *vq)
 {
+	if (vq->dev->broken)
+		return 0;
+
+	if (vq->packed)
+		return vring_packed_desc_avail(
+			vq->pdesc[vq->last_avail_idx].flags,
+			vq->avail_wrap_counter);
+
 	return vq->avail->idx != vq->last_avail_idx;
 }
 
@@ -169,14 +238,15 @@ static int inline virtq_has_feature(struct virt_queue *vq, int fe)
 
 static inline void virtio_send_irq(struct virtio_device *dev, int type)
 {
-	uint32_t value = 0;
-
-	value = ioread32(dev->vdev->iomem + VIRTIO_MMIO_INTERRUPT_STATUS);
-	rmb();
+	uint32_t *status;
 
-	value |= type;
-	iowrite32(dev->vdev->iomem + VIRTIO_MMIO_INTERRUPT_STATUS, value);
-	wmb();
+	/*
+	 * the queues of a multi-queue device may signal at the
+	 * same time from different threads, update the status
+	 * atomically
+	 */
+	status = dev->vdev->iomem + VIRTIO_MMIO_INTERRUPT_STATUS;
+	__atomic_fetch_or(status, type, __ATOMIC_SEQ_CST);
 
 	vdev_send_irq(dev->vdev);
 }
@@ -185,6 +255,9 @@ int virtio_device_init(struct virtio_device *,
 		struct vdev *, int, int, int, int);
 int virtq_enable_notify(struct virt_queue *vq);
 void virtq_disable_notify(struct virt_queue *vq);
+int virtq_poll(struct virt_queue *vq);
+void virtio_set_poll(struct virtio_device *dev, int us);
+void virtio_dump_stats(void);
 
 int virtio_handle_mmio(struct virtio_device *dev, int write,
 		unsigned long addr, unsigned long *value);
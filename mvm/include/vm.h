@@ -10,6 +10,7 @@
 #define VM_STAT_SUSPEND			0x1
 
 #define VM_MAX_DEVICES	(10)
+#define VM_MAX_MEM_REGIONS	(8)
 
 struct device_info {
 	int nr_device;
@@ -26,6 +27,17 @@ struct vm_config {
 	char kernel_image[256];
 	char dtb_image[256];
 	char ramdisk_image[256];
+	int nr_mevent_threads;
+};
+
+/*
+ * a guest physical memory region which is mapped to
+ * the address space of the mvm
+ */
+struct vm_mem_region {
+	uint64_t gpa;
+	uint64_t size;
+	void *hva;
 };
 
 /*
@@ -59,25 +71,108 @@ struct vm {
 	struct vm_config *vm_config;
 	struct mvm_queue queue;
 
+	/* guest memory regions sorted by the gpa */
+	struct vm_mem_region mem_regions[VM_MAX_MEM_REGIONS];
+	int nr_mem_regions;
+
 	void *vmcs;
 	int *eventfds;
 	int *epfds;
 	int *irqs;
 
+	struct virq_doorbell *virq_db;
+	struct ioevent_doorbell *ioevent_db;
+	struct vcpu_stats *stats;
+	int ioevent_irq;
+	int ioevent_fd;
+
 	struct list_head vdev_list;
+
+	/* vdevs sorted by guest_iomem for mmio dispatch */
+	struct vdev **vdev_index;
+	int nr_vdevs;
 };
 
 extern struct vm *mvm_vm;
 
-#define gpa_to_hvm_va(gpa) \
-	(unsigned long)(mvm_vm->mmap + ((gpa) - mvm_vm->mem_start))
+extern __thread struct vm_mem_region *mem_region_cache;
 
 void *map_vm_memory(struct vm *vm);
+int vm_add_mem_region(struct vm *vm, uint64_t gpa,
+		uint64_t size, void *hva);
+void *__gpa_to_hva(uint64_t gpa, uint64_t len);
+
+static inline int mem_region_contain(struct vm_mem_region *region,
+		uint64_t gpa, uint64_t len)
+{
+	uint64_t offset = gpa - region->gpa;
+
+	/* the unsigned offset also cover the gpa below the region */
+	return (offset < region->size) && (len <= region->size - offset);
+}
+
+/*
+ * translate the guest physical address to the mvm virtual
+ * address, the whole [gpa, gpa + len) must inside one memory
+ * region, otherwise return NULL. each thread cache the region
+ * which it hit last time, the data path of the virtio device
+ * usually only access one region
+ */
+static inline void *gpa_to_hva(uint64_t gpa, uint64_t len)
+{
+	struct vm_mem_region *region = mem_region_cache;
+
+	if (region && mem_region_contain(region, gpa, len))
+		return region->hva + (gpa - region->gpa);
+
+	return __gpa_to_hva(gpa, len);
+}
 void *hvm_map_iomem(void *base, size_t size);
 
+extern __thread int virq_batch_depth;
+
+static inline void kick_virq_doorbell(struct virq_doorbell *db)
+{
+	if (!__atomic_exchange_n(&db->kicked, 1, __ATOMIC_ACQ_REL))
+		ioctl(mvm_vm->vm_fd, IOCTL_KICK_VIRQ_DOORBELL, 0);
+}
+
+/*
+ * if the virq doorbell is enabled, the virq is set to
+ * pending in the doorbell page and the hypervisor inject
+ * all the pending virqs at one time, inside a virq batch
+ * the kick is delayed to the end of the batch
+ */
 static inline void send_virq_to_vm(int virq)
 {
-	ioctl(mvm_vm->vm_fd, IOCTL_SEND_VIRQ, (long)virq);
+	struct virq_doorbell *db = mvm_vm->virq_db;
+
+	if (!db || (virq >= VM_MAX_DOORBELL_VIRQS)) {
+		ioctl(mvm_vm->vm_fd, IOCTL_SEND_VIRQ, (long)virq);
+		return;
+	}
+
+	__atomic_fetch_or(&db->pending[virq / 32],
+			1U << (virq % 32), __ATOMIC_RELEASE);
+
+	if (!virq_batch_depth)
+		kick_virq_doorbell(db);
+}
+
+static inline void virq_batch_begin(void)
+{
+	virq_batch_depth++;
+}
+
+static inline void virq_batch_end(void)
+{
+	struct virq_doorbell *db = mvm_vm->virq_db;
+
+	if (--virq_batch_depth)
+		return;
+
+	if (db)
+		kick_virq_doorbell(db);
 }
 
 static inline int request_virq(unsigned long flags)
@@ -0,0 +1,347 @@
+/*
+ * BSD 3-Clause License
+ *
+ * Copyright (C) 2018 Min Le (lemin9538@gmail.com)
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the distribution.
+ *
+ * 3. Neither the name of the copyright holder nor the names of its
+ *    contributors may be used to endorse or promote products derived from
+ *    this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED
+ * TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR
+ * PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR
+ * CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL,
+ * EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+ * PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS;
+ * OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY,
+ * WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR
+ * OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF
+ * ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <mvm.h>
+
+#define LOG_RING_SIZE		256
+#define LOG_RING_MASK		(LOG_RING_SIZE - 1)
+#define LOG_MSG_SIZE		248
+
+#define LOG_RATELIMIT_INTERVAL	5	/* seconds */
+#define LOG_RATELIMIT_BURST	10
+
+/*
+ * the messages are put to a lock free ring by the callers
+ * and the log thread write them to the stdout, so the hot
+ * path never block on the console. the seq of each slot
+ * tell the slot is free (seq == pos) or filled (seq == pos + 1).
+ * the log thread sleep on the eventfd when the ring is empty,
+ * and only the first message after it sleep will wake it up
+ */
+struct log_slot {
+	unsigned long seq;
+	char msg[LOG_MSG_SIZE];
+};
+
+static struct log_slot log_ring[LOG_RING_SIZE];
+static unsigned long log_head;
+static unsigned long log_tail;
+static unsigned long log_dropped;
+static int log_thread_running;
+static int log_sleeping;
+static int log_wake_fd = -1;
+static pthread_t log_tid;
+static pthread_mutex_t log_drain_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int mvm_log_levels[LOG_SUB_MAX] = {
+	[0 ... LOG_SUB_MAX - 1] = LOG_INFO,
+};
+
+static char *log_subsys_name[LOG_SUB_MAX] = {
+	[LOG_SUB_CORE]		= "core",
+	[LOG_SUB_VIRTIO]	= "virtio",
+	[LOG_SUB_BLK]		= "blk",
+	[LOG_SUB_NET]		= "net",
+	[LOG_SUB_CON]		= "console",
+	[LOG_SUB_VSOCK]		= "vsock",
+};
+
+static char *log_level_name[] = {
+	[LOG_ERR]		= "err",
+	[LOG_WARN]		= "warn",
+	[LOG_INFO]		= "info",
+	[LOG_DEBUG]		= "debug",
+};
+
+static int log_ring_put(const char *fmt, va_list ap)
+{
+	struct log_slot *slot;
+	unsigned long pos, seq;
+
+	pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+	for (;;) {
+		slot = &log_ring[pos & LOG_RING_MASK];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&log_head, &pos,
+					pos + 1, 0, __ATOMIC_RELAXED,
+					__ATOMIC_RELAXED))
+				break;
+		} else if (seq < pos) {
+			/* the ring is full */
+			__atomic_fetch_add(&log_dropped, 1, __ATOMIC_RELAXED);
+			return -ENOSPC;
+		} else {
+			pos = __atomic_load_n(&log_head, __ATOMIC_RELAXED);
+		}
+	}
+
+	vsnprintf(slot->msg, LOG_MSG_SIZE, fmt, ap);
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	/* pair with the fence in log_thread */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&log_sleeping, __ATOMIC_RELAXED) &&
+			__atomic_exchange_n(&log_sleeping, 0, __ATOMIC_RELAXED))
+		eventfd_write(log_wake_fd, 1);
+
+	return 0;
+}
+
+static int log_ring_drain(void)
+{
+	struct log_slot *slot;
+	unsigned long dropped;
+	int nr = 0;
+
+	pthread_mutex_lock(&log_drain_lock);
+
+	for (;;) {
+		slot = &log_ring[log_tail & LOG_RING_MASK];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) !=
+				log_tail + 1)
+			break;
+
+		fputs(slot->msg, stdout);
+		__atomic_store_n(&slot->seq, log_tail + LOG_RING_SIZE,
+				__ATOMIC_RELEASE);
+		log_tail++;
+		nr++;
+	}
+
+	dropped = __atomic_exchange_n(&log_dropped, 0, __ATOMIC_RELAXED);
+	if (dropped)
+		printf("[WARN ] %lu log messages dropped\n", dropped);
+
+	if (nr || dropped)
+		fflush(stdout);
+
+	pthread_mutex_unlock(&log_drain_lock);
+
+	return nr;
+}
+
+static void *log_thread(void *data)
+{
+	eventfd_t value;
+
+	for (;;) {
+		if (log_ring_drain())
+			continue;
+
+		/*
+		 * recheck the ring after telling the producers that
+		 * it is going to sleep, so a message put before the
+		 * flag is set will not be missed
+		 */
+		__atomic_store_n(&log_sleeping, 1, __ATOMIC_RELAXED);
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		if (log_ring_drain()) {
+			/* the eventfd may be written, drained next time */
+			__atomic_store_n(&log_sleeping, 0, __ATOMIC_RELAXED);
+			continue;
+		}
+
+		eventfd_read(log_wake_fd, &value);
+	}
+
+	return NULL;
+}
+
+static void log_exit(void)
+{
+	log_ring_drain();
+}
+
+void mvm_log(int level, const char *fmt, ...)
+{
+	va_list ap;
+
+	va_start(ap, fmt);
+
+	/*
+	 * error message is printed directly since the program
+	 * may exit soon after it
+	 */
+	if ((level != LOG_ERR) &&
+			__atomic_load_n(&log_thread_running, __ATOMIC_ACQUIRE))
+		log_ring_put(fmt, ap);
+	else
+		vprintf(fmt, ap);
+
+	va_end(ap);
+}
+
+static unsigned long log_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+/*
+ * allow LOG_RATELIMIT_BURST messages in LOG_RATELIMIT_INTERVAL
+ * for each call site, the state is not protected by lock, the
+ * count may be a little inexact when called concurrently
+ */
+int mvm_log_ratelimit(struct log_ratelimit *rs)
+{
+	unsigned long now = log_now();
+	int missed;
+
+	if (!rs->begin || (now - rs->begin) >= LOG_RATELIMIT_INTERVAL) {
+		missed = rs->missed;
+		rs->begin = now;
+		rs->printed = 0;
+		rs->missed = 0;
+		if (missed)
+			mvm_log(LOG_WARN, "[WARN ] %d messages suppressed\n",
+					missed);
+	}
+
+	if (rs->printed < LOG_RATELIMIT_BURST) {
+		rs->printed++;
+		return 1;
+	}
+
+	rs->missed++;
+
+	return 0;
+}
+
+void mvm_log_set_level(int subsys, int level)
+{
+	int i;
+
+	if (level < LOG_ERR)
+		level = LOG_ERR;
+	else if (level > LOG_DEBUG)
+		level = LOG_DEBUG;
+
+	if (subsys < 0) {
+		for (i = 0; i < LOG_SUB_MAX; i++)
+			mvm_log_levels[i] = level;
+	} else if (subsys < LOG_SUB_MAX)
+		mvm_log_levels[subsys] = level;
+}
+
+static int log_find_name(char **names, int nr, char *name)
+{
+	int i;
+
+	for (i = 0; i < nr; i++) {
+		if (names[i] && !strcmp(names[i], name))
+			return i;
+	}
+
+	return -ENOENT;
+}
+
+/*
+ * parse the log option like "debug" or "net=debug,blk=warn"
+ */
+int mvm_log_parse(char *str)
+{
+	char *buf, *opts, *cp, *level;
+	int subsys, lvl, ret = 0;
+
+	buf = opts = strdup(str);
+	if (!buf)
+		return -ENOMEM;
+
+	while ((cp = strsep(&opts, ",")) != NULL) {
+		level = strchr(cp, '=');
+		if (level)
+			*level++ = 0;
+		else
+			level = cp;
+
+		lvl = log_find_name(log_level_name, LOG_DEBUG + 1, level);
+		if (lvl < 0) {
+			ret = -EINVAL;
+			break;
+		}
+
+		if (level == cp) {
+			mvm_log_set_level(-1, lvl);
+			continue;
+		}
+
+		subsys = log_find_name(log_subsys_name, LOG_SUB_MAX, cp);
+		if (subsys < 0) {
+			ret = -EINVAL;
+			break;
+		}
+
+		mvm_log_set_level(subsys, lvl);
+	}
+
+	free(buf);
+
+	return ret;
+}
+
+int mvm_log_init(void)
+{
+	int i, ret;
+
+	for (i = 0; i < LOG_RING_SIZE; i++)
+		log_ring[i].seq = i;
+
+	log_wake_fd = eventfd(0, EFD_CLOEXEC);
+	if (log_wake_fd < 0) {
+		pr_warn("failed to create log eventfd\n");
+		return -errno;
+	}
+
+	ret = pthread_create(&log_tid, NULL, log_thread, NULL);
+	if (ret) {
+		pr_warn("failed to create log thread %d\n", ret);
+		close(log_wake_fd);
+		log_wake_fd = -1;
+		return ret;
+	}
+
+	pthread_setname_np(log_tid, "mvm-log");
+	atexit(log_exit);
+	__atomic_store_n(&log_thread_running, 1, __ATOMIC_RELEASE);
+
+	return 0;
+}
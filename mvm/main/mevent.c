@@ -27,8 +27,12 @@
  */
 
 /*
- * Micro event library for FreeBSD, designed for a single i/o thread
- * using EPOLL, and having events be persistent by default.
+ * Micro event library for FreeBSD, using EPOLL, and having events be
+ * persistent by default. The events are sharded to several i/o
+ * threads by the key of the caller, each thread has its own epoll fd,
+ * the events which have the same key, usually the events of one
+ * device, are always handled by the same thread, so their callbacks
+ * never run concurrently.
  */
 
 #include <assert.h>
@@ -38,24 +42,24 @@
 #include <stdbool.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/queue.h>
 #include <pthread.h>
 #include <string.h>
 
 #include "mevent.h"
 #include <vm.h>
+#include <debug.h>
 
 #define	MEVENT_MAX	64
+#define	MEVENT_MAX_KEYS	64
 
 #define	MEV_ADD		1
 #define	MEV_ENABLE	2
 #define	MEV_DISABLE	3
 #define	MEV_DEL_PENDING	4
 
-static int epoll_fd;
-static pthread_t mevent_tid;
-static int mevent_pipefd[2];
-static pthread_mutex_t mevent_lmutex = PTHREAD_MUTEX_INITIALIZER;
+struct mevent_base;
 
 struct mevent {
 	void	(*me_func)(int, enum ev_type, void *);
@@ -65,53 +69,99 @@ struct mevent {
 	int	me_cq;
 	int	me_state;
 	int	me_closefd;
+	struct mevent_base *me_base;
 
 	LIST_ENTRY(mevent) me_list;
 };
 
-static LIST_HEAD(listhead, mevent) global_head;
+LIST_HEAD(listhead, mevent);
+
+/*
+ * one base for each i/o thread, the lock only protect the
+ * lists which are changed when adding or deleting a event,
+ * the dispatch loop never take it
+ */
+struct mevent_base {
+	int	epoll_fd;
+	int	wake_fd;
+	int	index;
+	int	started;
+	pthread_t tid;
+	pthread_mutex_t mtx;
+	struct listhead head;
+	struct listhead free_head;	/* freed by the i/o thread */
+};
+
+/* the base which the events of a key are added to */
+struct mevent_key {
+	void	*key;
+	struct mevent_base *base;
+};
+
+static struct mevent_base mevent_bases[MEVENT_MAX_THREADS];
+static int mevent_nr_bases;
+static unsigned int mevent_next_base;
+static struct vm *mevent_vm;
+static int mevent_exiting;
+
+static struct mevent_key mevent_keys[MEVENT_MAX_KEYS];
+static int mevent_nr_keys;
+static pthread_mutex_t mevent_key_mtx = PTHREAD_MUTEX_INITIALIZER;
 
 static void
-mevent_qlock(void)
+mevent_qlock(struct mevent_base *base)
 {
-	pthread_mutex_lock(&mevent_lmutex);
+	pthread_mutex_lock(&base->mtx);
 }
 
 static void
-mevent_qunlock(void)
+mevent_qunlock(struct mevent_base *base)
 {
-	pthread_mutex_unlock(&mevent_lmutex);
+	pthread_mutex_unlock(&base->mtx);
 }
 
 static void
-mevent_pipe_read(int fd, enum ev_type type, void *param)
+mevent_wake_read(int fd, enum ev_type type, void *param)
 {
-	char buf[MEVENT_MAX];
+	uint64_t val;
 	int status;
 
 	/*
-	 * Drain the pipe read side. The fd is non-blocking so this is
+	 * Drain the eventfd. The fd is non-blocking so this is
 	 * safe to do.
 	 */
-	do {
-		status = read(fd, buf, sizeof(buf));
-	} while (status == MEVENT_MAX);
+	status = read(fd, &val, sizeof(val));
+	(void)status;
+}
+
+static int
+mevent_wake(struct mevent_base *base)
+{
+	uint64_t val = 1;
+
+	if (base->wake_fd <= 0 || pthread_equal(pthread_self(), base->tid))
+		return 0;
+
+	if (write(base->wake_fd, &val, sizeof(val)) != sizeof(val))
+		return -1;
+
+	return 0;
 }
 
 /*On error, -1 is returned, else return zero*/
 int
 mevent_notify(void)
 {
-	char c;
+	int i, ret = 0;
 
 	/*
-	 * If calling from outside the i/o thread, write a byte on the
-	 * pipe to force the i/o thread to exit the blocking epoll call.
+	 * If calling from outside the i/o thread, signal the eventfd
+	 * to force the i/o threads to exit the blocking epoll call.
 	 */
-	if (mevent_pipefd[1] != 0 && pthread_self() != mevent_tid)
-		if (write(mevent_pipefd[1], &c, 1) <= 0)
-			return -1;
-	return 0;
+	for (i = 0; i < mevent_nr_bases; i++)
+		ret |= mevent_wake(&mevent_bases[i]);
+
+	return ret;
 }
 
 static int
@@ -129,50 +179,153 @@ mevent_kq_filter(struct mevent *mevp)
 	return retval;
 }
 
+static void
+mevent_free_pending(struct mevent_base *base)
+{
+	struct mevent *mevp;
+
+	if (LIST_EMPTY(&base->free_head))
+		return;
+
+	mevent_qlock(base);
+	while ((mevp = LIST_FIRST(&base->free_head)) != NULL) {
+		LIST_REMOVE(mevp, me_list);
+		free(mevp);
+	}
+	mevent_qunlock(base);
+}
+
 static void
 mevent_destroy(void)
 {
+	struct mevent_base *base;
 	struct mevent *mevp, *tmpp;
 	struct epoll_event ee;
+	int i;
 
-	mevent_qlock();
+	for (i = 0; i < mevent_nr_bases; i++) {
+		base = &mevent_bases[i];
+		mevent_qlock(base);
+
+		list_foreach_safe(mevp, &base->head, me_list, tmpp) {
+			LIST_REMOVE(mevp, me_list);
+			ee.events = mevent_kq_filter(mevp);
+			ee.data.ptr = mevp;
+			epoll_ctl(base->epoll_fd, EPOLL_CTL_DEL,
+					mevp->me_fd, &ee);
+			if ((mevp->me_type == EVF_READ ||
+				mevp->me_type == EVF_WRITE)
+				&& mevp->me_fd != STDIN_FILENO
+				&& mevp->me_fd != base->wake_fd)
+				close(mevp->me_fd);
+
+			free(mevp);
+		}
 
-	list_foreach_safe(mevp, &global_head, me_list, tmpp) {
-		LIST_REMOVE(mevp, me_list);
-		ee.events = mevent_kq_filter(mevp);
-		ee.data.ptr = mevp;
-		epoll_ctl(epoll_fd, EPOLL_CTL_DEL, mevp->me_fd, &ee);
-		if ((mevp->me_type == EVF_READ ||
-			mevp->me_type == EVF_WRITE)
-			&& mevp->me_fd != STDIN_FILENO)
-			close(mevp->me_fd);
+		list_foreach_safe(mevp, &base->free_head, me_list, tmpp) {
+			LIST_REMOVE(mevp, me_list);
+			free(mevp);
+		}
 
-		free(mevp);
+		mevent_qunlock(base);
 	}
-
-	mevent_qunlock();
 }
 
 static void
-mevent_handle(struct epoll_event *kev, int numev)
+mevent_handle(struct mevent_base *base, struct epoll_event *kev, int numev)
 {
 	int i;
 	struct mevent *mevp;
 
 	for (i = 0; i < numev; i++) {
 		mevp = kev[i].data.ptr;
+
+		/* deleted by other callback of this batch */
+		if (__atomic_load_n(&mevp->me_state, __ATOMIC_ACQUIRE) ==
+				MEV_DEL_PENDING)
+			continue;
+
 		/* XXX check for EV_ERROR ? */
 		(*mevp->me_func)(mevp->me_fd, mevp->me_type, mevp->me_param);
 	}
+
+	/*
+	 * the deleted events can be freed now, since epoll will
+	 * not return them anymore
+	 */
+	mevent_free_pending(base);
+}
+
+static struct mevent *
+mevent_find(int tfd, enum ev_type type)
+{
+	struct mevent_base *base;
+	struct mevent *lp;
+	int i;
+
+	for (i = 0; i < mevent_nr_bases; i++) {
+		base = &mevent_bases[i];
+		mevent_qlock(base);
+		LIST_FOREACH(lp, &base->head, me_list) {
+			if (lp->me_fd == tfd && lp->me_type == type) {
+				mevent_qunlock(base);
+				return lp;
+			}
+		}
+		mevent_qunlock(base);
+	}
+
+	return NULL;
+}
+
+/*
+ * the keys are assigned to the bases round robin when they
+ * are first used, the event without a key do not share any
+ * state with others and can go to any base
+ */
+static struct mevent_base *
+mevent_get_base(void *key)
+{
+	struct mevent_base *base;
+	int i;
+
+	pthread_mutex_lock(&mevent_key_mtx);
+
+	for (i = 0; key && i < mevent_nr_keys; i++) {
+		if (mevent_keys[i].key == key) {
+			base = mevent_keys[i].base;
+			goto out;
+		}
+	}
+
+	if (key && mevent_nr_keys >= MEVENT_MAX_KEYS) {
+		/* too many keys, hash it so it always get the same base */
+		base = &mevent_bases[((unsigned long)key >> 4) %
+				mevent_nr_bases];
+		goto out;
+	}
+
+	base = &mevent_bases[mevent_next_base++ % mevent_nr_bases];
+	if (key) {
+		mevent_keys[mevent_nr_keys].key = key;
+		mevent_keys[mevent_nr_keys].base = base;
+		mevent_nr_keys++;
+	}
+out:
+	pthread_mutex_unlock(&mevent_key_mtx);
+
+	return base;
 }
 
 struct mevent *
 mevent_add(int tfd, enum ev_type type,
-	   void (*func)(int, enum ev_type, void *), void *param)
+	   void (*func)(int, enum ev_type, void *), void *param,
+	   void *key)
 {
 	int ret;
 	struct epoll_event ee;
-	struct mevent *lp, *mevp;
+	struct mevent *mevp;
+	struct mevent_base *base;
 
 	if (tfd < 0 || func == NULL)
 		return NULL;
@@ -180,15 +333,15 @@ mevent_add(int tfd, enum ev_type type,
 	if (type == EVF_TIMER)
 		return NULL;
 
-	mevent_qlock();
+	if (mevent_nr_bases == 0)
+		return NULL;
+
 	/* Verify that the fd/type tuple is not present in the list */
-	LIST_FOREACH(lp, &global_head, me_list) {
-		if (lp->me_fd == tfd && lp->me_type == type) {
-			mevent_qunlock();
-			return lp;
-		}
-	}
-	mevent_qunlock();
+	mevp = mevent_find(tfd, type);
+	if (mevp)
+		return mevp;
+
+	base = mevent_get_base(key);
 
 	/*
 	 * Allocate an entry, populate it, and add it to the list.
@@ -201,51 +354,92 @@ mevent_add(int tfd, enum ev_type type,
 	mevp->me_type = type;
 	mevp->me_func = func;
 	mevp->me_param = param;
+	mevp->me_base = base;
+	mevp->me_state = MEV_ADD;
+
+	mevent_qlock(base);
+	LIST_INSERT_HEAD(&base->head, mevp, me_list);
+	mevent_qunlock(base);
 
 	ee.events = mevent_kq_filter(mevp);
 	ee.data.ptr = mevp;
-	ret = epoll_ctl(epoll_fd, EPOLL_CTL_ADD, mevp->me_fd, &ee);
-	if (ret == 0) {
-		mevent_qlock();
-		LIST_INSERT_HEAD(&global_head, mevp, me_list);
-		mevent_qunlock();
-
+	ret = epoll_ctl(base->epoll_fd, EPOLL_CTL_ADD, mevp->me_fd, &ee);
+	if (ret == 0)
 		return mevp;
-	} else {
-		free(mevp);
-		return NULL;
-	}
+
+	mevent_qlock(base);
+	LIST_REMOVE(mevp, me_list);
+	mevent_qunlock(base);
+	free(mevp);
+
+	return NULL;
 }
 
 int
 mevent_enable(struct mevent *evp)
 {
+	struct epoll_event ee;
+
+	if (!evp)
+		return -EINVAL;
+
+	ee.events = mevent_kq_filter(evp);
+	ee.data.ptr = evp;
+	if (epoll_ctl(evp->me_base->epoll_fd, EPOLL_CTL_ADD,
+			evp->me_fd, &ee) && errno != EEXIST)
+		return -errno;
+
 	return 0;
 }
 
+/*
+ * remove the fd from the epoll but keep the event, so it
+ * can be enabled again later
+ */
 int
 mevent_disable(struct mevent *evp)
 {
+	struct epoll_event ee;
+
+	if (!evp)
+		return -EINVAL;
+
+	ee.events = mevent_kq_filter(evp);
+	ee.data.ptr = evp;
+	if (epoll_ctl(evp->me_base->epoll_fd, EPOLL_CTL_DEL,
+			evp->me_fd, &ee) && errno != ENOENT)
+		return -errno;
+
 	return 0;
 }
 
+/*
+ * the event may be returned by the epoll_wait of its i/o thread
+ * at the same time, so it is only marked as deleted here and
+ * freed by the i/o thread after handling the current batch
+ */
 static int
 mevent_delete_event(struct mevent *evp, int closefd)
 {
+	struct mevent_base *base = evp->me_base;
 	struct epoll_event ee;
 
-	mevent_qlock();
-	LIST_REMOVE(evp, me_list);
-	mevent_qunlock();
+	__atomic_store_n(&evp->me_state, MEV_DEL_PENDING, __ATOMIC_RELEASE);
 
 	ee.events = mevent_kq_filter(evp);
 	ee.data.ptr = evp;
-	epoll_ctl(epoll_fd, EPOLL_CTL_DEL, evp->me_fd, &ee);
+	epoll_ctl(base->epoll_fd, EPOLL_CTL_DEL, evp->me_fd, &ee);
 
 	if (closefd)
 		close(evp->me_fd);
 
-	free(evp);
+	mevent_qlock(base);
+	LIST_REMOVE(evp, me_list);
+	LIST_INSERT_HEAD(&base->free_head, evp, me_list);
+	mevent_qunlock(base);
+
+	mevent_wake(base);
+
 	return 0;
 }
 
@@ -261,76 +455,182 @@ mevent_delete_close(struct mevent *evp)
 	return mevent_delete_event(evp, 1);
 }
 
-static void mevent_set_name(int vmid)
+static void mevent_set_name(struct mevent_base *base, int vmid)
 {
 	char name[64];
 
 	memset(name, 0, 64);
-	sprintf(name, "vm-%d-mevent", vmid);
-	pthread_setname_np(mevent_tid, name);
+	sprintf(name, "vm-%d-mevent%d", vmid, base->index);
+	pthread_setname_np(base->tid, name);
+}
+
+static int
+mevent_base_init(struct mevent_base *base, int index)
+{
+	struct epoll_event ee;
+	struct mevent *wakev;
+
+	base->index = index;
+	pthread_mutex_init(&base->mtx, NULL);
+	LIST_INIT(&base->head);
+	LIST_INIT(&base->free_head);
+
+	base->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (base->epoll_fd < 0)
+		return -errno;
+
+	/*
+	 * The eventfd will be used for other threads to force the
+	 * blocking epoll call to exit by writing to it.
+	 */
+	base->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (base->wake_fd < 0)
+		return -errno;
+
+	/*
+	 * Add internal event handler for the eventfd
+	 */
+	wakev = calloc(1, sizeof(struct mevent));
+	if (!wakev)
+		return -ENOMEM;
+
+	wakev->me_fd = base->wake_fd;
+	wakev->me_type = EVF_READ;
+	wakev->me_func = mevent_wake_read;
+	wakev->me_base = base;
+	LIST_INSERT_HEAD(&base->head, wakev, me_list);
+
+	ee.events = EPOLLIN;
+	ee.data.ptr = wakev;
+
+	return epoll_ctl(base->epoll_fd, EPOLL_CTL_ADD, base->wake_fd, &ee);
 }
 
 int
-mevent_init(void)
+mevent_init(int nr)
 {
-	epoll_fd = epoll_create1(0);
-	assert(epoll_fd >= 0);
+	int i, ret;
+
+	if (nr > MEVENT_MAX_THREADS)
+		nr = MEVENT_MAX_THREADS;
+	else if (nr <= 0)
+		nr = 1;
+
+	for (i = 0; i < nr; i++) {
+		ret = mevent_base_init(&mevent_bases[i], i);
+		mevent_nr_bases++;
+		if (ret) {
+			pr_err("mevent: init i/o thread %d failed\n", i);
+			return -1;
+		}
+	}
 
-	if (epoll_fd >= 0)
-		return 0;
-	else
-		return -1;
+	return 0;
 }
 
+/*
+ * stop the i/o threads first, so no callback is running
+ * when the events are freed, if called by one of the i/o
+ * threads, this thread will not run the events anymore
+ * after return
+ */
 void
 mevent_deinit(void)
 {
+	struct mevent_base *base;
+	int i;
+
+	__atomic_store_n(&mevent_exiting, 1, __ATOMIC_RELEASE);
+
+	for (i = 0; i < mevent_nr_bases; i++) {
+		base = &mevent_bases[i];
+		if (!base->started)
+			continue;
+
+		mevent_wake(base);
+		if (!pthread_equal(pthread_self(), base->tid))
+			pthread_join(base->tid, NULL);
+	}
+
 	mevent_destroy();
-	close(epoll_fd);
+
+	for (i = 0; i < mevent_nr_bases; i++) {
+		base = &mevent_bases[i];
+		if (base->epoll_fd > 0)
+			close(base->epoll_fd);
+		if (base->wake_fd > 0)
+			close(base->wake_fd);
+		base->epoll_fd = -1;
+		base->wake_fd = -1;
+		base->started = 0;
+	}
+
+	mevent_nr_bases = 0;
+	mevent_nr_keys = 0;
 }
 
-void *mevent_dispatch(void *data)
+static void *
+mevent_base_dispatch(void *data)
 {
 	struct epoll_event eventlist[MEVENT_MAX];
-	struct mevent *pipev;
+	struct mevent_base *base = data;
 	int ret;
-	struct vm *vm;
 
-	vm = (struct vm *)data;
-	mevent_tid = pthread_self();
-	mevent_set_name(vm->vmid);
+	base->tid = pthread_self();
+	mevent_set_name(base, mevent_vm->vmid);
 
-	/*
-	 * Open the pipe that will be used for other threads to force
-	 * the blocking kqueue call to exit by writing to it. Set the
-	 * descriptor to non-blocking.
-	 */
-	ret = pipe(mevent_pipefd);
-	if (ret < 0) {
-		perror("pipe");
-		exit(0);
-	}
-
-	/*
-	 * Add internal event handler for the pipe write fd
-	 */
-	pipev = mevent_add(mevent_pipefd[0], EVF_READ, mevent_pipe_read, NULL);
-	assert(pipev != NULL);
-
-	for (;;) {
+	while (!__atomic_load_n(&mevent_exiting, __ATOMIC_ACQUIRE)) {
 		/*
 		 * Block awaiting events
 		 */
-		ret = epoll_wait(epoll_fd, eventlist, MEVENT_MAX, -1);
-		if (ret == -1 && errno != EINTR)
-			perror("Error return from epoll_wait");
+		ret = epoll_wait(base->epoll_fd, eventlist, MEVENT_MAX, -1);
+		if (ret == -1) {
+			if (errno != EINTR)
+				perror("Error return from epoll_wait");
+			continue;
+		}
+
+		if (__atomic_load_n(&mevent_exiting, __ATOMIC_ACQUIRE))
+			break;
 
-		if (vm->state == VM_STAT_SUSPEND)
+		if (mevent_vm->state == VM_STAT_SUSPEND)
 			continue;
 
 		/*
 		 * Handle reported events
 		 */
-		mevent_handle(eventlist, ret);
+		mevent_handle(base, eventlist, ret);
 	}
+
+	return NULL;
+}
+
+/*
+ * the caller thread handle the events of the first base, and
+ * the other bases have their own threads
+ */
+void *mevent_dispatch(void *data)
+{
+	struct mevent_base *base;
+	int i, ret;
+
+	mevent_vm = (struct vm *)data;
+
+	for (i = 1; i < mevent_nr_bases; i++) {
+		base = &mevent_bases[i];
+		ret = pthread_create(&base->tid, NULL,
+				mevent_base_dispatch, base);
+		if (ret) {
+			perror("mevent thread");
+			exit(0);
+		}
+
+		base->started = 1;
+	}
+
+	base = &mevent_bases[0];
+	base->tid = pthread_self();
+	base->started = 1;
+
+	return mevent_base_dispatch(base);
 }
@@ -67,12 +67,14 @@
 struct vm *mvm_vm = NULL;
 static struct vm_config *global_config = NULL;
 
-int verbose;
+__thread int virq_batch_depth;
+__thread struct vm_mem_region *mem_region_cache;
 
 static void free_vm_config(struct vm_config *config);
 int vm_shutdown(struct vm *vm);
 
 extern int virtio_mmio_init(struct vm *vm);
+extern void virtio_dump_stats(void);
 
 void *map_vm_memory(struct vm *vm)
 {
@@ -99,6 +101,63 @@ void *map_vm_memory(struct vm *vm)
 	return addr;
 }
 
+int vm_add_mem_region(struct vm *vm, uint64_t gpa,
+		uint64_t size, void *hva)
+{
+	struct vm_mem_region *region;
+	int i;
+
+	if (!size || (gpa + size < gpa))
+		return -EINVAL;
+
+	if (vm->nr_mem_regions >= VM_MAX_MEM_REGIONS) {
+		pr_err("too many memory regions for vm\n");
+		return -ENOSPC;
+	}
+
+	/* keep the regions sorted and do not overlap */
+	for (i = 0; i < vm->nr_mem_regions; i++) {
+		region = &vm->mem_regions[i];
+		if (gpa + size <= region->gpa)
+			break;
+
+		if (gpa < region->gpa + region->size) {
+			pr_err("memory region 0x%"PRIx64" overlap\n", gpa);
+			return -EINVAL;
+		}
+	}
+
+	memmove(&vm->mem_regions[i + 1], &vm->mem_regions[i],
+		(vm->nr_mem_regions - i) * sizeof(struct vm_mem_region));
+
+	region = &vm->mem_regions[i];
+	region->gpa = gpa;
+	region->size = size;
+	region->hva = hva;
+	vm->nr_mem_regions++;
+
+	return 0;
+}
+
+void *__gpa_to_hva(uint64_t gpa, uint64_t len)
+{
+	struct vm_mem_region *region;
+	int i;
+
+	for (i = 0; i < mvm_vm->nr_mem_regions; i++) {
+		region = &mvm_vm->mem_regions[i];
+		if (gpa < region->gpa)
+			break;
+
+		if (mem_region_contain(region, gpa, len)) {
+			mem_region_cache = region;
+			return region->hva + (gpa - region->gpa);
+		}
+	}
+
+	return NULL;
+}
+
 static int create_new_vm(struct vm *vm)
 {
 	int fd, vmid = -1;
@@ -156,6 +215,69 @@ static int release_vm(int vmid)
 	return ret;
 }
 
+static size_t vcpu_stats_size(struct vm *vm)
+{
+	size_t size = vm->nr_vcpus * sizeof(struct vcpu_stats);
+
+	return (size + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+}
+
+static int vm_create_vcpu_stats(struct vm *vm)
+{
+	void *stats = NULL;
+
+	if (ioctl(vm->vm_fd, IOCTL_CREATE_VCPU_STATS, &stats) || !stats)
+		return -ENOENT;
+
+	vm->stats = hvm_map_iomem(stats, vcpu_stats_size(vm));
+	if (vm->stats == (void *)-1) {
+		vm->stats = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
+static void dump_stat_hist(char *name, uint64_t *hist)
+{
+	int i;
+
+	for (i = 0; i < VCPU_STAT_HIST_NR; i++) {
+		if (!hist[i])
+			continue;
+
+		pr_info("    %s ticks < 2^%-2d : %" PRIu64 "\n",
+				name, i, hist[i]);
+	}
+}
+
+static void vm_dump_vcpu_stats(struct vm *vm)
+{
+	int i, ec;
+	struct vcpu_stats *stats;
+
+	if (!vm || !vm->stats) {
+		pr_warn("no vcpu stats for this vm\n");
+		return;
+	}
+
+	for (i = 0; i < vm->nr_vcpus; i++) {
+		stats = &vm->stats[i];
+		pr_info("vm-%d vcpu-%d exits:%" PRIu64 " mmio:%" PRIu64 "\n",
+				vm->vmid, i, stats->exits, stats->mmio_traps);
+
+		for (ec = 0; ec < VCPU_STAT_EC_NR; ec++) {
+			if (stats->ec_count[ec])
+				pr_info("    ec 0x%02x : %" PRIu64 "\n",
+						ec, stats->ec_count[ec]);
+		}
+
+		dump_stat_hist("exit", stats->exit_hist);
+		dump_stat_hist("mmio", stats->mmio_hist);
+		dump_stat_hist("block", stats->block_hist);
+	}
+}
+
 int destroy_vm(struct vm *vm)
 {
 	int i;
@@ -197,9 +319,28 @@ int destroy_vm(struct vm *vm)
 		}
 	}
 
+	if (vm->ioevent_irq > 0)
+		ioctl(vm->vm_fd, IOCTL_UNREGISTER_VCPU,
+				(unsigned long)vm->ioevent_irq);
+
+	if (vm->ioevent_fd > 0)
+		close(vm->ioevent_fd);
+
+	if (vm->ioevent_db)
+		munmap(vm->ioevent_db, PAGE_SIZE);
+
+	if (vm->virq_db)
+		munmap(vm->virq_db, PAGE_SIZE);
+
+	if (vm->stats)
+		munmap(vm->stats, vcpu_stats_size(vm));
+
 	list_for_each_entry(vdev, &vm->vdev_list, list)
 		release_vdev(vdev);
 
+	if (vm->vdev_index)
+		free(vm->vdev_index);
+
 	mevent_deinit();
 
 	if (vm->mmap)
@@ -273,6 +414,8 @@ void print_usage(void)
 	fprintf(stderr, "    -b <32 or 64>              (32bit or 64 bit )\n");
 	fprintf(stderr, "    -r                         (do not load ramdisk image)\n");
 	fprintf(stderr, "    -v                         (verbose print debug information)\n");
+	fprintf(stderr, "    --log <level|sub=level,..> (set log level err/warn/info/debug of core/virtio/blk/net/console/vsock)\n");
+	fprintf(stderr, "    --mevent_threads <n>       (the count of the i/o event threads, default one per vcpu)\n");
 	fprintf(stderr, "    -d                         (run as a daemon process)\n");
 	fprintf(stderr, "    -D                         (create a platform bus device)\n");
 	fprintf(stderr, "    -V                         (create a virtio device)\n");
@@ -323,6 +466,42 @@ static int vm_create_vmcs(struct vm *vm)
 	return 0;
 }
 
+static int vm_create_ioevent(struct vm *vm)
+{
+	int irq;
+	void *db = NULL;
+
+	irq = ioctl(vm->vm_fd, IOCTL_CREATE_IOEVENT, &db);
+	if ((irq <= 0) || !db)
+		return -ENOENT;
+
+	vm->ioevent_db = hvm_map_iomem(db, PAGE_SIZE);
+	if (vm->ioevent_db == (void *)-1) {
+		vm->ioevent_db = NULL;
+		return -ENOMEM;
+	}
+
+	vm->ioevent_irq = irq;
+
+	return 0;
+}
+
+static int vm_create_virq_doorbell(struct vm *vm)
+{
+	void *db = NULL;
+
+	if (ioctl(vm->vm_fd, IOCTL_CREATE_VIRQ_DOORBELL, &db) || !db)
+		return -ENOENT;
+
+	vm->virq_db = hvm_map_iomem(db, PAGE_SIZE);
+	if (vm->virq_db == (void *)-1) {
+		vm->virq_db = NULL;
+		return -ENOMEM;
+	}
+
+	return 0;
+}
+
 static int create_and_init_vm(struct vm *vm)
 {
 	int ret = 0;
@@ -344,6 +523,23 @@ static int create_and_init_vm(struct vm *vm)
 	if (ret)
 		return -ENOMEM;
 
+	/*
+	 * the ioevent is optional, if failed the virtio
+	 * queue notify will go through the vmcs
+	 */
+	if (vm_create_ioevent(vm))
+		pr_warn("ioevent is not supported for vm-%d\n", vm->vmid);
+
+	/* the virq doorbell is optional as the ioevent */
+	if (vm_create_virq_doorbell(vm))
+		pr_warn("virq doorbell is not supported for vm-%d\n",
+				vm->vmid);
+
+	/* vcpu exit statistics, dump it by SIGUSR1 */
+	if (vm_create_vcpu_stats(vm))
+		pr_warn("vcpu stats is not supported for vm-%d\n",
+				vm->vmid);
+
 	/*
 	 * map a fix region for this vm, need to call ioctl
 	 * to informe hypervisor to map the really physical
@@ -353,6 +549,10 @@ static int create_and_init_vm(struct vm *vm)
 	if (!vm->mmap)
 		return -EAGAIN;
 
+	ret = vm_add_mem_region(vm, vm->mem_start, vm->mem_size, vm->mmap);
+	if (ret)
+		return ret;
+
 	/* load the image into the vm memory */
 	ret = vm->os->load_image(vm);
 	if (ret)
@@ -425,36 +625,35 @@ static int vm_vdev_init(struct vm *vm, struct vm_config *config)
 	return 0;
 }
 
-static void vmcs_ack(struct vmcs *vmcs)
-{
-	if (vmcs->guest_index == vmcs->host_index)
-		return;
-
-	vmcs->guest_index++;
-	wmb();
-}
+/* each vcpu has its own thread, cache the last hit vdev */
+static __thread struct vdev *vcpu_last_vdev;
 
 static int vcpu_handle_mmio(struct vm *vm, int trap_reason,
 		unsigned long trap_data, unsigned long *trap_result)
 {
-	int ret = -EIO;
-	struct vdev *vdev;
-	unsigned long base, size;
+	int ret;
+	struct vdev *vdev = vcpu_last_vdev;
+	unsigned long base;
 
-	list_for_each_entry(vdev, &vm->vdev_list, list) {
+	if (vdev) {
 		base = (unsigned long)vdev->guest_iomem;
-		size = vdev->iomem_size;
-		if ((trap_data >= base) && (trap_data < base + size)) {
-			pthread_mutex_lock(&vdev->lock);
-			ret = vdev->ops->event(vdev, trap_reason,
-					trap_data, trap_result);
-			pthread_mutex_unlock(&vdev->lock);
+		if ((trap_data < base) ||
+				(trap_data >= base + vdev->iomem_size))
+			vdev = NULL;
+	}
 
-			return ret;
-		}
+	if (!vdev) {
+		vdev = vdev_find_mmio(vm, trap_data);
+		if (!vdev)
+			return -ENODEV;
+		vcpu_last_vdev = vdev;
 	}
 
-	return -ENODEV;
+	pthread_mutex_lock(&vdev->lock);
+	ret = vdev->ops->event(vdev, trap_reason, trap_data, trap_result);
+	pthread_mutex_unlock(&vdev->lock);
+
+	return ret;
 }
 
 static int vcpu_handle_common_trap(struct vm *vm, int trap_reason,
@@ -484,13 +683,13 @@ static int vcpu_handle_common_trap(struct vm *vm, int trap_reason,
 	return 0;
 }
 
-static void handle_vcpu_event(struct vmcs *vmcs)
+static void handle_vcpu_event(struct vmcs_trap *trap)
 {
-	int ret;
-	uint32_t trap_type = vmcs->trap_type;
-	uint32_t trap_reason = vmcs->trap_reason;
-	unsigned long trap_data = vmcs->trap_data;
-	unsigned long trap_result = vmcs->trap_result;
+	int ret = -EINVAL;
+	uint32_t trap_type = trap->trap_type;
+	uint32_t trap_reason = trap->trap_reason;
+	unsigned long trap_data = trap->trap_data;
+	unsigned long trap_result = trap->trap_result;
 
 	switch (trap_type) {
 	case VMTRAP_TYPE_COMMON:
@@ -507,10 +706,33 @@ static void handle_vcpu_event(struct vmcs *vmcs)
 		break;
 	}
 
-	vmcs->trap_ret = ret;
-	vmcs->trap_result = trap_result;
+	trap->trap_ret = ret;
+	trap->trap_result = trap_result;
+}
+
+/*
+ * drain all the pending traps in the vmcs ring, the
+ * hypervisor only send the virq when the ring is empty
+ * so need to recheck the host_index after the guest_index
+ * has been updated
+ */
+static void handle_vcpu_events(struct vmcs *vmcs)
+{
+	uint64_t index = vmcs->guest_index;
+
+	for (;;) {
+		while (index != vmcs->host_index) {
+			rmb();
+			handle_vcpu_event(&vmcs->ring[index & VMCS_RING_MASK]);
+			wmb();
+
+			vmcs->guest_index = ++index;
+		}
 
-	vmcs_ack(vmcs);
+		mb();
+		if (index == vmcs->host_index)
+			break;
+	}
 }
 
 void *vm_vcpu_thread(void *data)
@@ -555,15 +777,92 @@ void *vm_vcpu_thread(void *data)
 		}
 
 		eventfd_read(eventfd, &value);
-		if (value > 1)
-			pr_err("invaild vmcs state\n");
+		handle_vcpu_events(vmcs);
+	}
+
+	return NULL;
+}
+
+static void *vm_ioevent_thread(void *data)
+{
+	int ret;
+	struct vm *vm = (struct vm *)data;
+	eventfd_t value;
+	char buf[32];
+
+	memset(buf, 0, 32);
+	sprintf(buf, "vm%d-ioevent", vm->vmid);
+	prctl(PR_SET_NAME, buf);
+
+	while (1) {
+		ret = eventfd_read(vm->ioevent_fd, &value);
+		if (ret) {
+			pr_err("read ioevent eventfd failed\n");
+			break;
+		}
+
+		vdev_handle_ioevents(vm);
+	}
+
+	return NULL;
+}
+
+/*
+ * the SIGUSR1 is blocked in all the threads, dump the
+ * statistics here but not in the signal handler since
+ * the dump routines are not async-signal-safe
+ */
+static void *vm_stats_thread(void *data)
+{
+	int sig;
+	sigset_t set;
+	struct vm *vm = (struct vm *)data;
+	char buf[32];
+
+	memset(buf, 0, 32);
+	sprintf(buf, "vm%d-stats", vm->vmid);
+	prctl(PR_SET_NAME, buf);
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGUSR1);
+
+	while (1) {
+		if (sigwait(&set, &sig))
+			break;
 
-		handle_vcpu_event(vmcs);
+		vm_dump_vcpu_stats(vm);
+		virtio_dump_stats();
 	}
 
 	return NULL;
 }
 
+static int vm_ioevent_init(struct vm *vm)
+{
+	int ret;
+	uint64_t arg;
+	pthread_t thread;
+
+	if (!vm->ioevent_db)
+		return 0;
+
+	vm->ioevent_fd = eventfd(0, 0);
+	if (vm->ioevent_fd < 0)
+		return -ENOENT;
+
+	/* the ioevent virq is bound to the eventfd as the vcpu irq */
+	arg = ((unsigned long)vm->ioevent_fd << 32) | vm->ioevent_irq;
+	ret = ioctl(vm->vm_fd, IOCTL_REGISTER_VCPU, &arg);
+	if (ret)
+		return ret;
+
+	ret = pthread_create(&thread, NULL, vm_ioevent_thread, (void *)vm);
+	if (ret)
+		pr_err("create ioevent thread failed\n");
+
+	return ret;
+}
+
 int __vm_shutdown(struct vm *vm)
 {
 	pr_info("***************************\n");
@@ -709,6 +1008,10 @@ static int mvm_main_loop(void)
 		}
 	}
 
+	ret = vm_ioevent_init(vm);
+	if (ret)
+		return ret;
+
 	ret = pthread_create(&vcpu_thread, NULL,
 			mevent_dispatch, (void *)vm);
 	if (ret) {
@@ -716,6 +1019,13 @@ static int mvm_main_loop(void)
 		return ret;
 	}
 
+	ret = pthread_create(&vcpu_thread, NULL,
+			vm_stats_thread, (void *)vm);
+	if (ret) {
+		pr_err("create stats thread failed\n");
+		return ret;
+	}
+
 	/* now start the vm */
 	ret = ioctl(vm->vm_fd, IOCTL_POWER_UP_VM, NULL);
 	if (ret)
@@ -799,6 +1109,7 @@ static int mvm_main(struct vm_config *config)
 	vm->flags = vmtag->flags;
 	vm->vmid = -1;
 	vm->vm_fd = -1;
+	vm->ioevent_fd = -1;
 	vm->entry = (uint64_t)vmtag->entry;
 	vm->mem_start = vmtag->mem_base;
 	vm->mem_size = vmtag->mem_size;
@@ -833,8 +1144,12 @@ static int mvm_main(struct vm_config *config)
 
 	mvm_queue_init(&vm->queue);
 
-	/* io events init before vdev init */
-	ret = mevent_init();
+	/*
+	 * io events init before vdev init, one i/o thread for
+	 * each vcpu by default
+	 */
+	ret = mevent_init(config->nr_mevent_threads ?
+			config->nr_mevent_threads : vm->nr_vcpus);
 	if (ret)
 		goto release_vm;
 
@@ -871,6 +1186,8 @@ static struct option options[] = {
 	{"gicv4",	no_argument,	   NULL, '2'},
 	{"earlyprintk",	no_argument,	   NULL, '3'},
 	{"help",	no_argument,	   NULL, 'h'},
+	{"log",		required_argument, NULL, '4'},
+	{"mevent_threads", required_argument, NULL, '5'},
 	{NULL,		0,		   NULL,  0}
 };
 
@@ -977,6 +1294,7 @@ int main(int argc, char **argv)
 	int run_as_daemon = 0;
 	struct vmtag *vmtag;
 	struct device_info *device_info;
+	sigset_t sigset;
 	static char *optstr = "K:R:S:c:C:m:i:s:n:D:V:t:b:rv?hd0123";
 
 	global_config = calloc(1, sizeof(struct vm_config));
@@ -1033,7 +1351,7 @@ int main(int argc, char **argv)
 			vmtag->flags |= VM_FLAGS_NO_RAMDISK;
 			break;
 		case 'v':
-			verbose = 1;
+			mvm_log_set_level(-1, LOG_DEBUG);
 			break;
 		case 'd':
 			run_as_daemon = 1;
@@ -1070,6 +1388,16 @@ int main(int argc, char **argv)
 		case '1':
 			global_config->gic_type = 1;
 			break;
+		case '4':
+			if (mvm_log_parse(optarg)) {
+				pr_err("invalid log option %s\n", optarg);
+				ret = -EINVAL;
+				goto exit;
+			}
+			break;
+		case '5':
+			global_config->nr_mevent_threads = atoi(optarg);
+			break;
 		/* the below argument is deicated for linux vm
 		 * and will use the fixed loading address which
 		 * kernel will loaded at 0x80080000 and dtb will
@@ -1115,6 +1443,17 @@ int main(int argc, char **argv)
 		}
 	}
 
+	/*
+	 * block the SIGUSR1 before any thread is created, it
+	 * will be handled by the stats thread with sigwait
+	 */
+	sigemptyset(&sigset);
+	sigaddset(&sigset, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &sigset, NULL);
+
+	/* start the log thread after daemon() since it fork */
+	mvm_log_init();
+
 	ret = mvm_main(global_config);
 
 exit:
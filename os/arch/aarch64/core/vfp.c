@@ -17,6 +17,7 @@
 #include <minos/minos.h>
 #include <minos/vmodule.h>
 #include <minos/task.h>
+#include <minos/percpu.h>
 
 #ifdef CONFIG_VIRT
 #include <virt/vm.h>
@@ -29,16 +30,25 @@ struct vfp_context {
 #endif
 	uint32_t fpsr;
 	uint32_t fpcr;
+	struct task *task;
+	int cpu;
 };
 
-static void vfp_state_init(struct task *task, void *context)
-{
-	memset(context, 0, sizeof(struct vfp_context));
-}
+/*
+ * the fp/simd registers are switched lazily, when switch to
+ * a task the CPTR_EL2.TFP is set if the registers of this pcpu
+ * do not belong to the task, then the first access of the fp
+ * will trap to el2, the registers of the old owner are saved
+ * and the new task's registers are loaded at that time. the
+ * minos itself is built with -mgeneral-regs-only so el2 will
+ * never touch the fp registers
+ */
+static DEFINE_PER_CPU(struct vfp_context *, fp_owner);
+static int vfp_vmodule_id = INVALID_MODULE_ID;
 
-static void vfp_state_save(struct task *task, void *context)
+static void __vfp_state_save(struct vfp_context *c)
 {
-	struct vfp_context *c = (struct vfp_context *)context;
+	struct task *task = c->task;
 
 #ifdef CONFIG_VIRT
 	if (task_is_32bit(task))
@@ -67,9 +77,9 @@ static void vfp_state_save(struct task *task, void *context)
                      : "=Q" (*c->regs) : "r" (c->regs));
 }
 
-static void vfp_state_restore(struct task *task, void *context)
+static void __vfp_state_restore(struct vfp_context *c)
 {
-	struct vfp_context *c = (struct vfp_context *)context;
+	struct task *task = c->task;
 
 #ifdef CONFIG_VIRT
 	if (task_is_32bit(task))
@@ -98,11 +108,103 @@ static void vfp_state_restore(struct task *task, void *context)
                      : : "Q" (*c->regs), "r" (c->regs));
 }
 
+static inline int vfp_is_live(struct vfp_context *c, int cpu)
+{
+	return ((c->cpu == cpu) && (get_per_cpu(fp_owner, cpu) == c));
+}
+
+static inline void vfp_set_trap(int trap)
+{
+	uint64_t value, old;
+
+	old = read_sysreg(CPTR_EL2);
+	if (trap)
+		value = old | CPTR_ELx_TFP;
+	else
+		value = old & ~CPTR_ELx_TFP;
+
+	if (value != old) {
+		write_sysreg(value, CPTR_EL2);
+		isb();
+	}
+}
+
+/*
+ * called when the task access the fp registers first time
+ * after it switched in
+ */
+void vfp_lazy_restore(struct task *task)
+{
+	struct vfp_context *c, *owner;
+	unsigned long flags;
+	int cpu;
+
+	c = get_vmodule_data_by_id(task, vfp_vmodule_id);
+	if (!c)
+		return;
+
+	local_irq_save(flags);
+	cpu = smp_processor_id();
+	vfp_set_trap(0);
+
+	if (vfp_is_live(c, cpu))
+		goto out;
+
+	owner = get_per_cpu(fp_owner, cpu);
+	if (owner && (owner != c) && (owner->cpu == cpu)) {
+		__vfp_state_save(owner);
+		owner->cpu = -1;
+	}
+
+	__vfp_state_restore(c);
+	c->cpu = cpu;
+	get_per_cpu(fp_owner, cpu) = c;
+out:
+	local_irq_restore(flags);
+}
+
+static void vfp_state_init(struct task *task, void *context)
+{
+	struct vfp_context *c = (struct vfp_context *)context;
+
+	c->task = task;
+	c->cpu = -1;
+}
+
+static void vfp_state_deinit(struct task *task, void *context)
+{
+	struct vfp_context *c = (struct vfp_context *)context;
+
+	/* the task will not run again, drop the ownership */
+	if ((c->cpu >= 0) && (get_per_cpu(fp_owner, c->cpu) == c))
+		get_per_cpu(fp_owner, c->cpu) = NULL;
+
+	c->cpu = -1;
+}
+
+static void vfp_state_restore(struct task *task, void *context)
+{
+	struct vfp_context *c = (struct vfp_context *)context;
+
+	/*
+	 * the registers are still live if no other task has
+	 * used the fp since this task switched out, then
+	 * nothing need to do
+	 */
+	vfp_set_trap(!vfp_is_live(c, smp_processor_id()));
+}
+
 static int vfp_vmodule_init(struct vmodule *vmodule)
 {
+	vfp_vmodule_id = vmodule->id;
+
+	/*
+	 * no state_save, the registers are saved when other
+	 * task use the fp on this pcpu
+	 */
 	vmodule->context_size	= sizeof(struct vfp_context);
 	vmodule->state_init	= vfp_state_init;
-	vmodule->state_save	= vfp_state_save;
+	vmodule->state_deinit	= vfp_state_deinit;
 	vmodule->state_restore	= vfp_state_restore;
 
 	return 0;
@@ -225,6 +225,33 @@ static inline void flush_local_tlbis_guest(void)
 	);
 }
 
+static inline void flush_tlb_ipa_guest(unsigned long ipa,
+		unsigned long size)
+{
+	unsigned long end = ipa + size;
+
+	/* current VMID only and innershareable TLBS */
+	dsb();
+
+	while (ipa < end) {
+		asm volatile("tlbi ipas2e1is, %0;" : : "r"
+				(ipa >> PAGE_SHIFT) : "memory");
+		ipa += PAGE_SIZE;
+	}
+
+	/*
+	 * the combined stage1 and stage2 entries can not be
+	 * flushed by the ipa, so also flush the stage1 entries
+	 */
+	asm volatile(
+		"dsb ish;"
+		"tlbi vmalle1is;"
+		"dsb ish;"
+		"isb;"
+		: : : "memory"
+	);
+}
+
 static inline void flush_all_tlb_guest(void)
 {
 	/* flush all vmids local TLBS, non-hypervisor mode */
@@ -344,5 +371,6 @@ void arch_smp_init(phy_addr_t *smp_h_addr);
 int __arch_init(void);
 int arch_early_init(void *data);
 void arch_init_task(struct task *task, void *entry, void *data);
+void vfp_lazy_restore(struct task *task);
 
 #endif
@@ -124,22 +124,7 @@
 #define GICV3_NR_SGI		(16)
 
 struct gicv3_context {
-	uint64_t ich_lr0_el2;
-	uint64_t ich_lr1_el2;
-	uint64_t ich_lr2_el2;
-	uint64_t ich_lr3_el2;
-	uint64_t ich_lr4_el2;
-	uint64_t ich_lr5_el2;
-	uint64_t ich_lr6_el2;
-	uint64_t ich_lr7_el2;
-	uint64_t ich_lr8_el2;
-	uint64_t ich_lr9_el2;
-	uint64_t ich_lr10_el2;
-	uint64_t ich_lr11_el2;
-	uint64_t ich_lr12_el2;
-	uint64_t ich_lr13_el2;
-	uint64_t ich_lr14_el2;
-	uint64_t ich_lr15_el2;
+	uint64_t ich_lr_el2[16];
 	uint32_t ich_ap0r2_el2;
 	uint32_t ich_ap1r2_el2;
 	uint32_t ich_ap0r1_el2;
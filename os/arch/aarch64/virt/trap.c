@@ -105,6 +105,9 @@ static int ldc_stc_cp14_handler(gp_regs *reg, uint32_t esr_value)
 
 static int access_simd_reg_handler(gp_regs *reg, uint32_t esr_value)
 {
+	/* trapped by CPTR_EL2.TFP, load the fp context of the vcpu */
+	vfp_lazy_restore(get_current_vcpu()->task);
+
 	return 0;
 }
 
@@ -381,7 +384,7 @@ DEFINE_SYNC_DESC(EC_LDC_STC_CP14, EC_TYPE_AARCH32,
 		ldc_stc_cp14_handler, 1, 4);
 
 DEFINE_SYNC_DESC(EC_ACCESS_SIMD_REG, EC_TYPE_BOTH,
-		access_simd_reg_handler, 1, 4);
+		access_simd_reg_handler, 1, 0);
 
 DEFINE_SYNC_DESC(EC_MCR_MRC_CP10, EC_TYPE_AARCH32,
 		mcr_mrc_cp10_handler, 1, 4);
@@ -472,6 +475,7 @@ void sync_from_lower_EL_handler(gp_regs *data)
 	int ec_type;
 	struct sync_desc *ec;
 	struct vcpu *vcpu = get_current_vcpu();
+	unsigned long start = 0;
 
 	if ((!vcpu) || (vcpu->task->affinity != cpuid))
 		panic("this vcpu is not belong to the pcpu");
@@ -491,8 +495,30 @@ void sync_from_lower_EL_handler(gp_regs *data)
 	 * TBD
 	 */
 	data->elr_elx += ec->ret_addr_adjust;
+
+	/* only read the tick when the statistics is enabled */
+	if (vcpu->stats)
+		start = get_sys_ticks();
+
 	ec->handler(data, esr_value);
+
+	/*
+	 * the wfi and wfe exits include the time of the vcpu
+	 * sleeping and waiting to run again, keep them out of
+	 * the exit handling time
+	 */
+	if (vcpu->stats && start) {
+		vcpu_stat_hist((ec_type == EC_WFI_WFE) ?
+				vcpu->stats->block_hist :
+				vcpu->stats->exit_hist,
+				get_sys_ticks() - start);
+	}
 out:
+	if (vcpu->stats) {
+		vcpu->stats->exits++;
+		vcpu->stats->ec_count[ec_type]++;
+	}
+
 	local_irq_disable();
 
 	enter_to_guest(get_current_vcpu(), NULL);
@@ -95,16 +95,69 @@ static inline uint64_t generate_vtcr_el2(void)
 	return value;
 }
 
+/*
+ * if the range is bigger than this, flush all the TLBs of
+ * the vmid instead of flush them page by page
+ */
+#define STAGE2_TLBI_RANGE_MAX	(512 * PAGE_SIZE)
+
+#define VTTBR_VMID_SHIFT	48
+#define VTTBR_VMID_MASK		(0xffUL << VTTBR_VMID_SHIFT)
+
 static uint64_t generate_vttbr_el2(uint32_t vmid, unsigned long base)
 {
 	uint64_t value = 0;
 
 	value = base ;
-	value |= (uint64_t)vmid << 48;
+	value |= (uint64_t)vmid << VTTBR_VMID_SHIFT;
 
 	return value;
 }
 
+/*
+ * the TLBs are tagged with the vmid, so only the entries of
+ * this vm need to be flushed when its stage2 mapping changed,
+ * the inner shareable TLBI will broadcast to all the pcpus, so
+ * the pcpus which the vm has run on will all be flushed
+ */
+void flush_guest_tlb_range(struct mm_struct *mm,
+		unsigned long ipa, size_t size)
+{
+	struct vm *vm = (struct vm *)mm->vm;
+	uint64_t vttbr, target;
+	unsigned long flags;
+
+	if (!vm) {
+		flush_all_tlbis_guest();
+		return;
+	}
+
+	target = generate_vttbr_el2(vm->vmid, mm->pgd_base);
+
+	/*
+	 * the TLBI will use the vmid in the VTTBR_EL2, switch to
+	 * the target vm's vmid if the mapping is not belong to
+	 * the current vm, el2 itself is not affected by stage2
+	 */
+	local_irq_save(flags);
+	vttbr = read_sysreg(VTTBR_EL2);
+	if ((vttbr & VTTBR_VMID_MASK) != (target & VTTBR_VMID_MASK)) {
+		write_sysreg(target, VTTBR_EL2);
+		isb();
+	}
+
+	if (size > STAGE2_TLBI_RANGE_MAX)
+		flush_local_tlbis_guest();
+	else
+		flush_tlb_ipa_guest(ipa, size);
+
+	if ((vttbr & VTTBR_VMID_MASK) != (target & VTTBR_VMID_MASK)) {
+		write_sysreg(vttbr, VTTBR_EL2);
+		isb();
+	}
+	local_irq_restore(flags);
+}
+
 int el2_stage2_init(void)
 {
 	/*
@@ -172,8 +225,7 @@ static void vmsa_state_restore(struct task *task, void *context)
 	write_sysreg(c->amair_el1, AMAIR_EL1);
 	write_sysreg(c->tcr_el1, TCR_EL1);
 	write_sysreg(c->par_el1, PAR_EL1);
-	dsb();
-	flush_local_tlb_guest();
+	isb();
 }
 
 static void vmsa_state_resume(struct task *task, void *context)
@@ -21,6 +21,7 @@
 #include <minos/init.h>
 #include <minos/mm.h>
 #include <minos/mmu.h>
+#include <minos/percpu.h>
 
 extern unsigned char __code_start;
 extern void *bootmem_end;
@@ -81,6 +82,17 @@ struct slab {
 	size_t alloc_blocks;
 };
 
+/*
+ * per-cpu cache for the small slabs, the cpu can get
+ * or put the slab without aquiring the global slab
+ * lock, only when the magazine is empty or full need
+ * to refill or flush it from or to the global pool
+ */
+struct slab_magazine {
+	struct slab_header *head;
+	unsigned long nr;
+};
+
 struct page_pool {
 	spinlock_t lock;
 	uint32_t meta_blocks;
@@ -105,6 +117,13 @@ static struct page_pool *io_pool = &__io_pool;
 static struct page_pool *page_pool = &__page_pool;
 static size_t free_blocks;
 
+#define SLAB_MAG_CLASSES	(16)
+#define SLAB_MAG_MAX_SIZE	(SLAB_MAG_CLASSES * SLAB_MIN_DATA_SIZE)
+#define SLAB_MAG_SIZE		(32)
+#define SLAB_MAG_BATCH		(SLAB_MAG_SIZE / 2)
+
+static DEFINE_PER_CPU(struct slab_magazine [SLAB_MAG_CLASSES], slab_magazines);
+
 static void inline add_slab_to_slab_pool(struct slab_header *header,
 		struct slab_pool *pool);
 
@@ -1157,6 +1176,112 @@ static slab_alloc_func alloc_func[] = {
 	NULL,
 };
 
+static inline struct slab_header *
+get_slab_from_magazine(struct slab_magazine *mag)
+{
+	struct slab_header *header = mag->head;
+
+	mag->head = header->next;
+	mag->nr--;
+	header->magic = SLAB_MAGIC;
+
+	return header;
+}
+
+static inline void add_slab_to_magazine(struct slab_header *header,
+		struct slab_magazine *mag)
+{
+	header->next = mag->head;
+	mag->head = header;
+	mag->nr++;
+}
+
+/*
+ * called with irq disabled, move a batch of slabs from
+ * the global pool to the magazine of this cpu
+ */
+static void slab_magazine_refill(struct slab_magazine *mag, int id)
+{
+	struct slab_pool *pool = &pslab->pool[id];
+	struct slab_header *header;
+
+	spin_lock(&pslab->lock);
+
+	while (pool->head && (mag->nr < SLAB_MAG_BATCH)) {
+		header = pool->head;
+		pool->head = header->next;
+		pool->nr--;
+		add_slab_to_magazine(header, mag);
+	}
+
+	spin_unlock(&pslab->lock);
+}
+
+/*
+ * called with irq disabled, give back half of the
+ * magazine to the global pool
+ */
+static void slab_magazine_flush(struct slab_magazine *mag, int id)
+{
+	struct slab_pool *pool = &pslab->pool[id];
+	struct slab_header *header;
+
+	spin_lock(&pslab->lock);
+
+	while (mag->nr > SLAB_MAG_BATCH) {
+		header = mag->head;
+		mag->head = header->next;
+		mag->nr--;
+		add_slab_to_slab_pool(header, pool);
+	}
+
+	spin_unlock(&pslab->lock);
+}
+
+static void *malloc_from_magazine(size_t size)
+{
+	unsigned long flags;
+	struct slab_magazine *mag;
+	struct slab_header *header = NULL;
+	int id = slab_pool_id(size);
+
+	local_irq_save(flags);
+
+	mag = &get_cpu_var(slab_magazines)[id];
+	if (!mag->head)
+		slab_magazine_refill(mag, id);
+
+	if (mag->head)
+		header = get_slab_from_magazine(mag);
+
+	local_irq_restore(flags);
+
+	return header ? SLAB_HEADER_TO_ADDR(header) : NULL;
+}
+
+static int free_to_magazine(struct slab_header *header)
+{
+	unsigned long flags;
+	struct slab_magazine *mag;
+	int id;
+
+	if (header->size > SLAB_MAG_MAX_SIZE)
+		return 0;
+
+	id = slab_pool_id(header->size);
+
+	local_irq_save(flags);
+
+	mag = &get_cpu_var(slab_magazines)[id];
+	if (mag->nr >= SLAB_MAG_SIZE)
+		slab_magazine_flush(mag, id);
+	add_slab_to_magazine(header, mag);
+
+	local_irq_restore(flags);
+
+	return 1;
+}
+
 void *malloc(size_t size)
 {
 	int i = 0;
@@ -1167,6 +1292,14 @@ void *malloc(size_t size)
 		return NULL;
 
 	size = get_slab_alloc_size(size);
+
+	/* small slab first try to get it from the cpu cache */
+	if (size <= SLAB_MAG_MAX_SIZE) {
+		ret = malloc_from_magazine(size);
+		if (ret)
+			return ret;
+	}
+
 	spin_lock(&pslab->lock);
 
 	while (1) {
@@ -1357,6 +1490,9 @@ free_slab:
 		return;
 	}
 
+	if (free_to_magazine(header))
+		return;
+
 	/* big slab will default push to free cache pool */
 	spin_lock(&pslab->lock);
 	id = slab_pool_id(header->size);
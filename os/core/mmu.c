@@ -272,7 +272,7 @@ int create_mem_mapping(struct mm_struct *mm, vir_addr_t addr,
 	if (flags & VM_HOST)
 		flush_tlb_va_host(addr, size);
 	else
-		flush_local_tlb_guest();
+		flush_guest_tlb_range(mm, addr, size);
 
 	return ret;
 }
@@ -403,7 +403,7 @@ int destroy_mem_mapping(struct mm_struct *mm, unsigned long vir,
 	if (flags & VM_HOST)
 		flush_tlb_va_host(vir, size);
 	else
-		flush_local_tlb_guest();
+		flush_guest_tlb_range(mm, vir, size);
 
 	return 0;
 }
@@ -16,6 +16,7 @@
 
 #include <minos/minos.h>
 #include <minos/task.h>
+#include <minos/atomic.h>
 #include <minos/sched.h>
 #include <minos/irq.h>
 #include <minos/softirq.h>
@@ -28,9 +29,35 @@
 
 DEFINE_SPIN_LOCK(__kernel_lock);
 
-static prio_t os_rdy_grp;
-static uint64_t __os_rdy_table;
-static uint8_t *os_rdy_table;
+/*
+ * the ready realtime tasks, bit n is the task whose prio
+ * is n, the bitmap is updated with atomic bit operation
+ * under the task's own lock, the kernel lock only protect
+ * the sched result of the global class pcpus.
+ *
+ * os_rdy_gen  : increased when the ready bitmap is changed
+ * os_sched_gen: the os_rdy_gen which the sched result base on
+ * os_sched_seq: odd when the sched result is updating
+ *
+ * then the global pcpu can check whether the sched result
+ * is still valid without the kernel lock
+ *
+ * the realtime tasks are not split to per pcpu run queues,
+ * sched_new() always run the highest N ready tasks on the N
+ * global pcpus, with per pcpu queues a high prio task may
+ * wait on one pcpu while a lower one is running on other
+ * pcpu until it is pulled. so the ready bitmap is global,
+ * and only the change of the sched result take the lock
+ */
+#if OS_REALTIME_TASK > BITS_PER_LONG
+#error "the realtime task is more than the bits of os_rdy_map"
+#endif
+
+static unsigned long os_rdy_map;
+static atomic_t os_rdy_gen;
+static int os_sched_gen;
+static volatile unsigned long os_sched_seq;
+
 prio_t os_highest_rdy[NR_CPUS];
 prio_t os_prio_cur[NR_CPUS]; 
 
@@ -67,6 +94,13 @@ static inline void precpu_task_sleep(struct pcpu *pcpu, struct task *task)
 	list_add_tail(&pcpu->sleep_list, &task->stat_list);
 }
 
+static inline void os_rdy_changed(void)
+{
+	/* the bitmap must be updated before the generation */
+	smp_mb();
+	atomic_inc(&os_rdy_gen);
+}
+
 static void inline set_next_task(struct task *task, int cpuid)
 {
 	__next_tasks[cpuid] = task;
@@ -110,12 +144,12 @@ int set_task_ready(struct task *task, int preempt)
 
 	/*
 	 * when call this function need to ensure :
-	 * 1 - kernel sched lock is locked (rt task)
+	 * 1 - the task lock is locked
 	 * 2 - the interrupt is disabled
 	 */
 	if (task_is_realtime(task)) {
-		os_rdy_grp |= task->bity;
-		os_rdy_table[task->by] |= task->bitx;
+		set_bit(task->prio, &os_rdy_map);
+		os_rdy_changed();
 	} else {
 		pcpu = get_cpu_var(pcpu);
 		if (pcpu->pcpu_id != task->affinity) {
@@ -143,9 +177,8 @@ int set_task_sleep(struct task *task, uint32_t ms)
 	struct pcpu *pcpu;
 
 	if (task_is_realtime(task)) {
-		os_rdy_table[task->by] &= ~task->bitx;
-		if (os_rdy_table[task->by] == 0)
-			os_rdy_grp &= ~task->bity;
+		clear_bit(task->prio, &os_rdy_map);
+		os_rdy_changed();
 	} else {
 		pcpu = get_cpu_var(pcpu);
 
@@ -217,16 +250,14 @@ static void sched_new(struct pcpu *pcpu)
 	 * this function need always called with
 	 * interrupt disabled
 	 */
-	uint8_t x, y, p;
+	prio_t p;
+	unsigned long rdy_map = *(volatile unsigned long *)&os_rdy_map;
 
 #ifndef CONFIG_OS_REALTIME_CORE0
 	int i, j = 0, k;
-	prio_t rdy_grp;
 	prio_t ncpu_highest[NR_CPUS];
 	int high_map[NR_CPUS];
 	int current_map[NR_CPUS];
-	uint64_t __rdy_table = __os_rdy_table;
-	uint8_t *rdy_table;
 
 	/*
 	 * first check the rt task in the global task
@@ -234,11 +265,9 @@ static void sched_new(struct pcpu *pcpu)
 	 * just exist
 	 */
 	memset(os_highest_rdy, OS_PRIO_PCPU, sizeof(os_highest_rdy));
-	if (__rdy_table == 0)
+	if (rdy_map == 0)
 		return;
 
-	rdy_grp = os_rdy_grp;
-	rdy_table = (uint8_t *)&__rdy_table;
 	memset(ncpu_highest, OS_PRIO_IDLE + 1, sizeof(ncpu_highest));
 	memset(high_map, 0, sizeof(high_map));
 	memset(current_map, 0, sizeof(current_map));
@@ -250,16 +279,13 @@ static void sched_new(struct pcpu *pcpu)
 			continue;
 		}
 
-		y = ffs_table[rdy_grp];
-		x = ffs_table[rdy_table[y]];
-		p = (y << 3) + x;
+		/* the lowest bit is the highest prio */
+		p = __ffs(rdy_map);
 		ncpu_highest[i] = p;
 
 		/* clear the task ready bit */
-		if ((rdy_table[y] &= ~(1 << x)) == 0)
-			rdy_grp &= ~(1 << y);
-
-		if (__rdy_table == 0)
+		rdy_map &= ~(1UL << p);
+		if (rdy_map == 0)
 			break;
 	}
 
@@ -297,17 +323,35 @@ static void sched_new(struct pcpu *pcpu)
 	 * the core0
 	 */
 	os_highest_rdy[0] = OS_PRIO_PCPU;
-	if (__os_rdy_table == 0)
+	if (rdy_map == 0)
 		return;
 
-	y = ffs_table[os_rdy_grp];
-	x = ffs_table[os_rdy_table[y]];
-	p = (y << 3) + x;
+	p = __ffs(rdy_map);
 	os_highest_rdy[0] = p;
 	dsb();
 #endif
 }
 
+/*
+ * need to be called with the kernel lock locked, record
+ * which ready bitmap the sched result is based on
+ */
+static void global_sched_new(struct pcpu *pcpu)
+{
+	int gen;
+
+	os_sched_seq++;
+	smp_wmb();
+
+	gen = atomic_read(&os_rdy_gen);
+	smp_rmb();
+	sched_new(pcpu);
+	os_sched_gen = gen;
+
+	smp_wmb();
+	os_sched_seq++;
+}
+
 static void inline task_sched_return(struct task *task)
 {
 #ifdef CONFIG_VIRT
@@ -349,6 +393,37 @@ static inline struct task *get_next_global_run_task(struct pcpu *pcpu)
 	return pcpu->idle_task;
 }
 
+/*
+ * check whether the current task can keep running without
+ * taking the kernel lock, if the ready realtime tasks are
+ * not changed since last sched and the sched result of this
+ * pcpu is already the running one, nothing need to do
+ */
+static int global_sched_fastpath(struct pcpu *pcpu, struct task *cur)
+{
+	int cpuid = pcpu->pcpu_id;
+	unsigned long seq;
+	struct task *next;
+
+	seq = os_sched_seq;
+	if (seq & 1)
+		return 0;
+
+	smp_rmb();
+	if (os_sched_gen != atomic_read(&os_rdy_gen))
+		return 0;
+
+	if (os_prio_cur[cpuid] != os_highest_rdy[cpuid])
+		return 0;
+
+	next = get_next_global_run_task(pcpu);
+	smp_rmb();
+	if (seq != os_sched_seq)
+		return 0;
+
+	return (next == cur);
+}
+
 static inline struct task *get_next_local_run_task(struct pcpu *pcpu)
 {
 	if (!is_list_empty(&pcpu->ready_list))
@@ -440,7 +515,12 @@ void switch_to_task(struct task *cur, struct task *next)
 	 *
 	 * if the task is ready state, adjust theurun time of
 	 * this task
+	 *
+	 * the waker only hold the task lock, so the stat and
+	 * the delay timer need to be checked under it, otherwise
+	 * the timer may be armed after the waker deleted it
 	 */
+	raw_spin_lock(&cur->lock);
 	if (!task_is_ready(cur)) {
 		recal_task_run_time(cur, pcpu, 1);
 		if (cur->delay) {
@@ -451,6 +531,7 @@ void switch_to_task(struct task *cur, struct task *next)
 		recal_task_run_time(cur, pcpu, 0);
 		cur->stat = TASK_STAT_RDY;
 	}
+	raw_spin_unlock(&cur->lock);
 
 	do_hooks((void *)cur, NULL, OS_HOOK_TASK_SWITCH_OUT);
 	pcpu->switch_out(pcpu, cur, next);
@@ -530,9 +611,12 @@ void global_sched(struct pcpu *pcpu, struct task *cur)
 	int i;
 	struct task *next;
 
+	if (global_sched_fastpath(pcpu, cur))
+		return;
+
 	kernel_lock();
 
-	sched_new(pcpu);
+	global_sched_new(pcpu);
 
 	/*
 	 * if there other cpu need to change the task running
@@ -669,6 +753,11 @@ static void global_irq_handler(struct pcpu *pcpu, struct task *task)
 	struct task *next = task;
 	int cpuid = pcpu->pcpu_id;
 
+	if (global_sched_fastpath(pcpu, task)) {
+		no_task_sched_return(pcpu, task);
+		return;
+	}
+
 	kernel_lock();
 
 #if 0
@@ -680,7 +769,7 @@ static void global_irq_handler(struct pcpu *pcpu, struct task *task)
 		goto out;
 #endif
 
-	sched_new(pcpu);
+	global_sched_new(pcpu);
 
 	for (i = 0; i < NR_CPUS; i++) {
 		if (os_prio_cur[i] != os_highest_rdy[i]) {
@@ -827,7 +916,11 @@ void pcpus_init(void)
 
 int sched_init(void)
 {
-	os_rdy_table = (uint8_t *)&__os_rdy_table;
+	/*
+	 * the realtime prio is the bit of the os_rdy_map, and
+	 * no sched result is valid before the first sched
+	 */
+	os_sched_gen = -1;
 
 	return 0;
 }
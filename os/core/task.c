@@ -299,9 +299,9 @@ int create_task(char *name, task_func_t func,
 		 * ready list
 		 */
 		if (task_is_realtime(task)) {
-			kernel_lock_irqsave(flags);
+			task_lock_irqsave(task, flags);
 			set_task_ready(task, 0);
-			kernel_unlock_irqrestore(flags);
+			task_unlock_irqrestore(task, flags);
 		}
 
 		/* 
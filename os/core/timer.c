@@ -24,59 +24,197 @@
 
 DEFINE_PER_CPU(struct timers, timers);
 
+static inline unsigned long timer_tick(unsigned long expires)
+{
+	return expires >> TIMER_TICK_SHIFT;
+}
+
+static inline int timer_pending(const struct timer_list * timer)
+{
+	return ((timer->entry.next) != NULL);
+}
+
+/*
+ * level 0 store the timers which will expire in the next
+ * 64 wheel ticks, the slot of a higher level is the time
+ * that the timer need to be moved to a lower level, so the
+ * slot is rounded down and the timer never expire late
+ */
+static void timer_wheel_add(struct timers *timers, struct timer_list *timer)
+{
+	unsigned long clk = timers->clk;
+	unsigned long tick = timer_tick(timer->expires);
+	unsigned long idx, diff;
+	int lvl, shift;
+
+	if (tick <= clk) {
+		lvl = 0;
+		idx = clk;
+	} else if ((tick - clk) < TIMER_LVL_SIZE) {
+		lvl = 0;
+		idx = tick;
+	} else {
+		for (lvl = 1; lvl < TIMER_LEVELS; lvl++) {
+			shift = lvl * TIMER_LVL_BITS;
+			idx = tick >> shift;
+			diff = idx - (clk >> shift);
+			if ((diff >= 1) && (diff <= TIMER_LVL_SIZE))
+				break;
+		}
+
+		/* too far, it will be added again when the slot expired */
+		if (lvl == TIMER_LEVELS) {
+			lvl = TIMER_LEVELS - 1;
+			idx = (clk >> (lvl * TIMER_LVL_BITS)) + TIMER_LVL_SIZE;
+		}
+	}
+
+	idx &= TIMER_LVL_MASK;
+	list_add_tail(&timers->wheel[lvl][idx], &timer->entry);
+	timers->pending[lvl] |= (1UL << idx);
+}
+
+/*
+ * return the wheel tick of the first slot which has timers
+ * on this level, the pending bit is cleared lazily when
+ * the slot is found empty
+ */
+static unsigned long timer_level_next(struct timers *timers, int lvl)
+{
+	int shift = lvl * TIMER_LVL_BITS;
+	unsigned long base, idx;
+
+	base = timers->clk >> shift;
+	if (lvl)
+		base++;
+
+	while (timers->pending[lvl]) {
+		idx = base + __ffs(ror64(timers->pending[lvl],
+					base & TIMER_LVL_MASK));
+		if (!is_list_empty(&timers->wheel[lvl][idx & TIMER_LVL_MASK]))
+			return idx << shift;
+
+		timers->pending[lvl] &= ~(1UL << (idx & TIMER_LVL_MASK));
+	}
+
+	return ~0UL;
+}
+
+static unsigned long timers_next_tick(struct timers *timers)
+{
+	unsigned long tick, next = ~0UL;
+	int lvl;
+
+	for (lvl = 0; lvl < TIMER_LEVELS; lvl++) {
+		tick = timer_level_next(timers, lvl);
+		if (tick < next)
+			next = tick;
+	}
+
+	return next;
+}
+
+/*
+ * the exact expires of the level 0 timers is used, for
+ * the higher levels the cpu need to wake up at the slot
+ * time to move the timers to the lower level
+ */
+static unsigned long timers_next_expires(struct timers *timers)
+{
+	unsigned long tick, expires = ~0UL;
+	struct timer_list *timer;
+	int lvl;
+
+	tick = timer_level_next(timers, 0);
+	if (tick != ~0UL) {
+		list_for_each_entry(timer, &timers->wheel[0][tick &
+				TIMER_LVL_MASK], entry) {
+			if (timer->expires < expires)
+				expires = timer->expires;
+		}
+	}
+
+	for (lvl = 1; lvl < TIMER_LEVELS; lvl++) {
+		tick = timer_level_next(timers, lvl);
+		if ((tick != ~0UL) && ((tick << TIMER_TICK_SHIFT) < expires))
+			expires = tick << TIMER_TICK_SHIFT;
+	}
+
+	return expires;
+}
+
+/*
+ * move all the timers in the slots which expired at the
+ * current wheel tick to the list, the slot of level n
+ * expire when the wheel tick is aligned with 64^n
+ */
+static void timers_collect(struct timers *timers, struct list_head *head)
+{
+	struct list_head *slot, *entry;
+	unsigned long idx;
+	int lvl, shift;
+
+	for (lvl = 0; lvl < TIMER_LEVELS; lvl++) {
+		shift = lvl * TIMER_LVL_BITS;
+		if (timers->clk & ((1UL << shift) - 1))
+			break;
+
+		idx = (timers->clk >> shift) & TIMER_LVL_MASK;
+		slot = &timers->wheel[lvl][idx];
+
+		while (!is_list_empty(slot)) {
+			entry = slot->next;
+			list_del(entry);
+			list_add_tail(head, entry);
+		}
+
+		timers->pending[lvl] &= ~(1UL << idx);
+	}
+}
+
 static void run_timer_softirq(struct softirq_action *h)
 {
 	struct timer_list *timer;
-	unsigned long expires = ~0, now;
+	unsigned long expires, now, tick, next;
 	struct timers *timers = &get_cpu_var(timers);
-	struct list_head *entry;
-	struct list_head *next;
+	struct list_head expired;
 	timer_func_t fn;
 	unsigned long data;
 
 	now = NOW();
+	tick = timer_tick(now);
+	init_list(&expired);
 
-	/* 
+	/*
 	 * need to aquire the spinlock in case of other
-	 * cpu process the list, first thing is to check
-	 * whether the timer has been canceled
+	 * cpu process the wheel, the wheel tick jump to
+	 * the next slot which has timers directly, so the
+	 * cost only depends on the expired timers
 	 */
 	raw_spin_lock(&timers->lock);
-	entry = &timers->active;
-	next = timers->active.next;
-
-	while ((next != entry) && (next != NULL)) {
-		timer = list_entry(next, struct timer_list, entry);
-		next = next->next;
-
-		/* 
-		 * there may be a issue that when the next entry
-		 * has been delete from the timers list, this will cause
-		 * that not all the timer can be handled, need to be
-		 * fix later, currently only panic here for debug purpose
-		 *
-		 * here use a member to indicate whether this timer is
-		 * requested to be deleted
-		 */
-		if (atomic_read(&timer->del_request)) {
-			pr_debug("timer has been deleted\n");
+
+	while (1) {
+		timers_collect(timers, &expired);
+
+		while (!is_list_empty(&expired)) {
+			timer = list_first_entry(&expired,
+					struct timer_list, entry);
 			list_del(&timer->entry);
 			timer->entry.next = NULL;
-			timer->expires = (unsigned long)~0;
-			continue;
-		}
 
-		if (timer->expires <= (now + DEFAULT_TIMER_MARGIN)) {	
-			/* 
+			/* not expired, move it to the lower level */
+			if (timer->expires > (now + DEFAULT_TIMER_MARGIN)) {
+				timer_wheel_add(timers, timer);
+				continue;
+			}
+
+			/*
 			 * need to release the spin lock to avoid
 			 * dead lock because on the timer handler
 			 * function the task may aquire other spinlocks
 			 */
 			fn = timer->function;
 			data = timer->data;
-
-			list_del(&timer->entry);
-			timer->entry.next = NULL;
 			timers->running_timer = timer;
 			raw_spin_unlock(&timers->lock);
 
@@ -85,15 +223,15 @@ static void run_timer_softirq(struct softirq_action *h)
 			raw_spin_lock(&timers->lock);
 		}
 
-		/* 
-		 * need to check whether the timer has been
-		 * add to timers list again
-		 */
-		if ((timer->entry.next != NULL) &&
-				(expires > timer->expires))
-			expires = timer->expires;
+		timers->running_timer = NULL;
+		if (timers->clk >= tick)
+			break;
+
+		next = timers_next_tick(timers);
+		timers->clk = (next < tick) ? next : tick;
 	}
 
+	expires = timers_next_expires(timers);
 	raw_spin_unlock(&timers->lock);
 
 	if (expires != ((unsigned long)~0)) {
@@ -105,11 +243,6 @@ static void run_timer_softirq(struct softirq_action *h)
 	}
 }
 
-static inline int timer_pending(const struct timer_list * timer)
-{
-	return ((timer->entry.next) != NULL);
-}
-
 static int detach_timer(struct timers *timers, struct timer_list *timer)
 {
 	struct list_head *entry = &timer->entry;
@@ -117,12 +250,24 @@ static int detach_timer(struct timers *timers, struct timer_list *timer)
 	if (timer_pending(timer)) {
 		list_del(entry);
 		entry->next = NULL;
-		atomic_set(&timer->del_request, 0);
 	}
 
 	return 0;
 }
 
+/*
+ * if there is no timer between the wheel tick and now
+ * move the wheel tick to now, then the new timer can be
+ * added to a more precise level
+ */
+static void forward_timers_clk(struct timers *timers)
+{
+	unsigned long tick = timer_tick(NOW());
+
+	if ((timers->clk < tick) && (timers_next_tick(timers) > tick))
+		timers->clk = tick;
+}
+
 static inline unsigned long slack_expires(unsigned long expires)
 {
 	return expires;
@@ -138,8 +283,8 @@ static int __mod_timer(struct timer_list *timer)
 	spin_lock_irqsave(&timers->lock, flags);
 
 	detach_timer(timers, timer);
-	list_add_tail(&timers->active, &timer->entry);
-	atomic_set(&timer->del_request, 0);
+	forward_timers_clk(timers);
+	timer_wheel_add(timers, timer);
 
 	/*
 	 * reprogram the timer for next event do not
@@ -157,7 +302,6 @@ static int __mod_timer(struct timer_list *timer)
 
 	return 0;
 }
-
 int mod_timer(struct timer_list *timer, unsigned long expires)
 {
 	struct timers *timers = timer->timers;
@@ -216,27 +360,17 @@ int del_timer(struct timer_list *timer)
 	unsigned long flags;
 	struct timers *timers = timer->timers;
 
-
 	if (!timer_pending(timer))
 		return 0;
 
-	preempt_disable();
-
-	/* 
-	 * if the timer is running on the same cpu
-	 * delete it directly otherwise set the del_request
-	 * bit
+	/*
+	 * the timer wheel is protected by the lock, so
+	 * the timer can be deleted directly even it is
+	 * on other cpu's timers
 	 */
-	if (timer->cpu == smp_processor_id()) {
-		spin_lock_irqsave(&timers->lock, flags);
-		detach_timer(timers, timer);
-		spin_unlock_irqrestore(&timers->lock, flags);
-	} else {
-		atomic_set(&timer->del_request, 1);
-		wmb();
-	}
-
-	preempt_enable();
+	spin_lock_irqsave(&timers->lock, flags);
+	detach_timer(timers, timer);
+	spin_unlock_irqrestore(&timers->lock, flags);
 
 	return 0;
 }
@@ -249,12 +383,18 @@ void add_timer(struct timer_list *timer)
 
 void init_timers(void)
 {
-	int i;
+	int i, j, lvl;
 	struct timers *timers;
 
 	for (i = 0; i < CONFIG_NR_CPUS; i++) {
 		timers = &get_per_cpu(timers, i);
-		init_list(&timers->active);
+		for (lvl = 0; lvl < TIMER_LEVELS; lvl++) {
+			timers->pending[lvl] = 0;
+			for (j = 0; j < TIMER_LVL_SIZE; j++)
+				init_list(&timers->wheel[lvl][j]);
+		}
+
+		timers->clk = 0;
 		timers->running_expires = 0;
 		spin_lock_init(&timers->lock);
 	}
@@ -66,32 +66,137 @@ int register_task_vmodule(const char *name, vmodule_init_fn fn)
 	return 0;
 }
 
+/*
+ * the switch plan of a task, it is built once when the task
+ * is created, the save and restore callbacks of the vmodules
+ * which are valid for this task are stored in flat arrays and
+ * the contexts of the vmodules are in one memory block, so the
+ * context switch do not need to walk the vmodule list, host
+ * task will skip the guest state since its vmodules are not
+ * in the plan
+ */
+struct vmodule_op {
+	void (*fn)(struct task *task, void *context);
+	void *context;
+};
+
+struct vmodule_plan {
+	int nr_context;
+	int nr_save;
+	int nr_restore;
+	struct vmodule_op *save;
+	struct vmodule_op *restore;
+	struct vmodule_op ops[0];
+};
+
+static inline int
+vmodule_valid_for_task(struct vmodule *vmodule, struct task *task)
+{
+	if (!vmodule->context_size)
+		return 0;
+
+	/* for the vcpu task some context is not necessary */
+	if (vmodule->valid_for_task && !vmodule->valid_for_task(task))
+		return 0;
+
+	return 1;
+}
+
+static inline void *
+task_vmodule_context(struct task *task, struct vmodule *vmodule)
+{
+	struct vmodule_plan *plan = task->vmodule_plan;
+
+	/* the vmodule may registered after the plan is built */
+	if (!plan || (vmodule->id >= plan->nr_context))
+		return NULL;
+
+	return task->context[vmodule->id];
+}
+
 void *get_vmodule_data_by_id(struct task *task, int id)
 {
+	struct vmodule_plan *plan = task->vmodule_plan;
+
+	if (!plan || (id < 0) || (id >= plan->nr_context))
+		return NULL;
+
 	return task->context[id];
 }
 
 void *get_vmodule_data_by_name(struct task *task, const char *name)
 {
 	struct vmodule *vmodule;
-	int id = INVALID_MODULE_ID;
 
 	list_for_each_entry(vmodule, &vmodule_list, list) {
-		if (strcmp(vmodule->name, name) == 0) {
-			id = vmodule->id;
-			break;
-		}
+		if (strcmp(vmodule->name, name) == 0)
+			return task_vmodule_context(task, vmodule);
 	}
 
-	if (id != INVALID_MODULE_ID)
-		return task->context[id];
-
 	return NULL;
 }
 
+static struct vmodule_plan *build_vmodule_plan(struct task *task)
+{
+	struct vmodule_plan *plan;
+	struct vmodule *vmodule;
+	unsigned long base;
+	size_t size = 0;
+	int nr = 0;
+	void *data;
+
+	list_for_each_entry(vmodule, &vmodule_list, list) {
+		if (!vmodule_valid_for_task(vmodule, task))
+			continue;
+
+		nr++;
+		size += BALIGN(vmodule->context_size, __cache_line_size__);
+	}
+
+	/*
+	 * plan | save ops | restore ops | contexts, each context
+	 * is cache line aligned
+	 */
+	size += sizeof(struct vmodule_plan) +
+		nr * 2 * sizeof(struct vmodule_op) +
+		2 * __cache_line_size__;
+	plan = zalloc(size);
+	if (!plan)
+		return NULL;
+
+	plan->nr_context = vmodule_class_nr;
+	plan->save = plan->ops;
+	plan->restore = plan->ops + nr;
+	base = BALIGN((unsigned long)(plan->ops + nr * 2),
+			__cache_line_size__);
+
+	list_for_each_entry(vmodule, &vmodule_list, list) {
+		if (!vmodule_valid_for_task(vmodule, task))
+			continue;
+
+		data = (void *)base;
+		base += BALIGN(vmodule->context_size, __cache_line_size__);
+		task->context[vmodule->id] = data;
+
+		if (vmodule->state_save) {
+			plan->save[plan->nr_save].fn = vmodule->state_save;
+			plan->save[plan->nr_save].context = data;
+			plan->nr_save++;
+		}
+
+		if (vmodule->state_restore) {
+			plan->restore[plan->nr_restore].fn =
+				vmodule->state_restore;
+			plan->restore[plan->nr_restore].context = data;
+			plan->nr_restore++;
+		}
+	}
+
+	return plan;
+}
+
 int task_vmodules_init(struct task *task)
 {
-	struct list_head *list;
 	struct vmodule *vmodule;
 	void *data;
 	int size;
@@ -104,31 +209,25 @@ int task_vmodules_init(struct task *task)
 	if (size == 0)
 		return 0;
 
-	task->context = malloc(size);
-	if (!task->context)
-		panic("No more memory for task vmodule cotnext\n");
-
-	memset(task->context, 0, size);
-
-	list_for_each(&vmodule_list, list) {
-		vmodule = list_entry(list, struct vmodule, list);
-		if (vmodule->context_size) {
-			/* for the vcpu task some context is not necessary */
-			if (vmodule->valid_for_task &&
-					!vmodule->valid_for_task(task))
-				continue;
-
-			/* for reboot if memory is areadly allocated skip it */
-			data = task->context[vmodule->id];
-			if (!data) {
-				data = malloc(vmodule->context_size);
-				task->context[vmodule->id] = data;
-			}
-
-			memset(data, 0, vmodule->context_size);
-			if (vmodule->state_init)
-				vmodule->state_init(task, data);
-		}
+	/* for reboot if the plan is areadly built skip it */
+	if (!task->vmodule_plan) {
+		task->context = zalloc(size);
+		if (!task->context)
+			panic("No more memory for task vmodule cotnext\n");
+
+		task->vmodule_plan = build_vmodule_plan(task);
+		if (!task->vmodule_plan)
+			panic("No more memory for task vmodule plan\n");
+	}
+
+	list_for_each_entry(vmodule, &vmodule_list, list) {
+		data = task_vmodule_context(task, vmodule);
+		if (!data)
+			continue;
+
+		memset(data, 0, vmodule->context_size);
+		if (vmodule->state_init)
+			vmodule->state_init(task, data);
 	}
 
 	return 0;
@@ -140,12 +239,17 @@ int task_vmodules_deinit(struct task *task)
 	void *data;
 
 	list_for_each_entry(vmodule, &vmodule_list, list) {
-		data = task->context[vmodule->id];
+		data = task_vmodule_context(task, vmodule);
 		if (vmodule->state_deinit && data)
 			vmodule->state_deinit(task, data);
+	}
 
-		if (data)
-			free(data);
+	/* all the contexts are in the plan's memory */
+	if (task->vmodule_plan) {
+		free(task->vmodule_plan);
+		free(task->context);
+		task->vmodule_plan = NULL;
+		task->context = NULL;
 	}
 
 	return 0;
@@ -157,7 +261,7 @@ int task_vmodules_reset(struct task *task)
 	void *data;
 
 	list_for_each_entry(vmodule, &vmodule_list, list) {
-		data = task->context[vmodule->id];
+		data = task_vmodule_context(task, vmodule);
 		if (vmodule->state_reset && data)
 			vmodule->state_reset(task, data);
 	}
@@ -167,25 +271,31 @@ int task_vmodules_reset(struct task *task)
 
 void restore_task_vmodule_state(struct task *task)
 {
-	struct vmodule *vmodule;
-	void *context;
+	struct vmodule_plan *plan = task->vmodule_plan;
+	struct vmodule_op *op;
+	int i;
 
-	list_for_each_entry(vmodule, &vmodule_list, list) {
-		context = task->context[vmodule->id];
-		if (vmodule->state_restore && context)
-			vmodule->state_restore(task, context);
+	if (!plan)
+		return;
+
+	for (i = 0; i < plan->nr_restore; i++) {
+		op = &plan->restore[i];
+		op->fn(task, op->context);
 	}
 }
 
 void save_task_vmodule_state(struct task *task)
 {
-	struct vmodule *vmodule;
-	void *context;
+	struct vmodule_plan *plan = task->vmodule_plan;
+	struct vmodule_op *op;
+	int i;
 
-	list_for_each_entry(vmodule, &vmodule_list, list) {
-		context = task->context[vmodule->id];
-		if (vmodule->state_save && context)
-			vmodule->state_save(task, context);
+	if (!plan)
+		return;
+
+	for (i = 0; i < plan->nr_save; i++) {
+		op = &plan->save[i];
+		op->fn(task, op->context);
 	}
 }
 
@@ -195,7 +305,7 @@ void suspend_task_vmodule_state(struct task *task)
 	void *context;
 
 	list_for_each_entry(vmodule, &vmodule_list, list) {
-		context = task->context[vmodule->id];
+		context = task_vmodule_context(task, vmodule);
 		if (vmodule->state_suspend && context)
 			vmodule->state_suspend(task, context);
 	}
@@ -207,7 +317,7 @@ void resume_task_vmodule_state(struct task *task)
 	void *context;
 
 	list_for_each_entry(vmodule, &vmodule_list, list) {
-		context = task->context[vmodule->id];
+		context = task_vmodule_context(task, vmodule);
 		if (vmodule->state_resume && context)
 			vmodule->state_resume(task, context);
 	}
@@ -116,6 +116,9 @@ int create_mem_mapping(struct mm_struct *mm, unsigned long addr,
 int destroy_mem_mapping(struct mm_struct *mm, unsigned long vir,
 		size_t size, unsigned long flags);
 
+void flush_guest_tlb_range(struct mm_struct *mm,
+		unsigned long ipa, size_t size);
+
 unsigned long get_mapping_entry(unsigned long tt,
 		unsigned long vir, int start, int end);
 
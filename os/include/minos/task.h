@@ -173,36 +173,18 @@ int create_task(char *name, task_func_t func,
 int release_task(struct task *task);
 struct task *pid_to_task(int pid);
 
-#define task_lock(task)					\
-	do {						\
-		if (task_is_realtime(task))		\
-			kernel_lock();			\
-		else					\
-			raw_spin_lock(&task->lock);	\
-	} while (0)
-
-#define task_unlock(task)				\
-	do {						\
-		if (task_is_realtime(task)) 		\
-			kernel_unlock();		\
-		else					\
-			raw_spin_unlock(&task->lock);	\
-	} while (0)
-
-#define task_lock_irqsave(task, flags)			\
-	do {						\
-		if (task_is_realtime(task)) 		\
-			kernel_lock_irqsave(flags);	\
-		else					\
-			spin_lock_irqsave(&task->lock, flags);	\
-	} while (0)
-
-#define task_unlock_irqrestore(task, flags)		\
-	do {						\
-		if (task_is_realtime(task)) 		\
-			kernel_unlock_irqrestore(flags);\
-		else					\
-			spin_unlock_irqrestore(&task->lock, flags);	\
-	} while (0)
+/*
+ * the realtime task's ready state is updated atomically
+ * in the global ready bitmap, so all the tasks use its
+ * own lock, the kernel lock only protect the sched result
+ */
+#define task_lock(task)			raw_spin_lock(&(task)->lock)
+#define task_unlock(task)		raw_spin_unlock(&(task)->lock)
+
+#define task_lock_irqsave(task, flags)	\
+	spin_lock_irqsave(&(task)->lock, flags)
+
+#define task_unlock_irqrestore(task, flags)	\
+	spin_unlock_irqrestore(&(task)->lock, flags)
 
 #endif
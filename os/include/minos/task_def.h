@@ -55,6 +55,7 @@
 typedef void (*task_func_t)(void *data);
 struct flag_node;
 struct event;
+struct vmodule_plan;
 
 struct task {
 	void *stack_base;
@@ -122,6 +123,7 @@ struct task {
 	void *pdata;		/* connect to the vcpu */
 	void *arch_data;	/* arch data to this task */
 	void **context;
+	struct vmodule_plan *vmodule_plan;
 } __align_cache_line;
 
 /*
@@ -8,11 +8,22 @@
 
 #define DEFAULT_TIMER_MARGIN	(10)
 
+/*
+ * the timers of each cpu are stored in a hierarchical
+ * timer wheel, each level has 64 slots and the slot of
+ * level n covers 64^n wheel ticks, one wheel tick is
+ * 2^TIMER_TICK_SHIFT ns
+ */
+#define TIMER_TICK_SHIFT	(16)
+#define TIMER_LVL_BITS		(6)
+#define TIMER_LVL_SIZE		(1 << TIMER_LVL_BITS)
+#define TIMER_LVL_MASK		(TIMER_LVL_SIZE - 1)
+#define TIMER_LEVELS		(6)
+
 typedef void (*timer_func_t)(unsigned long);
 
 struct timer_list {
 	int cpu;
-	atomic_t del_request;
 	struct list_head entry;
 	unsigned long expires;
 	timer_func_t function;
@@ -21,7 +32,9 @@ struct timer_list {
 };
 
 struct timers {
-	struct list_head active;
+	unsigned long clk;
+	unsigned long pending[TIMER_LEVELS];
+	struct list_head wheel[TIMER_LEVELS][TIMER_LVL_SIZE];
 	unsigned long running_expires;
 	struct timer_list *running_timer;
 	spinlock_t lock;
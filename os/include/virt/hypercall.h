@@ -28,6 +28,11 @@
 #define HVC_VM_VIRTIO_MMIO_DEINIT	HVC_VM0_FN(12)
 #define HVC_VM_CREATE_HOST_VDEV		HVC_VM0_FN(13)
 #define HVC_CHANGE_LOG_LEVEL		HVC_VM0_FN(14)
+#define HVC_VM_CREATE_IOEVENT		HVC_VM0_FN(15)
+#define HVC_VM_REGISTER_IOEVENT		HVC_VM0_FN(16)
+#define HVC_VM_CREATE_VIRQ_DOORBELL	HVC_VM0_FN(17)
+#define HVC_VM_KICK_VIRQ_DOORBELL	HVC_VM0_FN(18)
+#define HVC_VM_CREATE_VCPU_STATS	HVC_VM0_FN(19)
 
 #define HVC_MAILBOX_QUERY_INSTANCE	HVC_MAILBOX_FN(0)
 #define HVC_MAILBOX_GET_INFO		HVC_MAILBOX_FN(1)
@@ -9,6 +9,29 @@
 
 #define VDEV_NAME_SIZE	(15)
 
+/*
+ * the registered (address, value) pairs are handled
+ * in the hypervisor directly, the index of the entry
+ * is the pending bit in the doorbell page
+ */
+struct vm_ioevent {
+	int virq;
+	int nr;
+	struct ioevent_doorbell *doorbell;
+	unsigned long hvm_doorbell;
+	unsigned long addr[VM_MAX_IOEVENTS];
+	uint32_t value[VM_MAX_IOEVENTS];
+};
+
+/*
+ * all the vdevs of a vm sorted by the guest physical
+ * address, rebuilt when a vdev is added or removed
+ */
+struct vdev_index {
+	int nr;
+	struct vdev *vdevs[0];
+};
+
 typedef void *(*vdev_init_t)(struct vm *vm, struct device_node *node);
 
 struct vdev {
@@ -41,6 +64,13 @@ int host_vdev_init(struct vm *vm, struct vdev *vdev,
 int vdev_mmio_emulation(gp_regs *regs, int write,
 		unsigned long address, unsigned long *value);
 void vdev_set_name(struct vdev *vdev, char *name);
+void vm_release_vdev_index(struct vm *vm);
+int vm_create_ioevent(struct vm *vm, unsigned long *hbase);
+int vm_register_ioevent(struct vm *vm,
+		unsigned long addr, unsigned long value);
+void vm_release_ioevent(struct vm *vm);
+int vm_signal_ioevent(struct vm *vm,
+		unsigned long address, unsigned long value);
 
 static int inline vdev_notify_gvm(struct vdev *vdev, uint32_t irq)
 {
@@ -198,6 +198,8 @@ int request_hw_virq(struct vm *vm, uint32_t virq, uint32_t hwirq,
 int request_virq_pervcpu(struct vm *vm, uint32_t virq,
 			unsigned long flags);
 int request_virq(struct vm *vm, uint32_t virq, unsigned long flags);
+unsigned long vm_create_virq_doorbell(struct vm *vm);
+int vm_kick_virq_doorbell(struct vm *vm);
 
 static inline int alloc_hvm_virq(void)
 {
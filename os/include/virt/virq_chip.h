@@ -21,6 +21,7 @@ struct virq_chip {
 	/* for vgicv2 and vgicv3 that support hw virtualaztion */
 #if defined(CONFIG_VIRQCHIP_VGICV2) || defined(CONFIG_VIRQCHIP_VGICV3)
 	int nr_lrs;
+	unsigned long (*get_empty_lrs)(struct vcpu *vcpu);
 #endif
 
 	void *inc_pdata;
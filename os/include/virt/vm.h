@@ -36,6 +36,9 @@ struct os;
 struct vm;
 struct virq_struct;
 struct virq_chip;
+struct vm_ioevent;
+struct vdev;
+struct vdev_index;
 
 extern struct list_head vm_list;
 extern struct list_head mem_list;
@@ -59,6 +62,11 @@ struct vcpu {
 
 	struct vmcs *vmcs;
 	int vmcs_irq;
+
+	/* the vdev which handled the last mmio trap */
+	struct vdev *last_vdev;
+
+	struct vcpu_stats *stats;
 } __align_cache_line;
 
 struct vm {
@@ -79,6 +87,7 @@ struct vm {
 	unsigned long time_offset;
 
 	struct list_head vdev_list;
+	struct vdev_index *vdev_index;
 
 	uint32_t vspi_nr;
 	int virq_same_page;
@@ -89,6 +98,14 @@ struct vm {
 	void *vmcs;
 	void *hvm_vmcs;
 	void *resource;
+
+	struct vm_ioevent *ioevent;
+
+	struct virq_doorbell *virq_db;
+	unsigned long hvm_virq_db;
+
+	struct vcpu_stats *stats;
+	unsigned long hvm_stats;
 } __align(sizeof(unsigned long));
 
 extern struct vm *vms[CONFIG_MAX_VM];
@@ -157,6 +174,17 @@ int vcpu_power_on(struct vcpu *caller, unsigned long affinity,
 		unsigned long entry, unsigned long unsed);
 int vcpu_power_off(struct vcpu *vcpu, int timeout);
 void kick_vcpu(struct vcpu *vcpu, int preempt);
+unsigned long vm_create_vcpu_stats(struct vm *vm);
+
+static inline void vcpu_stat_hist(uint64_t *hist, unsigned long ticks)
+{
+	int bucket = fls64(ticks);
+
+	if (bucket >= VCPU_STAT_HIST_NR)
+		bucket = VCPU_STAT_HIST_NR - 1;
+
+	hist[bucket]++;
+}
 
 static inline void exit_from_guest(struct vcpu *vcpu, gp_regs *regs)
 {
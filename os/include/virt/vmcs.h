@@ -3,19 +3,38 @@
 
 #include <minos/types.h>
 
-struct vmcs {
-	volatile uint32_t vcpu_id;
+/*
+ * each vcpu has a single producer single consumer ring
+ * of trap descriptors, the hypervisor produces traps at
+ * host_index and the mvm consumes them at guest_index,
+ * a trap is completed when guest_index has passed it
+ */
+#define VMCS_RING_SIZE		(16)
+#define VMCS_RING_MASK		(VMCS_RING_SIZE - 1)
+
+#define VMCS_TRAP_F_NONBLOCK	(1 << 0)
+
+struct vmcs_trap {
 	volatile uint32_t trap_type;
 	volatile uint32_t trap_reason;
 	volatile int32_t  trap_ret;
+	volatile uint32_t trap_flags;
 	volatile unsigned long trap_data;
 	volatile unsigned long trap_result;
+};
+
+struct vmcs {
+	volatile uint32_t vcpu_id;
+	volatile uint32_t ring_size;
 	volatile uint64_t host_index;
 	volatile uint64_t guest_index;
+	volatile uint64_t reserved;
+	struct vmcs_trap ring[VMCS_RING_SIZE];
 	volatile unsigned long data[0];
 } __align(1024);
 
-#define VMCS_DATA_SIZE	(1024 - 48)
+#define VMCS_DATA_SIZE	(1024 - 32 - \
+		VMCS_RING_SIZE * sizeof(struct vmcs_trap))
 #define VMCS_SIZE(nr) 	PAGE_BALIGN(nr * sizeof(struct vmcs))
 
 enum vm_trap_type {
@@ -22,6 +22,7 @@
 #include <virt/virq.h>
 #include <virt/virtio.h>
 #include <virt/vmcs.h>
+#include <virt/vdev.h>
 
 static int vm_hvc_handler(gp_regs *c, uint32_t id, uint64_t *args)
 {
@@ -93,6 +94,26 @@ static int vm_hvc_handler(gp_regs *c, uint32_t id, uint64_t *args)
 		ret = vm_create_host_vdev(vm);
 		HVC_RET1(c, ret);
 		break;
+	case HVC_VM_CREATE_IOEVENT:
+		ret = vm_create_ioevent(vm, &hbase);
+		HVC_RET2(c, ret, hbase);
+		break;
+	case HVC_VM_REGISTER_IOEVENT:
+		ret = vm_register_ioevent(vm, args[1], args[2]);
+		HVC_RET1(c, ret);
+		break;
+	case HVC_VM_CREATE_VIRQ_DOORBELL:
+		addr = vm_create_virq_doorbell(vm);
+		HVC_RET1(c, addr);
+		break;
+	case HVC_VM_KICK_VIRQ_DOORBELL:
+		ret = vm_kick_virq_doorbell(vm);
+		HVC_RET1(c, ret);
+		break;
+	case HVC_VM_CREATE_VCPU_STATS:
+		addr = vm_create_vcpu_stats(vm);
+		HVC_RET1(c, addr);
+		break;
 	case HVC_CHANGE_LOG_LEVEL:
 		change_log_level((unsigned int)args[0]);
 		break;
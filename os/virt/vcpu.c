@@ -38,19 +38,49 @@ static int total_vms = 0;
 DEFINE_SPIN_LOCK(vms_lock);
 static DECLARE_BITMAP(vmid_bitmap, CONFIG_MAX_VM);
 
+/*
+ * the vmid is also the hardware VMID which tagged the stage2
+ * TLBs, so the TLBs do not need to be flushed when switch
+ * the vcpu. the vmid is allocated round robin, the vmid of a
+ * destroyed vm is marked as stale, when a stale vmid is used
+ * again a new generation begins and all the guest TLBs are
+ * flushed once, then all stale vmids are clean again
+ */
+static DECLARE_BITMAP(vmid_stale, CONFIG_MAX_VM);
+static unsigned long vmid_generation;
+static int vmid_next;
+
 static LIST_HEAD(vmtag_list);
 LIST_HEAD(vm_list);
 
+/* need to be called with vms_lock held */
+static void vmid_rollover_check(int vmid)
+{
+	if (!test_bit(vmid, vmid_stale))
+		return;
+
+	vmid_generation++;
+	bitmap_zero(vmid_stale, CONFIG_MAX_VM);
+	flush_all_tlbis_guest();
+
+	pr_debug("vmid rollover to generation %d\n", vmid_generation);
+}
+
 static int alloc_new_vmid(void)
 {
-	int vmid, start = total_vms;
+	int vmid;
 
 	spin_lock(&vms_lock);
-	vmid = find_next_zero_bit_loop(vmid_bitmap, CONFIG_MAX_VM, start);
-	if (vmid >= CONFIG_MAX_VM)
+	vmid = find_next_zero_bit_loop(vmid_bitmap,
+			CONFIG_MAX_VM, vmid_next);
+	if (vmid >= CONFIG_MAX_VM) {
+		vmid = VMID_INVALID;
 		goto out;
+	}
 
 	set_bit(vmid, vmid_bitmap);
+	vmid_rollover_check(vmid);
+	vmid_next = (vmid + 1) % CONFIG_MAX_VM;
 out:
 	spin_unlock(&vms_lock);
 
@@ -404,6 +434,39 @@ int vcpu_reset(struct vcpu *vcpu)
 	return 0;
 }
 
+unsigned long vm_create_vcpu_stats(struct vm *vm)
+{
+	int i;
+	size_t size;
+	unsigned long hva;
+
+	if (!vm || vm_is_hvm(vm) || !vm->vcpus)
+		return 0;
+
+	if (vm->stats)
+		return vm->hvm_stats;
+
+	size = PAGE_BALIGN(vm->vcpu_nr * sizeof(struct vcpu_stats));
+	vm->stats = get_io_pages(PAGE_NR(size));
+	if (!vm->stats)
+		return 0;
+
+	memset(vm->stats, 0, size);
+	hva = create_hvm_iomem_map(vm, (unsigned long)vm->stats, size);
+	if (hva == INVALID_ADDRESS) {
+		pr_err("mapping vcpu stats to hvm failed\n");
+		free_pages(vm->stats);
+		vm->stats = NULL;
+		return 0;
+	}
+
+	vm->hvm_stats = hva;
+	for (i = 0; i < vm->vcpu_nr; i++)
+		vm->vcpus[i]->stats = &vm->stats[i];
+
+	return hva;
+}
+
 void destroy_vm(struct vm *vm)
 {
 	int i;
@@ -421,6 +484,7 @@ void destroy_vm(struct vm *vm)
 	 * 5 : update the vmid bitmap
 	 * 6 : do vmodule deinit
 	 */
+	vm_release_vdev_index(vm);
 	list_for_each_entry_safe(vdev, n, &vm->vdev_list, list) {
 		list_del(&vdev->list);
 		if (vdev->deinit)
@@ -445,11 +509,22 @@ void destroy_vm(struct vm *vm)
 
 	vm->hvm_vmcs = NULL;
 	vm->vmcs = NULL;
+
+	if (vm->stats) {
+		destroy_hvm_iomem_map(vm->hvm_stats, PAGE_BALIGN(
+				vm->vcpu_nr * sizeof(struct vcpu_stats)));
+		free_pages(vm->stats);
+		vm->stats = NULL;
+		vm->hvm_stats = 0;
+	}
+
+	vm_release_ioevent(vm);
 	release_vm_memory(vm);
 
 	i = vm->vmid;
 	spin_lock(&vms_lock);
 	clear_bit(i, vmid_bitmap);
+	set_bit(i, vmid_stale);
 	list_del(&vm->vm_list);
 	spin_unlock(&vms_lock);
 
@@ -528,8 +603,14 @@ struct vm *create_vm(struct vmtag *vme)
 		if (vme->vmid == VMID_INVALID)
 			return NULL;
 	} else {
-		if (test_and_set_bit(vme->vmid, vmid_bitmap))
+		spin_lock(&vms_lock);
+		if (test_and_set_bit(vme->vmid, vmid_bitmap)) {
+			spin_unlock(&vms_lock);
 			return NULL;
+		}
+
+		vmid_rollover_check(vme->vmid);
+		spin_unlock(&vms_lock);
 
 		native = 1;
 	}
@@ -19,6 +19,7 @@
 #include <virt/vdev.h>
 #include <virt/virq.h>
 #include <virt/vmcs.h>
+#include <virt/vmm.h>
 
 void vdev_set_name(struct vdev *vdev, char *name)
 {
@@ -34,9 +35,110 @@ void vdev_set_name(struct vdev *vdev, char *name)
 	strncpy(vdev->name, name, len);
 }
 
+static void vm_clear_vdev_cache(struct vm *vm)
+{
+	struct vcpu *vcpu;
+
+	if (!vm->vcpus)
+		return;
+
+	vm_for_each_vcpu(vm, vcpu)
+		vcpu->last_vdev = NULL;
+}
+
+static int vm_rebuild_vdev_index(struct vm *vm, struct vdev *exclude)
+{
+	int i, nr = 0;
+	struct vdev *vdev;
+	struct vdev_index *index, *old = vm->vdev_index;
+
+	list_for_each_entry(vdev, &vm->vdev_list, list) {
+		if (vdev != exclude)
+			nr++;
+	}
+
+	index = malloc(sizeof(*index) + nr * sizeof(struct vdev *));
+	if (!index)
+		return -ENOMEM;
+
+	/* insertion sort, the vdev count of a vm is small */
+	index->nr = 0;
+	list_for_each_entry(vdev, &vm->vdev_list, list) {
+		if (vdev == exclude)
+			continue;
+
+		for (i = index->nr; i > 0; i--) {
+			if (index->vdevs[i - 1]->gvm_paddr <= vdev->gvm_paddr)
+				break;
+			index->vdevs[i] = index->vdevs[i - 1];
+		}
+
+		index->vdevs[i] = vdev;
+		index->nr++;
+	}
+
+	/*
+	 * the vdevs are added or removed when the vm is
+	 * not running, so the old index can be freed
+	 */
+	wmb();
+	vm->vdev_index = index;
+	vm_clear_vdev_cache(vm);
+
+	if (old)
+		free(old);
+
+	return 0;
+}
+
+void vm_release_vdev_index(struct vm *vm)
+{
+	vm_clear_vdev_cache(vm);
+
+	if (vm->vdev_index) {
+		free(vm->vdev_index);
+		vm->vdev_index = NULL;
+	}
+}
+
+static struct vdev *vm_find_vdev(struct vm *vm, unsigned long address)
+{
+	int l, r, m;
+	struct vdev *vdev;
+	struct vdev_index *index = vm->vdev_index;
+
+	if (!index)
+		return NULL;
+
+	/* find the last vdev whose base is not above the address */
+	l = 0;
+	r = index->nr - 1;
+	while (l <= r) {
+		m = (l + r) / 2;
+		if (index->vdevs[m]->gvm_paddr <= address)
+			l = m + 1;
+		else
+			r = m - 1;
+	}
+
+	if (r < 0)
+		return NULL;
+
+	vdev = index->vdevs[r];
+	if (address < vdev->gvm_paddr + vdev->mem_size)
+		return vdev;
+
+	return NULL;
+}
+
 void vdev_release(struct vdev *vdev)
 {
+	struct vm *vm = vdev->vm;
 
+	if (!vm || !vm->vdev_index)
+		return;
+
+	vm_rebuild_vdev_index(vm, vdev);
 }
 
 static void vdev_deinit(struct vdev *vdev)
@@ -63,7 +165,7 @@ int host_vdev_init(struct vm *vm, struct vdev *vdev,
 	vdev->deinit = vdev_deinit;
 	list_add_tail(&vm->vdev_list, &vdev->list);
 
-	return 0;
+	return vm_rebuild_vdev_index(vm, NULL);
 }
 
 struct vdev *create_host_vdev(struct vm *vm, unsigned long base, uint32_t size)
@@ -81,20 +183,148 @@ struct vdev *create_host_vdev(struct vm *vm, unsigned long base, uint32_t size)
 	return vdev;
 }
 
+int vm_create_ioevent(struct vm *vm, unsigned long *hbase)
+{
+	struct vm_ioevent *ioevent;
+
+	if (vm->ioevent)
+		return -EEXIST;
+
+	ioevent = zalloc(sizeof(*ioevent));
+	if (!ioevent)
+		return -ENOMEM;
+
+	ioevent->doorbell = get_io_page();
+	if (!ioevent->doorbell)
+		goto out;
+
+	memset(ioevent->doorbell, 0, PAGE_SIZE);
+	ioevent->hvm_doorbell = create_hvm_iomem_map(vm,
+			(unsigned long)ioevent->doorbell, PAGE_SIZE);
+	if (ioevent->hvm_doorbell == INVALID_ADDRESS) {
+		pr_err("mapping ioevent doorbell to hvm failed\n");
+		goto out_free_page;
+	}
+
+	ioevent->virq = alloc_hvm_virq();
+	if (ioevent->virq < 0) {
+		pr_err("alloc virq for ioevent failed\n");
+		goto out_unmap;
+	}
+
+	vm->ioevent = ioevent;
+	*hbase = ioevent->hvm_doorbell;
+
+	return ioevent->virq;
+
+out_unmap:
+	destroy_hvm_iomem_map(ioevent->hvm_doorbell, PAGE_SIZE);
+out_free_page:
+	free_pages(ioevent->doorbell);
+out:
+	free(ioevent);
+	return -ENOMEM;
+}
+
+int vm_register_ioevent(struct vm *vm,
+		unsigned long addr, unsigned long value)
+{
+	int index;
+	struct vm_ioevent *ioevent = vm->ioevent;
+
+	if (!ioevent)
+		return -ENOENT;
+
+	if (ioevent->nr >= VM_MAX_IOEVENTS)
+		return -ENOSPC;
+
+	/*
+	 * the ioevent is registered before the vm is powered
+	 * up, the lookup side read the entry lockless, so
+	 * update the nr after the entry is ready
+	 */
+	index = ioevent->nr;
+	ioevent->addr[index] = addr;
+	ioevent->value[index] = (uint32_t)value;
+	wmb();
+	ioevent->nr = index + 1;
+
+	return index;
+}
+
+void vm_release_ioevent(struct vm *vm)
+{
+	struct vm_ioevent *ioevent = vm->ioevent;
+
+	if (!ioevent)
+		return;
+
+	vm->ioevent = NULL;
+	release_hvm_virq(ioevent->virq);
+	destroy_hvm_iomem_map(ioevent->hvm_doorbell, PAGE_SIZE);
+	free_pages(ioevent->doorbell);
+	free(ioevent);
+}
+
+/*
+ * called by the vdev which support ioevent, such as the
+ * QUEUE_NOTIFY of the virtio device, return 1 if the write
+ * is matched and the hvm has been kicked
+ */
+int vm_signal_ioevent(struct vm *vm,
+		unsigned long address, unsigned long value)
+{
+	int i;
+	struct vm_ioevent *ioevent = vm->ioevent;
+	struct ioevent_doorbell *db;
+
+	if (!ioevent)
+		return 0;
+
+	for (i = 0; i < ioevent->nr; i++) {
+		if ((ioevent->addr[i] != address) ||
+				(ioevent->value[i] != (uint32_t)value))
+			continue;
+
+		/*
+		 * set the pending bit and kick the hvm only when
+		 * the mvm has already handle the last kick
+		 */
+		db = ioevent->doorbell;
+		set_bit(i, (unsigned long *)db->pending);
+		if (!test_and_set_bit(0, (unsigned long *)&db->kicked))
+			send_virq_to_vm(get_vm_by_id(0), ioevent->virq);
+
+		return 1;
+	}
+
+	return 0;
+}
+
 int vdev_mmio_emulation(gp_regs *regs, int write,
 		unsigned long address, unsigned long *value)
 {
-	struct vm *vm = get_current_vm();
+	struct vcpu *vcpu = get_current_vcpu();
+	struct vm *vm = vcpu->vm;
 	struct vdev *vdev;
 
-	list_for_each_entry(vdev, &vm->vdev_list, list) {
-		if ((address >= vdev->gvm_paddr) &&
-			(address < vdev->gvm_paddr + vdev->mem_size)) {
-			if (write)
-				return vdev->write(vdev, regs, address, value);
-			else
-				return vdev->read(vdev, regs, address, value);
-		}
+	/*
+	 * check the vdev which handled the last mmio trap
+	 * of this vcpu first, usually the guest access the
+	 * same device continuously
+	 */
+	vdev = vcpu->last_vdev;
+	if (!vdev || (address < vdev->gvm_paddr) ||
+			(address >= vdev->gvm_paddr + vdev->mem_size)) {
+		vdev = vm_find_vdev(vm, address);
+		vcpu->last_vdev = vdev;
+	}
+
+	if (vdev) {
+		if (write)
+			return vdev->write(vdev, regs, address, value);
+		else
+			return vdev->read(vdev, regs, address, value);
 	}
 
 	/*
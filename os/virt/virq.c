@@ -297,6 +297,70 @@ int send_virq_to_vm(struct vm *vm, uint32_t virq)
 	return send_virq(vcpu, desc);
 }
 
+unsigned long vm_create_virq_doorbell(struct vm *vm)
+{
+	unsigned long hva;
+
+	if (!vm || vm_is_hvm(vm))
+		return 0;
+
+	if (vm->virq_db)
+		return vm->hvm_virq_db;
+
+	vm->virq_db = get_io_page();
+	if (!vm->virq_db)
+		return 0;
+
+	memset(vm->virq_db, 0, PAGE_SIZE);
+	hva = create_hvm_iomem_map(vm, (unsigned long)vm->virq_db, PAGE_SIZE);
+	if (hva == INVALID_ADDRESS) {
+		pr_err("mapping virq doorbell to hvm failed\n");
+		free_pages(vm->virq_db);
+		vm->virq_db = NULL;
+		return 0;
+	}
+
+	vm->hvm_virq_db = hva;
+
+	return hva;
+}
+
+int vm_kick_virq_doorbell(struct vm *vm)
+{
+	int i, bit, count = 0;
+	uint32_t pending;
+	struct virq_doorbell *db;
+
+	if (!vm || !vm->virq_db)
+		return -ENOENT;
+
+	/*
+	 * clear the kicked flag before handle the pending
+	 * bits, the virq which set after this will kick
+	 * the hypervisor again
+	 */
+	db = vm->virq_db;
+	test_and_clear_bit(0, (unsigned long *)&db->kicked);
+	mb();
+
+	for (i = 0; i < VM_MAX_DOORBELL_VIRQS / 32; i++) {
+		pending = db->pending[i];
+		while (pending) {
+			bit = __ffs(pending);
+			pending &= ~(1U << bit);
+
+			if (!test_and_clear_bit(bit,
+					(unsigned long *)&db->pending[i]))
+				continue;
+
+			send_virq_to_vm(vm, i * 32 + bit);
+			count++;
+		}
+	}
+
+	return count;
+}
+
 void send_vsgi(struct vcpu *sender, uint32_t sgi, cpumask_t *cpumask)
 {
 	int cpu;
@@ -693,6 +757,13 @@ static int virq_destroy_vm(void *item, void *data)
 	if (!vm->virq_same_page)
 		free(vm->vspi_map);
 
+	if (vm->virq_db) {
+		destroy_hvm_iomem_map(vm->hvm_virq_db, PAGE_SIZE);
+		free_pages(vm->virq_db);
+		vm->virq_db = NULL;
+		vm->hvm_virq_db = 0;
+	}
+
 	return 0;
 }
 
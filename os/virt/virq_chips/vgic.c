@@ -107,12 +107,26 @@ int vgic_irq_exit_from_guest(struct vcpu *vcpu, void *data)
 	 * need spinlock
 	 */
 	int status;
+	unsigned long empty = 0;
 	struct virq_desc *virq, *n;
+	struct virq_chip *vc = vcpu->vm->virq_chip;
 	struct virq_struct *virq_struct = vcpu->virq_struct;
 
-	list_for_each_entry_safe(virq, n, &virq_struct->active_list, list) {
+	if (is_list_empty(&virq_struct->active_list))
+		return 0;
+
+	/*
+	 * the LR which is empty means the virq is inactive, no
+	 * need to read the LR for it
+	 */
+	if (vc->get_empty_lrs)
+		empty = vc->get_empty_lrs(vcpu);
 
-		status = virqchip_get_virq_state(vcpu, virq);
+	list_for_each_entry_safe(virq, n, &virq_struct->active_list, list) {
+		if ((virq->id < vc->nr_lrs) && (empty & (1UL << virq->id)))
+			status = VIRQ_STATE_INACTIVE;
+		else
+			status = virqchip_get_virq_state(vcpu, virq);
 
 		/*
 		 * the virq has been handled by the VCPU, if
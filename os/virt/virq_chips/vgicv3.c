@@ -30,6 +30,7 @@
 #include <virt/virq_chip.h>
 #include "vgic.h"
 #include <minos/of.h>
+#include <minos/percpu.h>
 
 #define vdev_to_vgic(vdev) \
 	(struct vgicv3_dev *)container_of(vdev, struct vgicv3_dev, vdev)
@@ -684,6 +685,12 @@ static int gicv3_get_virq_state(struct vcpu *vcpu, struct virq_desc *virq)
 	return ((int)value);
 }
 
+/* ICH_ELRSR_EL2 : the LRs which have no valid interrupt */
+static unsigned long gicv3_get_empty_lrs(struct vcpu *vcpu)
+{
+	return read_sysreg32(ICH_ELRSR_EL2);
+}
+
 static void vgicv3_init_virqchip(struct virq_chip *vc,
 		struct vgicv3_dev *dev, unsigned long flags)
 {
@@ -695,6 +702,7 @@ static void vgicv3_init_virqchip(struct virq_chip *vc,
 		vc->send_virq = gicv3_send_virq;
 		vc->update_virq = gicv3_update_virq;
 		vc->get_virq_state = gicv3_get_virq_state;
+		vc->get_empty_lrs = gicv3_get_empty_lrs;
 		vc->vm0_virq_data = gic_vm0_virq_data;
 		vc->flags = flags;
 	} else {
@@ -768,47 +776,59 @@ release_gic:
 }
 VIRQCHIP_DECLARE(vgicv3_chip, gicv3_match_table, vgicv3_virqchip_init);
 
-static void gicv3_save_lrs(struct gicv3_context *c, uint32_t count)
+/*
+ * the state of the virtual cpu interface on each pcpu, when
+ * switch the task only the LRs which are in use and the
+ * registers which are changed will be accessed
+ *
+ * lr_live  - the LRs which may not be zero in the hardware
+ * apr_live - the APRn registers may not be zero
+ * valid    - the vmcr/sre/hcr value are same as the hardware
+ */
+struct gicv3_hw_state {
+	unsigned long lr_live;
+	int apr_live;
+	int valid;
+	uint32_t icc_sre_el1;
+	uint32_t ich_vmcr_el2;
+	uint32_t ich_hcr_el2;
+};
+
+static DEFINE_PER_CPU(struct gicv3_hw_state, gicv3_hw_state);
+
+/*
+ * the LRs allocated to the vcpu, the LR is written when
+ * the virq is sent and cleared when the virq is done, so
+ * the LRs not in the irq_bitmap are always zero
+ */
+static inline unsigned long gicv3_task_used_lrs(struct task *task)
 {
-	if (count > 16)
-		panic("Unsupport LR count\n");
+	struct vcpu *vcpu;
 
-	switch (count) {
-	case 16:
-		c->ich_lr15_el2 = read_sysreg(ICH_LR15_EL2);
-	case 15:
-		c->ich_lr14_el2 = read_sysreg(ICH_LR14_EL2);
-	case 14:
-		c->ich_lr13_el2 = read_sysreg(ICH_LR13_EL2);
-	case 13:
-		c->ich_lr12_el2 = read_sysreg(ICH_LR12_EL2);
-	case 12:
-		c->ich_lr11_el2 = read_sysreg(ICH_LR11_EL2);
-	case 11:
-		c->ich_lr10_el2 = read_sysreg(ICH_LR10_EL2);
-	case 10:
-		c->ich_lr9_el2 = read_sysreg(ICH_LR9_EL2);
-	case 9:
-		c->ich_lr8_el2 = read_sysreg(ICH_LR8_EL2);
-	case 8:
-		c->ich_lr7_el2 = read_sysreg(ICH_LR7_EL2);
-	case 7:
-		c->ich_lr6_el2 = read_sysreg(ICH_LR6_EL2);
-	case 6:
-		c->ich_lr5_el2 = read_sysreg(ICH_LR5_EL2);
-	case 5:
-		c->ich_lr4_el2 = read_sysreg(ICH_LR4_EL2);
-	case 4:
-		c->ich_lr3_el2 = read_sysreg(ICH_LR3_EL2);
-	case 3:
-		c->ich_lr2_el2 = read_sysreg(ICH_LR2_EL2);
-	case 2:
-		c->ich_lr1_el2 = read_sysreg(ICH_LR1_EL2);
-	case 1:
-		c->ich_lr0_el2 = read_sysreg(ICH_LR0_EL2);
-		break;
-	default:
-		break;
+	if (!(task->flags & TASK_FLAGS_VCPU))
+		return 0;
+
+	vcpu = task_to_vcpu(task);
+	if (!vcpu || !vcpu->virq_struct)
+		return 0;
+
+	return (vcpu->virq_struct->irq_bitmap[0] &
+			((1UL << gicv3_nr_lr) - 1));
+}
+
+static void gicv3_save_lrs(struct gicv3_context *c, unsigned long used)
+{
+	unsigned long empty;
+	int i;
+
+	/* the empty LR has no valid interrupt, no need to read it */
+	empty = read_sysreg32(ICH_ELRSR_EL2);
+
+	for_each_set_bit(i, &used, gicv3_nr_lr) {
+		if (empty & (1UL << i))
+			c->ich_lr_el2[i] = 0;
+		else
+			c->ich_lr_el2[i] = gicv3_read_lr(i);
 	}
 }
 
@@ -830,16 +850,50 @@ static void gicv3_save_aprn(struct gicv3_context *c, uint32_t count)
 	}
 }
 
+static inline int gicv3_aprn_live(struct gicv3_context *c)
+{
+	return !!(c->ich_ap0r0_el2 | c->ich_ap1r0_el2 |
+		c->ich_ap0r1_el2 | c->ich_ap1r1_el2 |
+		c->ich_ap0r2_el2 | c->ich_ap1r2_el2);
+}
+
 static void gicv3_state_save(struct task *task, void *context)
 {
 	struct gicv3_context *c = (struct gicv3_context *)context;
+	struct gicv3_hw_state *hw = &get_cpu_var(gicv3_hw_state);
+	unsigned long used;
+
+	/* host task never change the virtual cpu interface */
+	if (!(task->flags & TASK_FLAGS_VCPU))
+		return;
 
 	dsb();
-	gicv3_save_lrs(c, gicv3_nr_lr);
-	gicv3_save_aprn(c, gicv3_nr_pr);
+	used = gicv3_task_used_lrs(task);
+	gicv3_save_lrs(c, used);
+
+	/*
+	 * the active priority is only set when there is a
+	 * active virq in the LRs
+	 */
+	if (used || hw->apr_live) {
+		gicv3_save_aprn(c, gicv3_nr_pr);
+		hw->apr_live = gicv3_aprn_live(c);
+	} else {
+		c->ich_ap0r0_el2 = c->ich_ap1r0_el2 = 0;
+		c->ich_ap0r1_el2 = c->ich_ap1r1_el2 = 0;
+		c->ich_ap0r2_el2 = c->ich_ap1r2_el2 = 0;
+	}
+
 	c->icc_sre_el1 = read_sysreg32(ICC_SRE_EL1);
 	c->ich_vmcr_el2 = read_sysreg32(ICH_VMCR_EL2);
 	c->ich_hcr_el2 = read_sysreg32(ICH_HCR_EL2);
+
+	/* the LRs are still in the hardware */
+	hw->lr_live |= used;
+	hw->icc_sre_el1 = c->icc_sre_el1;
+	hw->ich_vmcr_el2 = c->ich_vmcr_el2;
+	hw->ich_hcr_el2 = c->ich_hcr_el2;
+	hw->valid = 1;
 }
 
 static void gicv3_restore_aprn(struct gicv3_context *c, uint32_t count)
@@ -860,59 +914,55 @@ static void gicv3_restore_aprn(struct gicv3_context *c, uint32_t count)
 	}
 }
 
-static void gicv3_restore_lrs(struct gicv3_context *c, uint32_t count)
+static void gicv3_restore_lrs(struct gicv3_context *c,
+		struct gicv3_hw_state *hw, unsigned long used)
 {
-	if (count > 16)
-		panic("Unsupport LR count");
+	unsigned long clear = hw->lr_live & ~used;
+	int i;
 
-	switch (count) {
-	case 16:
-		write_sysreg(c->ich_lr15_el2, ICH_LR15_EL2);
-	case 15:
-		write_sysreg(c->ich_lr14_el2, ICH_LR14_EL2);
-	case 14:
-		write_sysreg(c->ich_lr13_el2, ICH_LR13_EL2);
-	case 13:
-		write_sysreg(c->ich_lr12_el2, ICH_LR12_EL2);
-	case 12:
-		write_sysreg(c->ich_lr11_el2, ICH_LR11_EL2);
-	case 11:
-		write_sysreg(c->ich_lr10_el2, ICH_LR10_EL2);
-	case 10:
-		write_sysreg(c->ich_lr9_el2, ICH_LR9_EL2);
-	case 9:
-		write_sysreg(c->ich_lr8_el2, ICH_LR8_EL2);
-	case 8:
-		write_sysreg(c->ich_lr7_el2, ICH_LR7_EL2);
-	case 7:
-		write_sysreg(c->ich_lr6_el2, ICH_LR6_EL2);
-	case 6:
-		write_sysreg(c->ich_lr5_el2, ICH_LR5_EL2);
-	case 5:
-		write_sysreg(c->ich_lr4_el2, ICH_LR4_EL2);
-	case 4:
-		write_sysreg(c->ich_lr3_el2, ICH_LR3_EL2);
-	case 3:
-		write_sysreg(c->ich_lr2_el2, ICH_LR2_EL2);
-	case 2:
-		write_sysreg(c->ich_lr1_el2, ICH_LR1_EL2);
-	case 1:
-		write_sysreg(c->ich_lr0_el2, ICH_LR0_EL2);
-		break;
-	default:
-		break;
-	}
+	/* clear the LRs left by the last task */
+	for_each_set_bit(i, &clear, gicv3_nr_lr)
+		gicv3_write_lr(i, 0);
+
+	for_each_set_bit(i, &used, gicv3_nr_lr)
+		gicv3_write_lr(i, c->ich_lr_el2[i]);
+
+	hw->lr_live = used;
 }
 
 static void gicv3_state_restore(struct task *task, void *context)
 {
 	struct gicv3_context *c = (struct gicv3_context *)context;
+	struct gicv3_hw_state *hw = &get_cpu_var(gicv3_hw_state);
+	int apr_live;
+
+	gicv3_restore_lrs(c, hw, gicv3_task_used_lrs(task));
 
-	gicv3_restore_lrs(c, gicv3_nr_lr);
-	gicv3_restore_aprn(c, gicv3_nr_pr);
-	write_sysreg32(c->icc_sre_el1, ICC_SRE_EL1);
-	write_sysreg32(c->ich_vmcr_el2, ICH_VMCR_EL2);
-	write_sysreg32(c->ich_hcr_el2, ICH_HCR_EL2);
+	apr_live = gicv3_aprn_live(c);
+	if (apr_live || hw->apr_live) {
+		gicv3_restore_aprn(c, gicv3_nr_pr);
+		hw->apr_live = apr_live;
+	}
+
+	/*
+	 * the host task do not use the virtual cpu interface
+	 * just keep the value of the last vcpu
+	 */
+	if (!(task->flags & TASK_FLAGS_VCPU))
+		goto out;
+
+	if (!hw->valid || (hw->icc_sre_el1 != c->icc_sre_el1))
+		write_sysreg32(c->icc_sre_el1, ICC_SRE_EL1);
+	if (!hw->valid || (hw->ich_vmcr_el2 != c->ich_vmcr_el2))
+		write_sysreg32(c->ich_vmcr_el2, ICH_VMCR_EL2);
+	if (!hw->valid || (hw->ich_hcr_el2 != c->ich_hcr_el2))
+		write_sysreg32(c->ich_hcr_el2, ICH_HCR_EL2);
+
+	hw->icc_sre_el1 = c->icc_sre_el1;
+	hw->ich_vmcr_el2 = c->ich_vmcr_el2;
+	hw->ich_hcr_el2 = c->ich_hcr_el2;
+	hw->valid = 1;
+out:
 	dsb();
 }
 
@@ -97,9 +97,14 @@ static int virtio_mmio_write(struct vdev *vdev, gp_regs *regs,
 		break;
 	case VIRTIO_MMIO_QUEUE_NOTIFY:
 		/*
-		 * indicate a queue is ready, need send a
-		 * event to hvm ?
+		 * indicate a queue is ready, kick the hvm by the
+		 * ioevent if the queue has registered one, otherwise
+		 * post the event to the hvm and return to the guest
+		 * directly
 		 */
+		if (vm_signal_ioevent(vdev->vm, address, value))
+			break;
+
 		trap_mmio_write_nonblock(address, write_value);
 		break;
 	case VIRTIO_MMIO_STATUS:
@@ -107,7 +112,13 @@ static int virtio_mmio_write(struct vdev *vdev, gp_regs *regs,
 		value = value - tmp;
 		*write_value = value;
 		iowrite32(value, iomem + VIRTIO_MMIO_STATUS);
-		trap_mmio_write(address, write_value);
+
+		/*
+		 * the status change is posted to the vmcs ring, the
+		 * following blocking trap such as QUEUE_READY will
+		 * wait until it has been handled by the mvm
+		 */
+		trap_mmio_write_nonblock(address, write_value);
 		break;
 	case VIRTIO_MMIO_QUEUE_DESC_LOW:
 		iowrite32(value, iomem + VIRTIO_MMIO_QUEUE_DESC_LOW);
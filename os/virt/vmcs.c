@@ -21,13 +21,42 @@
 #include <minos/irq.h>
 #include <virt/vmcs.h>
 
+static inline int vmcs_need_sched(struct vcpu *vcpu, struct vm *vm0)
+{
+	/*
+	 * if the gvm's vcpu is on the same pcpu which the
+	 * hvm's vcpu affinity to, need to call sched() to
+	 * let the hvm's vcpu run in case of dead lock
+	 */
+	return (vcpu_affinity(vcpu) < vm0->vcpu_nr);
+}
+
+static void vmcs_wait_complete(struct vcpu *vcpu,
+		struct vm *vm0, uint64_t index)
+{
+	struct vmcs *vmcs = vcpu->vmcs;
+
+	while ((int64_t)(vmcs->guest_index - index) <= 0) {
+		if (vmcs_need_sched(vcpu, vm0))
+			sched();
+		else
+			cpu_relax();
+	}
+
+	rmb();
+}
+
 int __vcpu_trap(uint32_t type, uint32_t reason, unsigned long data,
 		unsigned long *result, int nonblock)
 {
+	int ret = 0;
+	uint64_t index;
 	unsigned long flags;
+	struct vmcs_trap *trap;
 	struct vcpu *vcpu = get_current_vcpu();
 	struct vmcs *vmcs = vcpu->vmcs;
 	struct vm *vm0 = get_vm_by_id(0);
+	unsigned long start = get_sys_ticks();
 
 	if (vcpu->vmcs_irq < 0) {
 		pr_err("no hvm irq for this vcpu\n");
@@ -39,73 +68,62 @@ int __vcpu_trap(uint32_t type, uint32_t reason, unsigned long data,
 		return -EINVAL;
 
 	/*
-	 * enable the interrupt in case the vm0 shutdown
-	 * or reboot this vm when the vm is waitting for
-	 * vmcs ack
+	 * wait for a free slot in the trap ring, the slot is
+	 * reserved and posted with the interrupt disabled since
+	 * a timer or virq handler on this pcpu may also post a
+	 * trap for this vcpu. when waiting enable the interrupt
+	 * in case the vm0 shutdown or reboot this vm
 	 */
 	local_irq_save(flags);
-	local_irq_enable();
 
-	/*
-	 * wait for the last trap complete, if the gvm
-	 * has the same affinity pcpu with the vm0, need
-	 * to use sched() in case of dead lock
-	 */
-	while (vmcs->guest_index != vmcs->host_index) {
-		if (vcpu_affinity(vcpu) < vcpu_affinity(vm0->vcpus[0]))
+	while ((vmcs->host_index - vmcs->guest_index) >= VMCS_RING_SIZE) {
+		local_irq_enable();
+		if (vmcs_need_sched(vcpu, vm0))
 			sched();
 		else
 			cpu_relax();
+		local_irq_disable();
 	}
 
-	vmcs->trap_type = type;
-	vmcs->trap_reason = reason;
-	vmcs->trap_data = data;
-	vmcs->trap_ret = 0;
+	index = vmcs->host_index;
+	trap = &vmcs->ring[index & VMCS_RING_MASK];
+	trap->trap_type = type;
+	trap->trap_reason = reason;
+	trap->trap_data = data;
+	trap->trap_ret = 0;
+	trap->trap_flags = nonblock ? VMCS_TRAP_F_NONBLOCK : 0;
 	if (result)
-		vmcs->trap_result = *result;
+		trap->trap_result = *result;
 	else
-		vmcs->trap_result = 0;
+		trap->trap_result = 0;
 
 	/*
-	 * increase the host index of the vmcs, then send the
-	 * virq to the vcpu0 of the vm0
+	 * increase the host index of the vmcs, only need to
+	 * send the virq to the vcpu0 of the vm0 when the ring
+	 * was drained by the mvm, otherwise the mvm is still
+	 * processing the ring and will see this trap
 	 */
-	vmcs->host_index++;
+	wmb();
+	vmcs->host_index = index + 1;
 	mb();
 
-	if (send_virq_to_vm(vm0, vcpu->vmcs_irq)) {
+	if ((vmcs->guest_index == index) &&
+			send_virq_to_vm(vm0, vcpu->vmcs_irq)) {
 		pr_err("vmcs failed to send virq for vm-%d\n",
 				vcpu->vm->vmid);
-		vmcs->host_index--;
-		vmcs->trap_ret = -EPERM;
-		vmcs->trap_result = 0;
+		vmcs->host_index = index;
 		mb();
+		local_irq_restore(flags);
 		return -EFAULT;
 	}
 
-	/*
-	 * if vcpu's pcpu is equal the vm0_vcpu0's pcpu
-	 * force to block
-	 */
-	if (vcpu_affinity(vcpu) == vcpu_affinity(vm0->vcpus[0]))
-		nonblock = 0;
+	local_irq_enable();
 
-	/*
-	 * if gvm's vcpu is on the same pcpu which hvm
-	 * affnity, then need to call sched to sched the
-	 * hvm's vcpu in case of dead lock
-	 */
 	if (!nonblock) {
-		while (vmcs->guest_index != vmcs->host_index) {
-			if (vcpu_affinity(vcpu) < vm0->vcpu_nr)
-				sched();
-			else
-				cpu_relax();
-		}
-
+		vmcs_wait_complete(vcpu, vm0, index);
+		ret = trap->trap_ret;
 		if (result)
-			*result = vmcs->trap_result;
+			*result = trap->trap_result;
 	} else {
 		if (result)
 			*result = 0;
@@ -113,7 +131,13 @@ int __vcpu_trap(uint32_t type, uint32_t reason, unsigned long data,
 
 	local_irq_restore(flags);
 
-	return vmcs->trap_ret;
+	if (vcpu->stats && (type == VMTRAP_TYPE_MMIO)) {
+		vcpu->stats->mmio_traps++;
+		vcpu_stat_hist(vcpu->stats->mmio_hist,
+				get_sys_ticks() - start);
+	}
+
+	return ret;
 }
 
 int setup_vmcs_data(void *data, size_t size)
@@ -137,6 +161,7 @@ static void vcpu_vmcs_init(struct vcpu *vcpu)
 	}
 
 	vmcs->vcpu_id = get_vcpu_id(vcpu);
+	vmcs->ring_size = VMCS_RING_SIZE;
 }
 
 unsigned long vm_create_vmcs(struct vm *vm)
@@ -528,7 +528,7 @@ static int __vm_unmap(struct mm_struct *mm0, struct vmm_area *va)
 
 	spin_unlock(&mm0->mm_lock);
 
-	flush_local_tlb_guest();
+	flush_guest_tlb_range(mm0, va->start, va->size);
 
 	return 0;
 }
@@ -642,6 +642,31 @@ unsigned long create_hvm_iomem_map(struct vm *vm,
 	return va->start;
 }
 
+/*
+ * unmap the iomem which mapped by create_hvm_iomem_map
+ * the memory itself is freed by the caller
+ */
+void destroy_hvm_iomem_map(unsigned long vir, uint32_t size)
+{
+	struct vm *vm0 = get_vm_by_id(0);
+	struct mm_struct *mm = &vm0->mm;
+	struct vmm_area *va;
+
+	spin_lock(&mm->vmm_area_lock);
+
+	list_for_each_entry(va, &mm->vmm_area_used, list) {
+		if ((va->start != vir) || !(va->flags & VM_MAP_P2P))
+			continue;
+
+		destroy_guest_mapping(mm, va->start, va->size);
+		list_del(&va->list);
+		add_free_vmm_area(mm, va);
+		break;
+	}
+
+	spin_unlock(&mm->vmm_area_lock);
+}
+
 /*
  * map VMx virtual memory to hypervisor memory
  * space to let hypervisor can access guest vm's
@@ -726,8 +751,7 @@ static int __vm_mmap(struct mm_struct *mm, unsigned long hvm_mmap_base,
 		left -= count;
 	}
 
-	/* this function always run in vm0 */
-	flush_local_tlb_guest();
+	flush_guest_tlb_range(mm0, hvm_mmap_base, size);
 	flush_icache_all();
 
 	return 0;